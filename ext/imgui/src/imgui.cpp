@@ -60,12 +60,12 @@ struct hut_imgui_impl_ctx {
   display *display_ = nullptr;
   window  *window_  = nullptr;
 
-  shared_buffer                   buffer_;
-  shared_ubo                      ubo_;
-  std::unique_ptr<imgui_pipeline> pipeline_;
-  std::vector<hut_imgui_mesh>     meshes_;
-  std::vector<tex_binding>        bindings_;
-  std::vector<size_t>             reusable_bindings_ids_;
+  shared_buffer                            buffer_;
+  shared_ubo                               ubo_;
+  std::unique_ptr<imgui_pipeline>          pipeline_;
+  std::vector<std::vector<hut_imgui_mesh>> meshes_;  // Per frame slot, kept until the slot's frame is done
+  std::vector<tex_binding>                 bindings_;
+  std::vector<size_t>                      reusable_bindings_ids_;
 
   display::time_point last_frame_;
   std::string         clipboard_buffer_;
@@ -185,7 +185,11 @@ void render(VkCommandBuffer _cmd_buffer, ImDrawData *_draw_data) {
   ImGuiIO            &io    = ImGui::GetIO();
   hut_imgui_impl_ctx &ctx   = *static_cast<hut_imgui_impl_ctx *>(io.BackendRendererUserData);
   auto               &scale = _draw_data->FramebufferScale;
-  ctx.meshes_.clear();
+
+  // The window waited for the previous frame of this slot, that was the last one to read its meshes
+  ctx.meshes_.resize(ctx.window_->frames_in_flight());
+  auto &meshes = ctx.meshes_[ctx.window_->frame_index()];
+  meshes.clear();
 
   ctx.pipeline_->bind_pipeline(_cmd_buffer);
   auto last_bound_set = NUMAX<size_t>;
@@ -228,7 +232,7 @@ void render(VkCommandBuffer _cmd_buffer, ImDrawData *_draw_data) {
       }
     }
 
-    ctx.meshes_.emplace_back(std::move(m));
+    meshes.emplace_back(std::move(m));
   }
 
   // Reset scissor
@@ -256,7 +260,7 @@ bool create_device_objects() {
   image_params  atlas_params;
   atlas_params.size_   = {width, height};
   atlas_params.format_ = VK_FORMAT_R8G8B8A8_UNORM;
-  auto image           = image::load_raw(*ctx.display_, ctx.buffer_, pixels, width * 4, atlas_params);
+  auto image           = image::load_raw(*ctx.display_, pixels, width * 4, atlas_params);
   auto samp            = std::make_shared<sampler>(*ctx.display_);
   io.Fonts->TexID      = add_image(image, samp);
 
@@ -7,10 +7,9 @@
 using namespace hut;
 
 TEST(ktx2, tex_rgba8888_ktx2) {
-  display       d("ktx2");
-  shared_buffer b = std::make_shared<buffer>(d);
+  display d("ktx2");
 
-  auto result = ktx::load(d, b, tst_data::tex_rgba8888_ktx2);
+  auto result = ktx::load(d, tst_data::tex_rgba8888_ktx2);
   d.flush_staged();
 
   ASSERT_TRUE(result.has_value());
@@ -22,12 +21,11 @@ TEST(ktx2, tex_rgba8888_ktx2) {
 }
 
 TEST(ktx2, tex_bc1_ktx2) {
-  display       d("ktx2");
-  shared_buffer b = std::make_shared<buffer>(d);
+  display d("ktx2");
 
   ktx::load_params kparams;
   kparams.tiling_ = VK_IMAGE_TILING_OPTIMAL;
-  auto result     = ktx::load(d, b, tst_data::tex_bc1_ktx2, kparams);
+  auto result     = ktx::load(d, tst_data::tex_bc1_ktx2, kparams);
   d.flush_staged();
 
   ASSERT_TRUE(result.has_value());
@@ -39,12 +37,11 @@ TEST(ktx2, tex_bc1_ktx2) {
 }
 
 TEST(ktx2, tex_2layers_bc1_ktx2) {
-  display       d("ktx2");
-  shared_buffer b = std::make_shared<buffer>(d);
+  display d("ktx2");
 
   ktx::load_params kparams;
   kparams.tiling_ = VK_IMAGE_TILING_OPTIMAL;
-  auto result     = ktx::load(d, b, tst_data::tex_2layers_bc1_ktx2, kparams);
+  auto result     = ktx::load(d, tst_data::tex_2layers_bc1_ktx2, kparams);
   d.flush_staged();
 
   ASSERT_TRUE(result.has_value());
@@ -56,12 +53,11 @@ TEST(ktx2, tex_2layers_bc1_ktx2) {
 }
 
 TEST(ktx2, tex_cubemap_bc1_ktx2) {
-  display       d("ktx2");
-  shared_buffer b = std::make_shared<buffer>(d);
+  display d("ktx2");
 
   ktx::load_params kparams;
   kparams.tiling_ = VK_IMAGE_TILING_OPTIMAL;
-  auto result     = ktx::load(d, b, tst_data::tex_cubemap_bc1_ktx2, kparams);
+  auto result     = ktx::load(d, tst_data::tex_cubemap_bc1_ktx2, kparams);
   d.flush_staged();
 
   ASSERT_TRUE(result.has_value());
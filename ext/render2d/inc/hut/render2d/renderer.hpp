@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include <optional>
 #include <unordered_map>
 #include <utility>
 
@@ -49,6 +50,9 @@ using index = u32;
 
 using pipeline = pipeline<index, render2d_vert_spv_refl, render2d_frag_spv_refl, const shared_ubo &,
                           const shared_atlas &, const shared_sampler &>;
+// For atlases that aren't layered, samples up to 16 pages as separate descriptors, requires descriptor indexing
+using pages_pipeline = hut::pipeline<index, render2d_vert_spv_refl, render2d_pages_frag_spv_refl, const shared_ubo &,
+                                     const shared_atlas &, const shared_sampler &>;
 
 using vertex   = pipeline::vertex;
 using instance = pipeline::instance;
@@ -69,7 +73,7 @@ struct box_params {
   mode        mode_            = ROUNDED;
   uint        corner_radius_   = 0;
   uint        corner_softness_ = 0;
-  subimage   *subimg_          = nullptr;
+  subimage   *subimg_          = nullptr;  // Touched when set, pin it while the box shows it if its atlas evicts
 };
 
 inline void set(instance &_target, box_params _params) {
@@ -88,11 +92,13 @@ inline void set(instance &_target, box_params _params) {
   _target.pos_box_.y |= (_params.corner_softness_ & 0xF) << 12;
 
   if (_params.subimg_ != nullptr) {
+    _params.subimg_->touch();
     _target.uv_box_ = packSnorm<u16>(_params.subimg_->texcoords());
-    assert(_params.subimg_->page() <= 0xF);
-    _target.pos_box_.z |= (_params.subimg_->page() & 0xF) << 12;
+    assert(_params.subimg_->page() <= NUMAX<u16>);
+    _target.page_ = _params.subimg_->page();
   } else {
     _target.uv_box_ = vec4(0);
+    _target.page_   = 0;
   }
 
   assert(_params.gradient_ <= 0x3);
@@ -108,12 +114,12 @@ using render2d_suballoc = suballoc<instance, batch>;
 using render2d_updator  = buffer_updator<instance>;
 
 struct batch {
-  shared_instances        buffer_;
-  binpack::linear1d<uint> suballocator_;
+  shared_instances         buffer_;
+  binpack::dynamic1d<uint> suballocator_;
 
-  batch(shared_instances _buffer, uint _instances_count)
+  batch(shared_instances _buffer, uint _instances_count, binpack::packer1d _packer)
       : buffer_(std::move(_buffer))
-      , suballocator_(_instances_count) {}
+      , suballocator_(_packer, _instances_count) {}
 
   void                           release(render2d_suballoc *_suballoc);
   [[nodiscard]] render2d_updator update_raw_impl(uint _offset_bytes, uint _size_bytes);
@@ -140,7 +146,8 @@ public:
 };
 
 struct renderer_params : pipeline_params {
-  uint initial_batch_size_instances_ = 1024;
+  uint              initial_batch_size_instances_ = 1024;
+  binpack::packer1d packer_                       = binpack::PLINEAR1D;  // Of instances in batches
 };
 
 class renderer {
@@ -152,16 +159,27 @@ class renderer {
 
   boxes_holder allocate(uint _count);
 
+  // Instances bake the page and texcoords of their sub-image, they have to be set again once atlas::compact moved it
   batch_updators update_all();
 
  private:
   std::list<details::batch> batches_;
 
-  pipeline      pipeline_;
-  shared_buffer buffer_;
-  shared_atlas  atlas_;
+  std::optional<pipeline>       pipeline_;  // Engaged for layered atlases
+  std::optional<pages_pipeline> pages_pipeline_;
+  shared_buffer                 buffer_;
+  shared_atlas      atlas_;
+  binpack::packer1d packer_;
 
   void grow(uint _count);
+
+  template<typename TFunc>
+  void with_pipeline(TFunc &&_func) {
+    if (pipeline_)
+      _func(*pipeline_);
+    else
+      _func(*pages_pipeline_);
+  }
 };
 
 }  // namespace hut::render2d
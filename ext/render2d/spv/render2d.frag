@@ -1,9 +1,7 @@
 #version 460
 #extension GL_ARB_separate_shader_objects : enable
-#extension GL_EXT_nonuniform_qualifier : require
 
-const int samplers_pages = 16;
-layout(binding = 1) uniform sampler2D uni_samplers[samplers_pages];
+layout(binding = 1) uniform sampler2DArray uni_atlas;
 
 layout(location = 0) in flat vec4 in_box; // pos_box
 layout(location = 1) in flat uvec4 in_params; // (radius, smoothness, atlas_page, mode)
@@ -17,6 +15,7 @@ layout(location = 0) out vec4 out_col;
 const uint RENDER_GRADIENT = 0;
 const uint RENDER_BORDER = 1;
 const uint RENDER_SHADOW = 2;
+const uint INVALID_ATLAS_PAGE = 0xFFFFFFFF;
 
 float udRoundBox(vec2 _center, vec2 _half_size, float _radius) {
   return length(max(abs(_center) - _half_size + _radius, 0.f)) - _radius;
@@ -32,8 +31,8 @@ float border_distance(float _radius) {
 
 void main() {
   const uint atlas_page = in_params.z;
-  const vec4 tex_sample = (atlas_page < samplers_pages)
-    ? texture(uni_samplers[nonuniformEXT(atlas_page)], in_uv)
+  const vec4 tex_sample = (atlas_page != INVALID_ATLAS_PAGE)
+    ? texture(uni_atlas, vec3(in_uv, atlas_page))
     : vec4(1);
   const float radius = uintBitsToFloat(in_params.x);
   const float softness = uintBitsToFloat(in_params.y);
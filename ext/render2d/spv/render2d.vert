@@ -11,6 +11,7 @@ layout(location = 0) in uvec4 in_i_pos_box_r16g16b16a16_uint; // AA box (x1, y1,
 layout(location = 1) in vec4 in_i_uv_box_r16g16b16a16_unorm; // AA box (x1, y1, x2, y2)
 layout(location = 2) in vec4 in_i_col_from_r8g8b8a8_unorm;
 layout(location = 3) in vec4 in_i_col_to_r8g8b8a8_unorm;
+layout(location = 4) in uint in_i_page_r16_uint; // Layer of the atlas
 
 layout(location = 0) out flat vec4 out_box;
 layout(location = 1) out flat uvec4 out_params; // (radius, softness, atlas_page, mode)
@@ -24,7 +25,7 @@ out gl_PerVertex {
 /*
   4 MSBits of pos.x: round corner radius (4px per step)
   4 MSBits of pos.y: round corner softness (2px per step)
-  4 MSBits of pos.z: atlas page
+  4 MSBits of pos.z: unused
   4 MSBits of pos.w: 2bits for render mode, next 2 bits is gradient mode
 */
 
@@ -46,7 +47,7 @@ void main() {
 
   out_params.x = floatBitsToUint(radius);
   out_params.y = floatBitsToUint(softness);
-  out_params.z = uv_box == vec4(0, 0, 0, 0) ? INVALID_ATLAS_PAGE : (in_i_pos_box_r16g16b16a16_uint.z >> 12 & 0x7);
+  out_params.z = uv_box == vec4(0, 0, 0, 0) ? INVALID_ATLAS_PAGE : in_i_page_r16_uint;
 
   const uint border_gradient = in_i_pos_box_r16g16b16a16_uint.w >> 12;
   const uint gradient = border_gradient & 0x3;
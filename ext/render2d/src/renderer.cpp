@@ -33,38 +33,46 @@ namespace hut::render2d {
 
 renderer::renderer(render_target &_target, shared_buffer _buffer, const shared_ubo &_ubo, shared_atlas _atlas,
                    const shared_sampler &_sampler, renderer_params _params)
-    : pipeline_(_target, _params)
-    , buffer_(std::move(_buffer))
-    , atlas_(std::move(_atlas)) {
-  const auto &features12 = _target.parent().features12();
-  if (features12.shaderSampledImageArrayNonUniformIndexing == VK_FALSE
-      || features12.descriptorBindingPartiallyBound == VK_FALSE)
-    throw std::runtime_error("vulkan device does not meet minimum requirements for render2d renderer");
+    : buffer_(std::move(_buffer))
+    , atlas_(std::move(_atlas))
+    , packer_(_params.packer_) {
+  if (atlas_->layered()) {
+    pipeline_.emplace(_target, _params);
+  } else {
+    const auto &features12 = _target.parent().features12();
+    if (features12.shaderSampledImageArrayNonUniformIndexing == VK_FALSE
+        || features12.descriptorBindingPartiallyBound == VK_FALSE)
+      throw std::runtime_error("vulkan device does not meet minimum requirements for render2d renderer");
+    pages_pipeline_.emplace(_target, _params);
+  }
   if (_params.initial_batch_size_instances_ > 0)
     grow(_params.initial_batch_size_instances_);
-  pipeline_.write(0, _ubo, atlas_, _sampler);
+  with_pipeline([&](auto &_pipeline) { _pipeline.write(0, _ubo, atlas_, _sampler); });
 }
 
 void renderer::grow(uint _instances_count) {
-  batches_.emplace_back(buffer_->allocate<instance>(_instances_count), _instances_count);
+  batches_.emplace_back(buffer_->allocate<instance>(_instances_count), _instances_count, packer_);
   batches_.back().buffer_->zero();
 }
 
 void renderer::draw(VkCommandBuffer _buffer) {
-  pipeline_.update_atlas(0, atlas_);
-  pipeline_.bind_pipeline(_buffer);
-  pipeline_.bind_descriptor(_buffer, 0);
-  for (const auto &batch : batches_) {
-    if (batch.suballocator_.empty())
-      continue;
-    pipeline_.bind_instances(_buffer, batch.buffer_);
-
-    constexpr bool OPTIMIZE = true;
-    const uint     lower    = OPTIMIZE ? batch.suballocator_.lower_bound() : 0;
-    const uint     upper    = OPTIMIZE ? batch.suballocator_.upper_bound() : batch.suballocator_.capacity();
-    assert(upper >= lower);
-    pipeline_.draw(_buffer, 6, upper - lower, 0, lower);
-  }
+  assert(atlas_->layered() || atlas_->page_count() <= 16);
+  with_pipeline([this, _buffer](auto &_pipeline) {
+    _pipeline.update_atlas(0, atlas_);
+    _pipeline.bind_pipeline(_buffer);
+    _pipeline.bind_descriptor(_buffer, 0);
+    for (const auto &batch : batches_) {
+      if (batch.suballocator_.empty())
+        continue;
+      _pipeline.bind_instances(_buffer, batch.buffer_);
+
+      constexpr bool OPTIMIZE = true;
+      const uint     lower    = OPTIMIZE ? batch.suballocator_.lower_bound() : 0;
+      const uint     upper    = OPTIMIZE ? batch.suballocator_.upper_bound() : batch.suballocator_.capacity();
+      assert(upper >= lower);
+      _pipeline.draw(_buffer, 6, upper - lower, 0, lower);
+    }
+  });
 }
 
 boxes_holder renderer::allocate(uint _instances_count) {
@@ -94,7 +102,7 @@ batch_updators renderer::update_all() {
   result.updators_.reserve(batches_.size());
 
   for (auto &batch : batches_)
-    result.updators_.emplace(&batch, batch.buffer_->update());
+    result.updators_.emplace(&batch, batch.buffer_->update_staged());
 
   return result;
 }
@@ -108,11 +116,11 @@ void batch::release(render2d_suballoc *_suballoc) {
 }
 
 render2d_updator batch::update_raw_impl(uint _offset_bytes, uint _size_bytes) {
-  return buffer_->update_raw(_offset_bytes, _size_bytes);
+  return buffer_->update_staged_raw(_offset_bytes, _size_bytes);
 }
 
 void batch::zero_raw(uint _offset_bytes, uint _size_bytes) {
-  buffer_->zero_raw(_offset_bytes, _size_bytes);
+  buffer_->zero_staged_raw(_offset_bytes, _size_bytes);
 }
 
 }  // namespace details
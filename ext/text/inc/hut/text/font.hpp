@@ -68,6 +68,7 @@ class font {
 
   uint  char_index(char32_t _unichar);
   glyph load(const shared_atlas &_atlas, uint _char_index, render_mode _rmode = render_mode::NORMAL);
+  void  forget(std::span<const shared_subimage> _evicted);  // Drops the cache entries of evicted glyphs
 
   void reset_to_size(const u16_px &_size);
 
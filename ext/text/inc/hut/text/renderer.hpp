@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include <optional>
 #include <unordered_map>
 
 #include "hut/text/font.hpp"
@@ -44,6 +45,9 @@ using string_hash = size_t;
 
 using glyph_pipeline = pipeline<index_t, glyph_vert_spv_refl, glyph_frag_spv_refl, const shared_ubo &,
                                 const shared_atlas &, const shared_sampler &>;
+// For atlases that aren't layered, samples up to 16 pages as separate descriptors, requires descriptor indexing
+using glyph_pages_pipeline = pipeline<index_t, glyph_vert_spv_refl, glyph_pages_frag_spv_refl, const shared_ubo &,
+                                      const shared_atlas &, const shared_sampler &>;
 
 using vertex   = glyph_pipeline::vertex;
 using instance = glyph_pipeline::instance;
@@ -61,17 +65,17 @@ using text_suballoc = suballoc<instance, batch>;
 using text_updator  = buffer_updator<instance>;
 
 struct mesh_store {
-  shared_vertices         vertices_;
-  shared_indices          indices_;
-  binpack::linear1d<uint> suballocator_;
+  shared_vertices          vertices_;
+  shared_indices           indices_;
+  binpack::dynamic1d<uint> suballocator_;
 
   explicit mesh_store(renderer *_parent, uint _size);
 };
 
 struct draw_store {
-  shared_instances        instances_;
-  shared_indexed_commands commands_;
-  binpack::linear1d<uint> suballocator_;
+  shared_instances         instances_;
+  shared_indexed_commands  commands_;
+  binpack::dynamic1d<uint> suballocator_;
 
   std::unique_ptr<VkDrawIndexedIndirectCommand[]> commands_fallback_;
 
@@ -79,12 +83,25 @@ struct draw_store {
 };
 
 struct word {
-  uint       alloc_;
-  uint       glyphs_    = 0;
-  uint       ref_count_ = 0;
-  i16vec4_px bbox_;
+  uint                         alloc_;
+  uint                         codepoints_;
+  uint                         glyphs_    = 0;
+  uint                         ref_count_ = 0;
+  i16vec4_px                   bbox_;
+  std::u8string                text_;
+  std::vector<shared_subimage> subimages_;  // Pinned while the word lives, so that the atlas doesn't evict them
 
   word(renderer *_parent, batch &_batch, uint _alloc, uint _codepoints, std::u8string_view _text);
+  ~word();
+
+  word(const word &)            = delete;
+  word &operator=(const word &) = delete;
+
+  word(word &&) noexcept            = default;
+  word &operator=(word &&) noexcept = delete;
+
+  void               shape(renderer *_parent, batch &_batch);  // Writes the quads of the glyphs in the mesh store
+  [[nodiscard]] bool uses(std::span<const shared_subimage> _glyphs) const;
 };
 
 struct batch {
@@ -168,8 +185,9 @@ public:
 };
 
 struct renderer_params : pipeline_params {
-  uint initial_mesh_store_size_ = 8 * 1024;
-  uint initial_draw_store_size_ = 1024;
+  uint              initial_mesh_store_size_ = 8 * 1024;
+  uint              initial_draw_store_size_ = 1024;
+  binpack::packer1d packer_                  = binpack::PLINEAR1D;  // Of glyphs and words in mesh and draw stores
 };
 
 class renderer {
@@ -188,15 +206,35 @@ class renderer {
 
   batch_updators update_all();
 
+  // Shapes again the words using glyphs that were evicted, or moved by atlas::compact. allocate and update_all refresh
+  // first, otherwise call it once the atlas was compacted, before recording.
+  void refresh();
+
  private:
-  glyph_pipeline pipeline_;
-  shared_buffer  buffer_;
-  shared_atlas   atlas_;
-  shaper         shaper_;
+  std::optional<glyph_pipeline>       pipeline_;  // Engaged for layered atlases
+  std::optional<glyph_pages_pipeline> pages_pipeline_;
+  shared_buffer                       buffer_;
+  shared_atlas                        atlas_;
+  shaper                              shaper_;
+
+  template<typename TFunc>
+  void with_pipeline(TFunc &&_func) {
+    if (pipeline_)
+      _func(*pipeline_);
+    else
+      _func(*pages_pipeline_);
+  }
 
   std::list<details::batch> batches_;
 
-  bool use_indirect_fallback_;
+  // Glyphs evicted from the atlas, words still using them are shaped again on the next allocate or update_all. Shared
+  // with the eviction callback, as the atlas may outlive the renderer.
+  std::shared_ptr<std::vector<shared_subimage>> evicted_ = std::make_shared<std::vector<shared_subimage>>();
+  void                                          refresh_evicted();
+  u64                                           atlas_generation_;  // Of the atlas texcoords words were shaped with
+
+  bool              use_indirect_fallback_;
+  binpack::packer1d packer_;
 
   details::batch &grow(uint _mesh_store_size, uint _draw_store_size);
 
@@ -59,9 +59,11 @@ class shaper {
   explicit shaper(shared_font _font, render_mode _rmode = shaper::render_mode::NORMAL);
   ~shaper();
 
-  using shape_callback = std::function<void(uint /*index*/, i16vec4_px /*quad*/, vec4 /*uv*/, uint /*atlas_page*/)>;
+  using shape_callback = std::function<void(uint /*index*/, i16vec4_px /*quad*/, const shared_subimage & /*glyph*/)>;
   void shape(const shared_atlas &_atlas, std::u8string_view _text, const shape_callback &_cb);
 
+  [[nodiscard]] const shared_font &font() const { return font_; }
+
  private:
   hb_buffer_t *buffer_ = nullptr;
   shared_font  font_;
@@ -0,0 +1,19 @@
+#version 460
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_EXT_nonuniform_qualifier : require
+
+// Same as glyph.frag, for atlases that aren't layered: each page is its own descriptor
+layout(binding = 1) uniform sampler2D uni_samplers[16];
+
+layout(location = 0) in vec4 in_col;
+layout(location = 1) in vec2 in_uv;
+layout(location = 2) in flat uint in_page;
+
+layout(location = 0) out vec4 out_col;
+
+void main() {
+  const vec4 tex = texture(uni_samplers[nonuniformEXT(in_page)], in_uv);
+
+  out_col = in_col;
+  out_col.a *= tex.r;
+}
@@ -29,6 +29,7 @@
 
 #include <cstddef>
 
+#include <algorithm>
 #include <iostream>
 
 #include <ft2build.h>
@@ -157,10 +158,21 @@ font::glyph font::load(const shared_atlas &_atlas, uint _char_index, render_mode
     auto result = cache_.emplace(_char_index, load_internal(_atlas, _char_index, _rmode));
     assert(result.second);
     it = result.first;
+  } else if (it->second.subimage_ && !it->second.subimage_->valid()) {
+    it->second = load_internal(_atlas, _char_index, _rmode);  // Evicted from the atlas, raster it again
+  } else if (it->second.subimage_) {
+    it->second.subimage_->touch();
   }
   return it->second;
 }
 
+void font::forget(std::span<const shared_subimage> _evicted) {
+  std::unique_lock lk{mutex_};
+  std::erase_if(cache_, [_evicted](const auto &_entry) {
+    return std::ranges::find(_evicted, _entry.second.subimage_) != _evicted.end();
+  });
+}
+
 void font::reset_to_size(const u16_px &_size) {
   HUT_PROFILE_SCOPE(PFONT, "font::font::reset_to_size")
   std::unique_lock lk{mutex_};
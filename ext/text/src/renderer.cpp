@@ -27,6 +27,7 @@
 
 #include "hut/text/renderer.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <span>
@@ -40,40 +41,13 @@
 
 namespace hut::text {
 
-ivec2 encode_atlas_page_xy(vec2 _in, uint _atlas_page) {
-  assert(_atlas_page < 4);
-  switch (_atlas_page) {
-    case 0:
-      _in.x *= +1;
-      _in.y *= +1;
-      break;
-    case 1:
-      _in.x *= +1;
-      _in.y *= -1;
-      break;
-    case 2:
-      _in.x *= -1;
-      _in.y *= +1;
-      break;
-    case 3:
-      _in.x *= -1;
-      _in.y *= -1;
-      break;
-    default: throw std::runtime_error("not enough bits to encode atlas page in uv signs");
-  }
-  assert(_in.x < NUMAX<i16>);
-  assert(_in.x > NUMIN<i16>);
-  assert(_in.y < NUMAX<i16>);
-  assert(_in.y > NUMIN<i16>);
-  return packSnorm<i16>(_in);
-}
-
 renderer::renderer(render_target &_target, shared_buffer _buffer, const shared_font &_font, const shared_ubo &_ubo,
                    shared_atlas _atlas, const shared_sampler &_sampler, renderer_params _params)
-    : pipeline_(_target, _params)
-    , buffer_(std::move(_buffer))
+    : buffer_(std::move(_buffer))
     , atlas_(std::move(_atlas))
-    , shaper_(_font) {
+    , shaper_(_font)
+    , atlas_generation_(atlas_->generation())
+    , packer_(_params.packer_) {
   const auto &features   = _target.parent().features();
   use_indirect_fallback_ = features.multiDrawIndirect != VK_TRUE || features.drawIndirectFirstInstance != VK_TRUE;
   if (use_indirect_fallback_) {
@@ -81,16 +55,54 @@ renderer::renderer(render_target &_target, shared_buffer _buffer, const shared_f
               << " (multiDrawIndirect: " << features.multiDrawIndirect
               << ", drawIndirectFirstInstance: " << features.drawIndirectFirstInstance << ")" << std::endl;
   }
-  const auto &features12 = _target.parent().features12();
-  if (features12.shaderSampledImageArrayNonUniformIndexing == VK_FALSE
-      || features12.descriptorBindingPartiallyBound == VK_FALSE)
-    throw std::runtime_error("vulkan device does not meet minimum requirements for text renderer");
+  if (atlas_->layered()) {
+    pipeline_.emplace(_target, _params);
+  } else {
+    const auto &features12 = _target.parent().features12();
+    if (features12.shaderSampledImageArrayNonUniformIndexing == VK_FALSE
+        || features12.descriptorBindingPartiallyBound == VK_FALSE)
+      throw std::runtime_error("vulkan device does not meet minimum requirements for text renderer");
+    pages_pipeline_.emplace(_target, _params);
+  }
 
-  constexpr u16_px MAX_ATLAS_BOUNDS = 32_px * 1024;
-  assert(atlas_->size().x <= MAX_ATLAS_BOUNDS && atlas_->size().y <= MAX_ATLAS_BOUNDS);
   if (_params.initial_mesh_store_size_ > 0 && _params.initial_draw_store_size_ > 0)
     grow(_params.initial_mesh_store_size_, _params.initial_draw_store_size_);
-  pipeline_.write(0, _ubo, atlas_, _sampler);
+  with_pipeline([&](auto &_pipeline) { _pipeline.write(0, _ubo, atlas_, _sampler); });
+
+  // Only recorded here, the font is locked and the atlas allocating while it fires
+  atlas_->on_evict_.connect([evicted = std::weak_ptr{evicted_}](const shared_subimage &_glyph) {
+    if (auto locked = evicted.lock())
+      locked->emplace_back(_glyph);
+    return false;
+  });
+}
+
+void renderer::refresh_evicted() {
+  if (evicted_->empty())
+    return;
+  std::vector<shared_subimage> evicted;
+  evicted.swap(*evicted_);  // Shaping again may evict more glyphs, handled next time
+
+  shaper_.font()->forget(evicted);
+  for (auto &batch : batches_) {
+    for (auto &[hash, word] : batch.cache_) {
+      if (word.uses(evicted))
+        word.shape(this, batch);
+    }
+  }
+}
+
+void renderer::refresh() {
+  refresh_evicted();
+  if (atlas_generation_ == atlas_->generation())
+    return;
+
+  // The glyphs may have moved, every word is shaped again with their new texcoords
+  atlas_generation_ = atlas_->generation();
+  for (auto &batch : batches_) {
+    for (auto &[hash, word] : batch.cache_)
+      word.shape(this, batch);
+  }
 }
 
 renderer::words_info::words_info(std::span<const std::u8string_view> _words)
@@ -108,31 +120,35 @@ renderer::words_info::words_info(std::span<const std::u8string_view> _words)
 }
 
 void renderer::draw(VkCommandBuffer _buff) {
-  pipeline_.bind_pipeline(_buff);
-  pipeline_.bind_descriptor(_buff, 0);
-  for (const auto &batch : batches_) {
-    if (batch.dstore_.suballocator_.empty())
-      continue;
-
-    pipeline_.bind_indices(_buff, batch.mstore_.indices_);
-    pipeline_.bind_vertices(_buff, batch.mstore_.vertices_);
-    pipeline_.bind_instances(_buff, batch.dstore_.instances_);
-
-    constexpr bool OPTIMIZE = true;
-    const uint     lower    = OPTIMIZE ? batch.dstore_.suballocator_.lower_bound() : 0;
-    const uint upper = OPTIMIZE ? batch.dstore_.suballocator_.upper_bound() : batch.dstore_.suballocator_.capacity();
-    assert(upper >= lower);
-    if (!use_indirect_fallback_) {
-      pipeline_.draw_indexed(_buff, batch.dstore_.commands_, upper - lower, lower,
-                             sizeof(VkDrawIndexedIndirectCommand));
-    } else {
-      for (uint i = lower; i < upper; i++) {
-        auto &command = batch.dstore_.commands_fallback_[i];
-        pipeline_.draw_indexed(_buff, command.indexCount, command.instanceCount, command.firstIndex,
-                               command.vertexOffset, command.firstInstance);
+  assert(atlas_->layered() || atlas_->page_count() <= 16);
+  with_pipeline([this, _buff](auto &_pipeline) {
+    _pipeline.update_atlas(0, atlas_);
+    _pipeline.bind_pipeline(_buff);
+    _pipeline.bind_descriptor(_buff, 0);
+    for (const auto &batch : batches_) {
+      if (batch.dstore_.suballocator_.empty())
+        continue;
+
+      _pipeline.bind_indices(_buff, batch.mstore_.indices_);
+      _pipeline.bind_vertices(_buff, batch.mstore_.vertices_);
+      _pipeline.bind_instances(_buff, batch.dstore_.instances_);
+
+      constexpr bool OPTIMIZE = true;
+      const uint     lower    = OPTIMIZE ? batch.dstore_.suballocator_.lower_bound() : 0;
+      const uint upper = OPTIMIZE ? batch.dstore_.suballocator_.upper_bound() : batch.dstore_.suballocator_.capacity();
+      assert(upper >= lower);
+      if (!use_indirect_fallback_) {
+        _pipeline.draw_indexed(_buff, batch.dstore_.commands_, upper - lower, lower,
+                               sizeof(VkDrawIndexedIndirectCommand));
+      } else {
+        for (uint i = lower; i < upper; i++) {
+          auto &command = batch.dstore_.commands_fallback_[i];
+          _pipeline.draw_indexed(_buff, command.indexCount, command.instanceCount, command.firstIndex,
+                                 command.vertexOffset, command.firstInstance);
+        }
       }
     }
-  }
+  });
 }
 
 details::batch &renderer::grow(uint _mesh_store_size, uint _draw_store_size) {
@@ -147,6 +163,7 @@ details::batch &renderer::grow(uint _mesh_store_size, uint _draw_store_size) {
 }
 
 words_holder renderer::allocate(std::span<const std::u8string_view> _words) {
+  refresh();
   words_info winfo{_words};
   auto      &best_batch = find_best_fit(winfo);
 
@@ -154,7 +171,7 @@ words_holder renderer::allocate(std::span<const std::u8string_view> _words) {
   assert(draw_alloc);
 
   if (!use_indirect_fallback_) {
-    auto  cupdator     = best_batch.dstore_.commands_->update(*draw_alloc, _words.size());
+    auto  cupdator     = best_batch.dstore_.commands_->update_staged(*draw_alloc, _words.size());
     auto *commands_ptr = reinterpret_cast<VkDrawIndexedIndirectCommand *>(cupdator.staging().data());
     return prepare_commands(_words, winfo, best_batch, *draw_alloc, commands_ptr);
   } else {
@@ -229,11 +246,12 @@ std::span<instance> batch_updators::locate(const words_holder &_holder) {
 }
 
 batch_updators renderer::update_all() {
+  refresh();
   batch_updators result;
   result.updators_.reserve(batches_.size());
 
   for (auto &batch : batches_)
-    result.updators_.emplace(&batch, batch.dstore_.instances_->update());
+    result.updators_.emplace(&batch, batch.dstore_.instances_->update_staged());
 
   return result;
 }
@@ -243,12 +261,12 @@ namespace details {
 mesh_store::mesh_store(renderer *_parent, uint _size)
     : vertices_(_parent->buffer_->allocate<vertex>(_size * 4))
     , indices_(_parent->buffer_->allocate<index_t>(_size * 6))
-    , suballocator_(_size) {
+    , suballocator_(_parent->packer_, _size) {
 }
 
 draw_store::draw_store(renderer *_parent, uint _size)
     : instances_(_parent->buffer_->allocate<instance>(_size))
-    , suballocator_(_size) {
+    , suballocator_(_parent->packer_, _size) {
   if (!_parent->use_indirect_fallback_) {
     commands_ = _parent->buffer_->allocate<VkDrawIndexedIndirectCommand>(_size);
     commands_->zero();
@@ -260,23 +278,41 @@ draw_store::draw_store(renderer *_parent, uint _size)
 
 word::word(renderer *_parent, batch &_batch, uint _alloc, uint _codepoints, std::u8string_view _text)
     : alloc_(_alloc)
-    , bbox_(NUMAX<f32>, NUMAX<f32>, NUMIN<f32>, NUMIN<f32>) {
-  const auto vertices_offset = 4 * _alloc;
-  const auto vertices_size   = 4 * _codepoints;
-  const auto indices_offset  = 6 * _alloc;
-  const auto indices_size    = 6 * _codepoints;
+    , codepoints_(_codepoints)
+    , text_(_text) {
+  shape(_parent, _batch);
+}
+
+word::~word() {
+  for (auto &subimage : subimages_)
+    subimage->unpin();
+}
 
-  auto vupdator = _batch.mstore_.vertices_->update(vertices_offset, vertices_size);
-  auto iupdator = _batch.mstore_.indices_->update(indices_offset, indices_size);
+void word::shape(renderer *_parent, batch &_batch) {
+  const auto vertices_offset = 4 * alloc_;
+  const auto vertices_size   = 4 * codepoints_;
+  const auto indices_offset  = 6 * alloc_;
+  const auto indices_size    = 6 * codepoints_;
+
+  auto vupdator = _batch.mstore_.vertices_->update_staged(vertices_offset, vertices_size);
+  auto iupdator = _batch.mstore_.indices_->update_staged(indices_offset, indices_size);
 
   auto *vertices = reinterpret_cast<vertex *>(vupdator.staging().data());
   auto *indices  = reinterpret_cast<index_t *>(iupdator.staging().data());
 
-  auto callback = [vertices, indices, this](uint _index, i16vec4_px _coords, vec4 _uv, uint _atlas_page) {
-    vertices[_index * 4 + 0] = {{_coords.x, _coords.y}, encode_atlas_page_xy({_uv.x, _uv.y}, _atlas_page)};
-    vertices[_index * 4 + 1] = {{_coords.x, _coords.w}, encode_atlas_page_xy({_uv.x, _uv.w}, _atlas_page)};
-    vertices[_index * 4 + 2] = {{_coords.z, _coords.y}, encode_atlas_page_xy({_uv.z, _uv.y}, _atlas_page)};
-    vertices[_index * 4 + 3] = {{_coords.z, _coords.w}, encode_atlas_page_xy({_uv.z, _uv.w}, _atlas_page)};
+  // Glyphs shared with the previous shaping are pinned again before being unpinned, so they never look unused
+  auto previous = std::exchange(subimages_, {});
+  glyphs_       = 0;
+  bbox_         = i16vec4_px(NUMAX<f32>, NUMAX<f32>, NUMIN<f32>, NUMIN<f32>);
+
+  auto callback = [vertices, indices, this](uint _index, i16vec4_px _coords, const shared_subimage &_glyph) {
+    assert(_glyph->page() <= NUMAX<u16>);
+    const auto page          = u16(_glyph->page());
+    const auto uv            = _glyph->texcoords();
+    vertices[_index * 4 + 0] = {{_coords.x, _coords.y}, packUnorm<u16>(vec2{uv.x, uv.y}), page};
+    vertices[_index * 4 + 1] = {{_coords.x, _coords.w}, packUnorm<u16>(vec2{uv.x, uv.w}), page};
+    vertices[_index * 4 + 2] = {{_coords.z, _coords.y}, packUnorm<u16>(vec2{uv.z, uv.y}), page};
+    vertices[_index * 4 + 3] = {{_coords.z, _coords.w}, packUnorm<u16>(vec2{uv.z, uv.w}), page};
 
     indices[_index * 6 + 0] = _index * 4 + 0;
     indices[_index * 6 + 1] = _index * 4 + 1;
@@ -290,13 +326,25 @@ word::word(renderer *_parent, batch &_batch, uint _alloc, uint _codepoints, std:
     bbox_.z = std::max(bbox_.z, _coords.z);
     bbox_.w = std::max(bbox_.w, _coords.w);
     glyphs_++;
+
+    _glyph->pin();
+    subimages_.emplace_back(_glyph);
   };
-  _parent->shaper_.shape(_parent->atlas_, _text, callback);
+  _parent->shaper_.shape(_parent->atlas_, text_, callback);
+
+  for (auto &subimage : previous)
+    subimage->unpin();
+}
+
+bool word::uses(std::span<const shared_subimage> _glyphs) const {
+  return std::ranges::any_of(subimages_, [_glyphs](const shared_subimage &_subimage) {
+    return std::ranges::find(_glyphs, _subimage) != _glyphs.end();
+  });
 }
 
 void batch::release(text_suballoc *_suballoc) {
   if (!parent_->use_indirect_fallback_) {
-    dstore_.commands_->zero(_suballoc->offset(), _suballoc->size());
+    dstore_.commands_->zero_staged(_suballoc->offset(), _suballoc->size());
   } else {
     std::fill(dstore_.commands_fallback_.get() + _suballoc->offset(),
               dstore_.commands_fallback_.get() + _suballoc->offset() + _suballoc->size(),
@@ -321,11 +369,11 @@ void batch::release_words(std::span<string_hash> _hashes) {
 }
 
 text_updator batch::update_raw_impl(uint _offset_bytes, uint _size_bytes) {
-  return dstore_.instances_->update_raw(_offset_bytes, _size_bytes);
+  return dstore_.instances_->update_staged_raw(_offset_bytes, _size_bytes);
 }
 
 void batch::zero_raw(uint _offset_bytes, uint _size_bytes) {
-  dstore_.instances_->zero_raw(_offset_bytes, _size_bytes);
+  dstore_.instances_->zero_staged_raw(_offset_bytes, _size_bytes);
 }
 
 }  // namespace details
@@ -73,7 +73,7 @@ void shaper::shape(const shared_atlas &_atlas, std::u8string_view _text, const s
       i16vec2 begin{offset.x + bearing.x, offset.y - bearing.y};
       i16vec2 end = begin + size;
 
-      _cb(i, i16vec4{begin, end}, glyph.subimage_->texcoords(), glyph.subimage_->page());
+      _cb(i, i16vec4{begin, end}, glyph.subimage_);
     }
     cur_offset += i16vec2{pos[i].x_advance, pos[i].y_advance} / FONT_FACTOR;
   }
@@ -36,17 +36,19 @@
 namespace hut::ui {
 
 struct root_params {
-  shared_atlas   words_atlas_;
-  image_params   words_atlas_dparams_{.size_ = u16vec2_px{u16_px{(1 << 15) - 1}}, .format_ = VK_FORMAT_R8_UNORM};
-  shared_sampler words_sampler_;
-  sampler_params words_sampler_dparams_;
+  shared_atlas      words_atlas_;
+  image_params      words_atlas_dparams_{.size_ = u16vec2_px{u16_px{(1 << 15) - 1}}, .format_ = VK_FORMAT_R8_UNORM};
+  binpack::packer2d words_atlas_dpacker_ = binpack::PSHELVE2D;    // Words are packed and freed often, with few heights
+  shared_sampler    words_sampler_;
+  sampler_params    words_sampler_dparams_;
 
   text::renderer_params words_params_;
 
-  shared_atlas   boxes_atlas_;
-  image_params   boxes_atlas_dparams_{.size_ = u16vec2_px{u16_px{(1 << 16) - 1}}, .format_ = VK_FORMAT_R8G8B8A8_UNORM};
-  shared_sampler boxes_sampler_;
-  sampler_params boxes_sampler_dparams_;
+  shared_atlas      boxes_atlas_;
+  image_params      boxes_atlas_dparams_{.size_ = u16vec2_px{u16_px{(1 << 16) - 1}}, .format_ = VK_FORMAT_R8G8B8A8_UNORM};
+  binpack::packer2d boxes_atlas_dpacker_ = binpack::PMAXRECTS2D;  // Icons, emojis and images of any size
+  shared_sampler    boxes_sampler_;
+  sampler_params    boxes_sampler_dparams_;
 
   render2d::renderer_params boxes_params_;
 };
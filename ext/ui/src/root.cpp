@@ -40,8 +40,8 @@ static shared_buffer default_buffer(display &_dsp, const buffer_params &_params)
   return std::make_shared<buffer>(_dsp, _params);
 }
 
-static shared_atlas default_atlas(display &_dsp, const shared_buffer &_buf, const image_params &_params) {
-  return std::make_shared<atlas>(_dsp, _buf, _params);
+static shared_atlas default_atlas(display &_dsp, const image_params &_params, binpack::packer2d _packer) {
+  return std::make_shared<atlas>(_dsp, _params, _packer, true);
 }
 
 static shared_sampler default_sampler(display &_dsp, const sampler_params &_params) {
@@ -54,10 +54,10 @@ root::root(display &_dsp, window &_parent, shared_buffer _buf, shared_ubo _ubo,
     , buffer_(std::move(_buf))
     , ubo_(std::move(_ubo))
     , boxes_sampler_(_params.boxes_sampler_ ? _params.boxes_sampler_ : default_sampler(_dsp, _params.boxes_sampler_dparams_))
-    , boxes_atlas_(_params.boxes_atlas_ ? _params.boxes_atlas_ : default_atlas(_dsp, buffer_, _params.boxes_atlas_dparams_))
+    , boxes_atlas_(_params.boxes_atlas_ ? _params.boxes_atlas_ : default_atlas(_dsp, _params.boxes_atlas_dparams_, _params.boxes_atlas_dpacker_))
     , boxes_renderer_(_parent, buffer_, ubo_, boxes_atlas_, boxes_sampler_, _params.boxes_params_)
     , words_sampler_(_params.words_sampler_ ? _params.words_sampler_ : default_sampler(_dsp, _params.words_sampler_dparams_))
-    , words_atlas_(_params.words_atlas_ ? _params.words_atlas_ : default_atlas(_dsp, buffer_, _params.words_atlas_dparams_))
+    , words_atlas_(_params.words_atlas_ ? _params.words_atlas_ : default_atlas(_dsp, _params.words_atlas_dparams_, _params.words_atlas_dpacker_))
     , font_(std::move(_font))
     , words_renderer_(_parent, buffer_, font_, ubo_, words_atlas_, words_sampler_, _params.words_params_) {
   _parent.on_draw_.connect(std::bind_front(&ui::root::draw, this));
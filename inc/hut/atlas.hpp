@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include "hut/utils/event.hpp"
 #include "hut/utils/length.hpp"
 
 #include "hut/image.hpp"
@@ -41,10 +42,22 @@ class atlas {
   constexpr static u16vec2_px PADDING = {1, 1};
 
  public:
-  atlas(display &_display, shared_buffer _storage, const image_params &_params);
+  struct page_occupancy {
+    uint   used_px_;         // Area of live sub-images, padding included
+    uint   total_px_;        // Area of the page
+    uint   subimages_;       // Count of live sub-images
+    size_t metadata_bytes_;  // Estimated host memory used by the packer
+  };
+
+  // A layered atlas keeps its pages as the layers of a single image, viewed as a 2D array. It's bound as one descriptor
+  // whatever its page count, and grows by copying its layers into a larger image.
+  atlas(display &_display, const image_params &_params, binpack::packer2d _packer = binpack::PSHELVE2D,
+        bool _layered = false);
 
-  shared_image             page(uint _index) { return pages_[_index].image_; }
+  shared_image             page(uint _index) { return pages_[_index].image_; }  // Same image for all layered pages
   [[nodiscard]] size_t     page_count() const { return pages_.size(); }
+  [[nodiscard]] size_t     descriptor_count() const { return layered_ ? 1 : pages_.size(); }
+  [[nodiscard]] bool       layered() const { return layered_; }
   [[nodiscard]] u16vec2_px size() const { return params_.size_; }
   [[nodiscard]] VkFormat   format() const { return params_.format_; }
 
@@ -53,24 +66,55 @@ class atlas {
   image::updator  update(const subimage &_sub, const u16bbox_px &_bounds);
   void            free(subimage &&_sub);
 
+  [[nodiscard]] std::vector<page_occupancy> occupancy() const;
+
+  // Once _max_pages are full, alloc reclaims the least recently used unpinned sub-images that weren't touched for at
+  // least _min_age frames, before growing further. Owners keep their shared_subimage, which just becomes invalid, so
+  // anything still displaying a sub-image should either pin it or touch it every frame.
+  void enable_eviction(uint _max_pages, uint _min_age = 1);
+
+  [[nodiscard]] u64 frame() const;  // Of the display, the clock of last uses
+
+  event<shared_subimage> on_evict_;  // sub-image is about to be evicted, owners may drop it
+
+  // Repacks live sub-images into as few pages as possible, copying their texels on the GPU into new page images.
+  // Sub-images keep their identity but get a new page and bounds, so anything that baked their texcoords must refresh
+  // once generation() changes. Updates of sub-images should be finished before calling it. Returns false if the pages
+  // count wouldn't decrease, and nothing was moved.
+  bool              compact();
+  [[nodiscard]] u64 generation() const { return generation_; }
+
  private:
-  void add_page();
+  void                                    add_page();
+  void                                    grow_layers(uint _layers);
+  [[nodiscard]] u16                       layer(uint _page) const { return layered_ ? u16(_page) : 0; }
+  shared_subimage                         emplace(uint _page, const u16vec2 &_origin, const u16vec2_px &_bounds);
+  std::optional<std::pair<uint, u16vec2>> evict_and_pack(const u16vec2_px &_padded);
 
   struct page_data {
-    using packer_t = binpack::shelve<u16, binpack::shelve_separator_align<u16, 8>>;
+    shared_image            image_;
+    binpack::dynamic2d<u16> packer_;
+    uint                    used_px_   = 0;
+    uint                    subimages_ = 0;
 
-    shared_image image_;
-    packer_t     packer_;
+    std::unordered_map<u32, std::weak_ptr<subimage>> live_;  // Origin to sub-image
 
-    explicit page_data(const shared_image &_image)
+    page_data(const shared_image &_image, binpack::packer2d _packer)
         : image_(_image)
-        , packer_(_image->size()) {}
+        , packer_(_packer, _image->size()) {}
   };
 
   display               &display_;
-  shared_buffer          storage_;
   image_params           params_;
+  binpack::packer2d      packer_;
   std::vector<page_data> pages_;
+  bool                   layered_;
+  shared_image           layers_;  // When layered, shared by all the pages
+
+  bool evict_      = false;
+  uint max_pages_  = 0;
+  uint min_age_    = 0;
+  u64  generation_ = 0;
 };
 
 }  // namespace hut
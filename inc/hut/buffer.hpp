@@ -27,6 +27,10 @@
 
 #pragma once
 
+#include <mutex>
+#include <optional>
+#include <variant>
+
 #include "hut/utils/binpacks.hpp"
 
 #include "hut/display.hpp"
@@ -36,11 +40,17 @@ namespace hut {
 
 namespace details {
 struct buffer_page_data {
-  buffer                 *parent_ = nullptr;
-  binpack::linear1d<uint> suballocator_;
-  VkBuffer                buffer_        = VK_NULL_HANDLE;
-  VkDeviceMemory          memory_        = VK_NULL_HANDLE;
-  u8                     *permanent_map_ = nullptr;
+  using suballocator_t = std::variant<binpack::linear1d<uint>, binpack::ring1d<uint>, binpack::tlsf1d<uint>>;
+
+  buffer             *parent_  = nullptr;
+  display            *display_ = nullptr;  // Outlives parent_ once the page is retired
+  suballocator_t      suballocator_;
+  VkBuffer            buffer_ = VK_NULL_HANDLE;
+  memory_block        memory_;
+  u8                 *permanent_map_ = nullptr;
+  bool                transient_     = false;
+  bool                direct_        = false;  // Updates write to permanent_map_, without staging
+  display::time_point empty_since_   = {};     // When its last allocation was released, reset by allocations
 
   buffer_page_data() = delete;
   ~buffer_page_data();
@@ -50,27 +60,36 @@ struct buffer_page_data {
 
   buffer_page_data(buffer_page_data &&_other) noexcept
       : parent_(std::exchange(_other.parent_, nullptr))
+      , display_(_other.display_)
       , suballocator_(std::move(_other.suballocator_))
       , buffer_(std::exchange(_other.buffer_, (VkBuffer)VK_NULL_HANDLE))
-      , memory_(std::exchange(_other.memory_, (VkDeviceMemory)VK_NULL_HANDLE))
-      , permanent_map_(std::exchange(_other.permanent_map_, nullptr)) {}
+      , memory_(std::move(_other.memory_))
+      , permanent_map_(std::exchange(_other.permanent_map_, nullptr))
+      , transient_(_other.transient_)
+      , direct_(_other.direct_)
+      , empty_since_(_other.empty_since_) {}
   buffer_page_data &operator=(buffer_page_data &&_other) noexcept {
     if (&_other != this) {
       parent_        = std::exchange(_other.parent_, nullptr);
+      display_       = _other.display_;
       suballocator_  = std::move(_other.suballocator_);
       buffer_        = std::exchange(_other.buffer_, (VkBuffer)VK_NULL_HANDLE);
-      memory_        = std::exchange(_other.memory_, (VkDeviceMemory)VK_NULL_HANDLE);
+      memory_        = std::move(_other.memory_);
       permanent_map_ = std::exchange(_other.permanent_map_, nullptr);
+      transient_     = _other.transient_;
+      direct_        = _other.direct_;
+      empty_since_   = _other.empty_since_;
     }
     return *this;
   }
 
-  buffer_page_data(buffer &_parent, uint _size);
+  buffer_page_data(buffer &_parent, uint _size, bool _transient = false);
 
   void                             release_impl(buffer_suballoc<u8> *_suballoc);
-  [[nodiscard]] buffer_updator<u8> update_raw_impl(uint _offset_bytes, uint _size_bytes);
+  // _staged goes through staging even if the page is direct mapped
+  [[nodiscard]] buffer_updator<u8> update_raw_impl(uint _offset_bytes, uint _size_bytes, bool _staged = false);
   void                             finalize_impl(buffer_updator<u8> *_updator);
-  void                             zero_raw(uint _offset_bytes, uint _size_bytes) const;
+  void                             zero_raw(uint _offset_bytes, uint _size_bytes, bool _staged = false) const;
 
   template<typename TContained>
   void release(buffer_suballoc<TContained> *_suballoc) {
@@ -87,27 +106,94 @@ struct buffer_page_data {
     return std::move(*update_raw_impl(_offset_bytes, _size_bytes).template reinterpret_as<TContained>());
   }
 
-  [[nodiscard]] uint size() const { return suballocator_.capacity(); }
+  template<typename TContained>
+  [[nodiscard]] buffer_updator<TContained> update_staged_raw(uint _offset_bytes, uint _size_bytes) {
+    return std::move(*update_raw_impl(_offset_bytes, _size_bytes, true).template reinterpret_as<TContained>());
+  }
+
+  [[nodiscard]] std::optional<uint> pack(uint _size_bytes, uint _align) {
+    return std::visit([=](auto &_suballocator) { return _suballocator.pack(_size_bytes, _align); }, suballocator_);
+  }
+  [[nodiscard]] uint size() const {
+    return std::visit([](const auto &_suballocator) { return _suballocator.capacity(); }, suballocator_);
+  }
+  [[nodiscard]] uint allocated() const {
+    return std::visit([](const auto &_suballocator) { return _suballocator.allocated(); }, suballocator_);
+  }
+  [[nodiscard]] bool empty() const {
+    return std::visit([](const auto &_suballocator) { return _suballocator.empty(); }, suballocator_);
+  }
+  template<typename TVisitor>
+  void visit_blocks(TVisitor _visitor) const {
+    std::visit([&](const auto &_suballocator) { _suballocator.visit_blocks(_visitor); }, suballocator_);
+  }
 };
 }  // namespace details
 
 struct buffer_params {
+  enum packer {
+    PACK_LINEAR1D,
+    PACK_RING1D,  // Fixed size ring, space is reclaimed in allocation order, pages can't grow
+    PACK_TLSF1D,  // Constant time allocation and release, for pages with many live allocations
+  };
+
   bool                  permanent_map_     = false;
+  // If a HOST_VISIBLE|HOST_COHERENT memory type also has type_ flags (UMA, ReBAR), pages are mapped and updators write
+  // to them directly instead of going through staging. Writes are then immediate, don't overwrite ranges in use by
+  // frames in flight, use update_staged/zero_staged for those, or display::wait_graphics before.
+  bool                  direct_map_        = false;
   uint                  initial_byte_size_ = 32 * 1024 * 1024;
+  packer                packer_            = PACK_LINEAR1D;
   VkMemoryPropertyFlags type_              = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  memory_category       category_          = MBUFFER;
   VkBufferUsageFlagBits usage_             = VkBufferUsageFlagBits(
       VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
       | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+  // Pages left empty for trim_delay_ are released by the display's loop, or after trim_pressure_delay_ while a heap is
+  // over its budget. Both should outlast the frames in flight, and the first page is always kept.
+  display::duration trim_delay_          = std::chrono::seconds(2);
+  display::duration trim_pressure_delay_ = std::chrono::milliseconds(250);
 };
 
 class buffer {
+  friend class display;
   friend struct details::buffer_page_data;
 
  public:
   buffer(display &_display, const buffer_params &_params = {});
+  ~buffer();
+
+  buffer(const buffer &)            = delete;
+  buffer &operator=(const buffer &) = delete;
 
   [[nodiscard]] buffer_suballoc<u8> allocate_raw(uint _size_bytes, uint _align = 4);
 
+  // Never grows, returns nothing if existing pages are full
+  [[nodiscard]] std::optional<buffer_suballoc<u8>> try_allocate_raw(uint _size_bytes, uint _align = 4);
+  // Allocates in a dedicated page, that is released by release_transient_pages once empty
+  [[nodiscard]] buffer_suballoc<u8> allocate_transient_raw(uint _size_bytes, uint _align = 4);
+  void                              release_transient_pages();
+
+  // False if direct_map_ wasn't requested or isn't supported by the device
+  [[nodiscard]] bool direct_mapped() const { return !pages_.empty() && pages_.front().direct_; }
+
+  // Only for PACK_RING1D, a range that the caller sub-allocates by building buffer_suballoc itself
+  struct shared_range {
+    details::buffer_page_data *page_;
+    uint                       offset_bytes_;
+  };
+  [[nodiscard]] std::optional<shared_range> try_allocate_shared_raw(uint _size_bytes, uint _align = 4);
+  // Ends sub-allocation of a shared range, it's released once all of its _sub_count sub-allocations are
+  void close_shared_raw(const shared_range &_range, uint _sub_count);
+
+  [[nodiscard]] uint allocated_bytes() const;
+  [[nodiscard]] uint reserved_bytes() const;
+  [[nodiscard]] uint high_water_mark() const { return high_water_mark_; }
+
+  // Releases the pages that have been empty for at least _min_idle, except the first one, returns the released bytes.
+  // They are destroyed once the frames and staging flush submitted before are done, see display::retire.
+  uint trim(display::duration _min_idle = {});
+
   template<typename TSubType>
   [[nodiscard]] shared_buffer_suballoc<TSubType> allocate(uint _count, uint _align = 4) {
     auto raw_alloc = allocate_raw(_count * sizeof(TSubType), _align);
@@ -123,8 +209,14 @@ class buffer {
   buffer_params params_;
 
   std::list<details::buffer_page_data> pages_;
-
-  details::buffer_page_data &grow(uint _new_size) { return pages_.emplace_back(*this, _new_size); }
+  mutable std::mutex                   pages_mutex_;  // Pages and their suballocators, trimmed by the dispatch loop
+  uint                                 high_water_mark_ = 0;
+
+  // Require pages_mutex_
+  details::buffer_page_data         &grow(uint _new_size) { return pages_.emplace_back(*this, _new_size); }
+  buffer_suballoc<u8>                track(details::buffer_page_data &_page, uint _offset_bytes, uint _size_bytes);
+  void                               track_high_water();
+  std::optional<buffer_suballoc<u8>> try_allocate_impl(uint _size_bytes, uint _align);
 };
 
 }  // namespace hut
@@ -0,0 +1,202 @@
+/*  _ _ _   _       _
+ * | |_| |_| |_ _ _| |_
+ * | | | . |   | | |  _|
+ * |_|_|___|_|_|___|_|
+ * Hobby graphics and GUI library under the MIT License (MIT)
+ *
+ * Copyright (c) 2014 Jean-Baptiste Lepesme github.com/jiboo/libhut
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <list>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "hut/utils/binpacks.hpp"
+#include "hut/utils/fwd.hpp"
+#include "hut/utils/vulkan.hpp"
+
+namespace hut {
+
+class device_memory;
+
+enum memory_category : u8 {
+  MSTAGING,        // Staging ring, and its dedicated overflow allocations
+  MBUFFER,         // Vertex, index, instance and uniform buffers
+  MATLAS,          // Atlas pages
+  MRENDER_TARGET,  // Multisampled and depth attachments
+  MIMAGE,          // Other images
+  MEMORY_CATEGORY_COUNT,
+};
+const char *memory_category_name(memory_category _category);
+
+struct memory_heap_stats {
+  VkDeviceSize      size_;
+  VkDeviceSize      budget_;  // Without VK_EXT_memory_budget, the heap size
+  VkDeviceSize      usage_;   // By the whole process, or only reserved by hut without VK_EXT_memory_budget
+  VkMemoryHeapFlags flags_;
+};
+
+struct memory_stats {
+  std::array<VkDeviceSize, MEMORY_CATEGORY_COUNT> categories_      = {};     // Bound to resources
+  VkDeviceSize                                    reserved_bytes_  = 0;      // In VkDeviceMemory objects
+  uint                                            allocations_     = 0;
+  uint                                            pending_garbage_ = 0;      // Waiting for a staging flush to retire
+  bool                                            budget_          = false;  // Heaps come from VK_EXT_memory_budget
+  std::vector<memory_heap_stats>                  heaps_;
+
+  [[nodiscard]] VkDeviceSize allocated_bytes() const {
+    VkDeviceSize result = 0;
+    for (auto bytes : categories_)
+      result += bytes;
+    return result;
+  }
+};
+
+namespace details {
+struct memory_page {
+  VkDeviceMemory        memory_ = VK_NULL_HANDLE;
+  VkBuffer              alias_  = VK_NULL_HANDLE;  // Spans linear pages, so that transfers can fill their images
+  u32                   type_;
+  u32                   tiling_;
+  binpack::tlsf1d<uint> packer_;
+
+  memory_page(u32 _type, u32 _tiling, uint _size)
+      : type_(_type)
+      , tiling_(_tiling)
+      , packer_(_size) {}
+};
+}  // namespace details
+
+// Device memory bound to a buffer or an image: either a range of a shared page, or a whole VkDeviceMemory
+class memory_block {
+  friend class device_memory;
+
+  device_memory        *parent_ = nullptr;
+  details::memory_page *page_   = nullptr;  // Null for whole allocations
+  VkDeviceMemory        memory_ = VK_NULL_HANDLE;
+  VkDeviceSize          offset_   = 0;
+  VkDeviceSize          size_     = 0;
+  u32                   type_     = 0;
+  memory_category       category_ = MBUFFER;
+
+  memory_block(device_memory *_parent, details::memory_page *_page, VkDeviceMemory _memory, VkDeviceSize _offset,
+               VkDeviceSize _size, u32 _type, memory_category _category)
+      : parent_(_parent)
+      , page_(_page)
+      , memory_(_memory)
+      , offset_(_offset)
+      , size_(_size)
+      , type_(_type)
+      , category_(_category) {}
+
+ public:
+  memory_block() = default;
+  ~memory_block();
+
+  memory_block(const memory_block &)            = delete;
+  memory_block &operator=(const memory_block &) = delete;
+
+  memory_block(memory_block &&_other) noexcept
+      : parent_(std::exchange(_other.parent_, nullptr))
+      , page_(std::exchange(_other.page_, nullptr))
+      , memory_(std::exchange(_other.memory_, (VkDeviceMemory)VK_NULL_HANDLE))
+      , offset_(std::exchange(_other.offset_, 0))
+      , size_(std::exchange(_other.size_, 0))
+      , type_(_other.type_)
+      , category_(_other.category_) {}
+  memory_block &operator=(memory_block &&_other) noexcept;
+
+  [[nodiscard]] VkDeviceMemory  memory() const { return memory_; }
+  [[nodiscard]] VkDeviceSize    offset() const { return offset_; }
+  [[nodiscard]] VkDeviceSize    size() const { return size_; }
+  [[nodiscard]] u32             type() const { return type_; }
+  [[nodiscard]] memory_category category() const { return category_; }
+  [[nodiscard]] bool            whole() const { return page_ == nullptr; }
+  [[nodiscard]] VkBuffer        alias() const { return page_ != nullptr ? page_->alias_ : VK_NULL_HANDLE; }
+};
+
+// Sub-allocates device memory from pages kept per memory type, so that resources get a memory type they support
+// without a VkDeviceMemory each. Linear and optimal resources never share a page, bufferImageGranularity can then be
+// ignored between neighbours.
+class device_memory {
+  friend class memory_block;
+
+ public:
+  enum tiling {
+    TLINEAR,   // Buffers and linear images
+    TOPTIMAL,  // Optimal images
+    TILING_COUNT,
+  };
+
+  struct request {
+    VkMemoryRequirements  requirements_;
+    VkMemoryPropertyFlags properties_;
+    tiling                tiling_           = TLINEAR;
+    memory_category       category_         = MBUFFER;
+    bool                  whole_            = false;           // Own VkDeviceMemory, e.g. to be mapped as a whole
+    VkImage               dedicated_image_  = VK_NULL_HANDLE;  // Whole allocation dedicated to this image
+    VkBuffer              dedicated_buffer_ = VK_NULL_HANDLE;  // Whole allocation dedicated to this buffer
+  };
+
+  device_memory(display &_display, uint _page_byte_size);
+  ~device_memory();
+
+  device_memory(const device_memory &)            = delete;
+  device_memory &operator=(const device_memory &) = delete;
+
+  [[nodiscard]] memory_block allocate(const request &_request);
+
+  [[nodiscard]] VkDeviceSize reserved_bytes() const { return reserved_bytes_; }    // In VkDeviceMemory objects
+  [[nodiscard]] VkDeviceSize allocated_bytes() const { return allocated_bytes_; }  // Bound to resources
+  [[nodiscard]] VkDeviceSize allocated_bytes(memory_category _category) const { return category_bytes_[_category]; }
+  [[nodiscard]] uint         allocation_count() const { return allocation_count_; }
+  // Fills the categories, reserved bytes and allocations, and the heaps usage without VK_EXT_memory_budget
+  void collect(memory_stats &_stats) const;
+
+ private:
+  using heap = std::list<details::memory_page>;
+
+  display           &display_;
+  uint               page_byte_size_;
+  mutable std::mutex mutex_;
+
+  std::array<std::array<heap, TILING_COUNT>, VK_MAX_MEMORY_TYPES> heaps_;
+
+  VkDeviceSize                                    reserved_bytes_   = 0;
+  VkDeviceSize                                    allocated_bytes_  = 0;
+  std::array<VkDeviceSize, MEMORY_CATEGORY_COUNT> category_bytes_   = {};
+  std::array<VkDeviceSize, VK_MAX_MEMORY_HEAPS>   heap_bytes_       = {};  // Reserved, per heap
+  uint                                            allocation_count_ = 0;  // Bounded by maxMemoryAllocationCount
+
+  VkDeviceMemory allocate_memory(u32 _type, VkDeviceSize _size, VkImage _image, VkBuffer _buffer);
+  void           free_memory(VkDeviceMemory _memory, u32 _type, VkDeviceSize _size);
+  memory_block   allocate_whole(const request &_request, u32 _type);
+  memory_block   allocate_shared(const request &_request, u32 _type);
+  void           destroy_page(details::memory_page &_page);
+  void           release(memory_block &_block);
+};
+
+}  // namespace hut
@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <condition_variable>
 #include <functional>
@@ -37,6 +38,7 @@
 #include <thread>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <wayland-client.h>
@@ -51,6 +53,8 @@
 #include "hut/utils/sstream.hpp"
 #include "hut/utils/vulkan.hpp"
 
+#include "hut/device_memory.hpp"
+
 #include "xdg-shell-client-protocol.h"
 
 namespace hut {
@@ -198,9 +202,56 @@ struct drop_target_interface {
   virtual void        on_drop(dragndrop_action, clipboard_receiver &) = 0;
 };
 
+struct display_params {
+  enum staging_overflow {
+    SBLOCK,      // Wait for in-flight staging submissions to retire, flushing only if nothing else can free space
+    SFLUSH,      // Submit what was staged so far right away, then wait for space to be retired
+    SDEDICATED,  // Never wait, use a temporary dedicated allocation that is released once its upload is done
+  };
+
+  uint             staging_byte_size_       = 32 * 1024 * 1024;
+  staging_overflow staging_overflow_        = SFLUSH;
+  uint             staging_arena_byte_size_ = 256 * 1024;  // Slice of the ring each thread allocates from, 0 to disable
+
+  uint memory_page_byte_size_ = 64 * 1024 * 1024;  // Device memory pages that images are sub-allocated from
+  uint dedicated_byte_size_   = 8 * 1024 * 1024;   // Attachments at least this big get their own memory
+
+  uint record_threads_ = 2;  // Workers recording command buffers alongside the caller, 0 to record serially
+};
+
+struct staging_stats {
+  u64                      flushes_            = 0;   // Flushes that recorded work
+  u64                      submissions_        = 0;
+  u64                      bytes_              = 0;   // Uploaded from the staging buffer
+  u64                      copies_             = 0;
+  u64                      zeroes_             = 0;
+  u64                      clears_             = 0;
+  u64                      transitions_        = 0;   // Layout barriers
+  std::chrono::nanoseconds blocked_            = {};  // Stalled on in-flight staging submissions or a full ring
+  uint                     staging_allocated_  = 0;   // Staging buffer occupancy after the flush
+  uint                     staging_high_water_ = 0;
+
+  staging_stats &operator+=(const staging_stats &_other) {
+    flushes_ += _other.flushes_;
+    submissions_ += _other.submissions_;
+    bytes_ += _other.bytes_;
+    copies_ += _other.copies_;
+    zeroes_ += _other.zeroes_;
+    clears_ += _other.clears_;
+    transitions_ += _other.transitions_;
+    blocked_ += _other.blocked_;
+    staging_allocated_  = _other.staging_allocated_;
+    staging_high_water_ = _other.staging_high_water_;
+    return *this;
+  }
+};
+
 class display {
+  friend class atlas;
   friend class buffer;
+  friend class device_memory;
   friend class offscreen;
+  friend class render_target;
   friend class window;
   friend class image;
   friend struct details::buffer_page_data;
@@ -220,11 +271,13 @@ class display {
   display &operator=(display &&) noexcept = delete;
 
   explicit display(const char *_app_name, u32 _app_version = VK_MAKE_VERSION(1, 0, 0),
-                   const char *_display_name = nullptr);
+                   const char *_display_name = nullptr, const display_params &_params = {});
   ~display();
 
   void flush();
   void flush_staged();
+  // Blocks until the graphics work submitted so far is done, before rewriting resources or descriptors it may read
+  void wait_graphics();
   void roundtrip();
   int  dispatch();
 
@@ -255,9 +308,34 @@ class display {
   }
   [[nodiscard]] uint ubo_align() const { return limits().minUniformBufferOffsetAlignment; }
 
+  [[nodiscard]] device_memory &memory() { return *memory_; }
+
   std::pair<u32, VkMemoryPropertyFlags> find_memory_type(u32 _type_filter, VkMemoryPropertyFlags _properties);
+  std::optional<std::pair<u32, VkMemoryPropertyFlags>> try_find_memory_type(u32 _type_filter,
+                                                                            VkMemoryPropertyFlags _properties);
+
+  [[nodiscard]] uint staging_high_water_mark();
+  // Counters of the last flush that recorded work, and running totals since creation
+  [[nodiscard]] staging_stats last_staging_stats();
+  [[nodiscard]] staging_stats total_staging_stats();
+  // Device memory per category and per heap, with the driver's budget when VK_EXT_memory_budget is available
+  [[nodiscard]] memory_stats memory_usage();
+
+  // Runs independent recording jobs on the recording workers, the first one always on the calling thread.
+  // Returns once they are all done, jobs should record into command buffers from distinct command pools. Jobs may
+  // share pipelines and renderers, drawing only reads them, but must not allocate, update or write descriptors
+  // through them, nor use buffers, images or atlases that another job modifies.
+  using record_job = std::function<void()>;
+  void record_parallel(std::span<const record_job> _jobs);
+
+  // Iterations of the dispatch loop that redrew a window, the clock of atlas eviction
+  [[nodiscard]] u64 frame() const { return frames_; }
 
  protected:
+  display_params params_;
+
+  std::atomic<u64> frames_ = 0;
+
   VkInstance               instance_ = VK_NULL_HANDLE;
   VkDebugReportCallbackEXT debug_cb_ = VK_NULL_HANDLE;
 
@@ -273,28 +351,139 @@ class display {
   VkPhysicalDeviceVulkan12Properties device_props12_;
   VkQueue                            queueg_, queuec_, queuet_, queuep_;
   VkCommandPool                      commandg_pool_ = VK_NULL_HANDLE;
+  VkCommandPool                      commandt_pool_ = VK_NULL_HANDLE;  // Of staging, on the graphics family otherwise
+  std::mutex                         commandg_mutex_;                  // Host access to commandg_pool_
   VkPhysicalDeviceMemoryProperties   mem_props_;
+  bool                               memory_budget_              = false;  // VK_EXT_memory_budget
+  bool                               incremental_present_        = false;  // VK_KHR_incremental_present
+  bool                               inherited_viewport_scissor_ = false;  // VK_NV_inherited_viewport_scissor
 
   void init_vulkan_instance(const char *_app_name, u32 _app_version, std::vector<const char *> &_extensions);
   void init_vulkan_device(VkSurfaceKHR _dummy);
   void destroy_vulkan();
 
   void *get_proc_impl(const std::string &_name);
+  void  trim_buffers(time_point _now);
+
+  std::vector<std::thread>    record_workers_;
+  std::mutex                  record_mutex_;
+  std::condition_variable     record_cv_;       // Jobs available, or stop requested
+  std::condition_variable     record_done_cv_;  // Jobs done, or record_parallel available again
+  std::span<const record_job> record_jobs_;
+  size_t                      record_next_    = 0;
+  size_t                      record_pending_ = 0;
+  bool                        record_stop_    = false;
+
+  void record_worker();
+  void run_record_job(std::unique_lock<std::mutex> &_lock);  // Requires record_mutex_, unlocked during the job
+#ifdef HUT_ENABLE_PROFILING
+  void profile_memory_usage();
+#endif  // HUT_ENABLE_PROFILING
+
+  constexpr static uint STAGING_SUBMISSIONS = 3;
+  struct staging_submission {
+    VkCommandBuffer                    cb_      = VK_NULL_HANDLE;
+    VkFence                            fence_   = VK_NULL_HANDLE;
+    bool                               pending_ = false;
+    std::vector<buffer_suballoc<u8>>   garbage_;
+    std::vector<std::shared_ptr<void>> retained_;
+  };
 
-  shared_buffer   staging_;
-  VkCommandBuffer staging_cb_;
-  uint            staging_jobs_ = 0;
-  std::mutex      staging_mutex_;
-  using flush_callback = std::function<void()>;
-  std::vector<flush_callback>      preflush_jobs_;
-  std::vector<buffer_suballoc<u8>> postflush_garbage_;
-
-  inline void preflush(const flush_callback &_callback) { preflush_jobs_.emplace_back(_callback); }
-  void        postflush_collect(buffer_suballoc<u8> &&_callback);
+  std::unique_ptr<device_memory>                      memory_;
+  std::vector<buffer *>                               buffers_;  // Trimmed by the dispatch loop
+  std::mutex                                          buffers_mutex_;
+  time_point                                          last_pressure_check_ = {};
+  bool                                                memory_pressure_     = false;  // A heap is over its budget
+  shared_buffer                                       staging_;
+  std::array<staging_submission, STAGING_SUBMISSIONS> staging_submissions_;
+  uint                                                staging_current_ = 0;
+  VkCommandBuffer                                     staging_cb_      = VK_NULL_HANDLE;
+  std::mutex                                          staging_mutex_;
+  std::mutex                                          queues_mutex_;  // Locked after staging_mutex_
+
+  // When a dedicated transfer family is available, staging is submitted on queuet_: resources touched by transfers
+  // are shared concurrently between both families, and the queues synchronize through timeline semaphores.
+  bool             staging_transfer_        = false;
+  VkSemaphore      graphics_timeline_       = VK_NULL_HANDLE;  // Signaled by graphics submissions if supported
+  VkSemaphore      transfer_timeline_       = VK_NULL_HANDLE;
+  std::atomic<u64> graphics_timeline_value_ = 0;  // Counts graphics submissions even without graphics_timeline_
+  std::atomic<u64> transfer_timeline_value_ = 0;
+
+  // Stages of graphics submissions waiting on staging_handoff(), the render pass and its clears may start earlier
+  constexpr static VkPipelineStageFlags STAGING_CONSUMER_STAGES
+      = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+      | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+  [[nodiscard]] u64 staging_handoff() const { return transfer_timeline_value_; }
+  [[nodiscard]] std::array<u32, 2> transfer_families() const { return {iqueueg_, iqueuet_}; }
+  // Requires queues_mutex_, value that a graphics submission signals on graphics_timeline_ if it exists
+  [[nodiscard]] u64 next_graphics_value() { return ++graphics_timeline_value_; }
+
+  // Graphics submissions may read any destination staged before them. The value of graphics_timeline_value_ when each
+  // destination was last written tells if graphics work was submitted since, that may still be reading it.
+  std::unordered_map<VkBuffer, u64> staging_written_buffers_;
+  std::unordered_map<VkImage, u64>  staging_written_images_;
+  std::mutex                        staging_written_mutex_;  // Destructors may run with staging_mutex_ held
+  // Oldest last write of the destinations of the flush being recorded, if any was staged before
+  u64 staging_read_since_ = NUMAX<u64>;
+
+  template<typename THandle>
+  void track_destination(std::unordered_map<THandle, u64> &_written, THandle _destination);
+  void track_destinations();  // Requires staging_mutex_, before the flush records anything
+  // Of destroyed destinations, so that a handle reused by the driver starts afresh
+  void forget_destination(VkBuffer _destination);
+  void forget_destination(VkImage _destination);
+
+  std::vector<buffer_suballoc<u8>>   postflush_garbage_;
+  std::vector<std::shared_ptr<void>> postflush_retained_;
+
+  staging_stats staging_stats_;  // Of the flush being recorded, requires staging_mutex_ like the other two
+  staging_stats last_staging_stats_;
+  staging_stats total_staging_stats_;
+
+  // Start of the current stall on the staging ring or fences, it may span a flush that emits the stats meanwhile
+  std::optional<time_point> staging_stall_;
+  void                      begin_stall();
+  void                      account_stall();  // Adds the stall so far to blocked_
+  void                      end_stall();
+
+  void begin_staging();
+  void retire_staging(staging_submission &_submission, bool _wait);
+  void flush_staged_impl();
+
+  // Small allocations come from a slice of the ring owned by the calling thread, so that threads don't contend on
+  // staging_mutex_. Slices are closed on each flush, to not hold the ring back.
+  constexpr static u64 STAGING_ARENA_CLOSED = ~u64(0);
+  struct staging_arena {
+    details::buffer_page_data *page_         = nullptr;
+    uint                       offset_bytes_ = 0;
+    std::atomic<u64>           state_        = STAGING_ARENA_CLOSED;  // Sub-allocations count << 32 | used bytes
+  };
+  inline static std::atomic<u64> s_staging_uids_ = 0;
+  const u64                      staging_uid_    = s_staging_uids_++;  // Key of thread local arena lookups
+  std::list<staging_arena>       staging_arenas_;  // One per thread that staged something, kept until destruction
+
+  staging_arena                                    &thread_staging_arena();
+  [[nodiscard]] std::optional<buffer_suballoc<u8>> try_allocate_arena(staging_arena &_arena, uint _size, uint _align);
+  void                                              close_arena(staging_arena &_arena);  // Requires staging_mutex_
+
+  // Locks staging_mutex_, unless the allocation fits in the thread's arena
+  [[nodiscard]] buffer_suballoc<u8> allocate_staging(uint _size_bytes, uint _align = 4);
+  // Requires staging_mutex_, applies display_params::staging_overflow_ when the ring is full
+  [[nodiscard]] buffer_suballoc<u8> allocate_staging_impl(uint _size_bytes, uint _align);
+
+  void postflush_collect(buffer_suballoc<u8> &&_callback);
+  // Requires staging_mutex_, keeps a resource alive until the next flush has been executed
+  void postflush_retain(std::shared_ptr<void> _resource);
+  // From the dispatch loop, keeps a resource alive until the next flush and the frames submitted by windows are done
+  void retire(std::shared_ptr<void> _resource);
+  // From the dispatch loop, windows record on_draw_ and all their layers again, when what they baked in was replaced
+  void invalidate_layers();
 
   struct buffer_copy : public VkBufferCopy {
     VkBuffer source_;
     VkBuffer destination_;
+    u64      sequence_;  // Set by post_copy
   };
 
   struct buffer_zero {
@@ -317,6 +506,10 @@ class display {
   struct image_clear {
     VkImage           destination_;
     VkClearColorValue color_;
+    // Linear images can't be cleared from a transfer queue, they are zeroed through their aliasing storage instead
+    VkBuffer     storage_;
+    VkDeviceSize storage_offset_;
+    VkDeviceSize storage_size_;
   };
 
   struct image_transition {
@@ -324,16 +517,122 @@ class display {
     VkImageLayout old_layout_, new_layout_;
   };
 
-  void stage_copy(const buffer_copy &_info);
+  struct image_update : public buffer_image_copy {
+    VkImageSubresourceRange range_;
+    u64                     sequence_;  // Set by post_copy
+  };
+
+  struct image_barrier {
+    VkImageMemoryBarrier barrier_;
+    VkPipelineStageFlags src_stage_, dst_stage_;
+  };
+
+  // Commands and copies are numbered when queued, flush_staged records them in that order. The vector keeps its capacity
+  // so queuing doesn't allocate.
+  struct staging_command {
+    enum kind { ZERO, TRANSITION, CLEAR, COPY };
+    kind                    kind_;
+    u64                     sequence_;
+    VkImageSubresourceRange range_;
+    union {
+      buffer_zero      zero_;
+      image_transition transition_;
+      image_clear      clear_;
+      image_copy       copy_;
+    };
+  };
+  std::vector<staging_command> staging_commands_;
+  std::atomic<u64>             staging_sequence_ = 0;
+
+  // Requires staging_mutex_
+  void queue_command(const buffer_zero &_info);
+  void queue_command(const image_transition &_info, VkImageSubresourceRange _range);
+  void queue_command(const image_clear &_info, VkImageSubresourceRange _range);
+  void queue_command(const image_copy &_info);
+  staging_command &emplace_command(staging_command::kind _kind);
+  void             stage_command(const staging_command &_command);
+
+  // Copies are not recorded right away, flush_staged sorts and merges the ones between two commands touching their
+  // destinations in as few commands as possible
+  std::vector<buffer_copy>          pending_buffer_copies_;
+  std::vector<image_update>         pending_image_copies_;
+  std::vector<uint>                 pending_order_;
+  std::vector<VkBufferCopy>         buffer_regions_;
+  std::vector<VkBufferImageCopy>    image_regions_;
+  std::vector<VkImageMemoryBarrier> image_barriers_;
+
+  void queue_copy(const buffer_copy &_info) { pending_buffer_copies_.emplace_back(_info); }
+  void queue_copy(const image_update &_info) { pending_image_copies_.emplace_back(_info); }
+
+  // Finalized updators are pushed lock-free to this list, that flush_staged drains into the pending copies
+  struct staging_record;
+  std::atomic<staging_record *> staging_records_ = nullptr;
+
+  void post_copy(const buffer_copy &_info, buffer_suballoc<u8> &&_staging);
+  void post_copy(const image_update &_info, buffer_suballoc<u8> &&_staging);
+  void push_staging_record(staging_record *_record);
+  void drain_staging_records();  // Requires staging_mutex_
+  void stage_ordered();
+  void stage_batch(std::span<const buffer_copy> _buffers, std::span<const image_update> _images);
+  void stage_pending_buffer_copies(std::span<const buffer_copy> _copies);
+  void stage_pending_image_copies(std::span<const image_update> _copies);
+
+  // Destinations of the copies batched by stage_ordered, and resources written since the last transfer barrier
+  std::unordered_set<VkBuffer> staging_batch_buffers_, staging_unsynced_buffers_;
+  std::unordered_set<VkImage>  staging_batch_images_, staging_unsynced_images_;
+
+  bool touches_batch(const staging_command &_command) const;
+  void sync_transfer(VkBuffer _buffer) {
+    if (staging_unsynced_buffers_.contains(_buffer))
+      stage_transfer_barrier();
+  }
+  void sync_transfer(VkImage _image) {
+    if (staging_unsynced_images_.contains(_image))
+      stage_transfer_barrier();
+  }
+
+  void stage_copy(VkBuffer _source, VkBuffer _destination, std::span<const VkBufferCopy> _regions);
   void stage_zero(const buffer_zero &_info);
 
   void stage_copy(const image_copy &_info);
-  void stage_copy(const buffer_image_copy &_info);
+  void stage_copy(VkBuffer _source, VkImage _destination, std::span<const VkBufferImageCopy> _regions);
   void stage_transition(const image_transition &_info, VkImageSubresourceRange _range);
   void stage_clear(const image_clear &_info, VkImageSubresourceRange _range);
+  void stage_transfer_barrier();  // Also clears the unsynced resources
+
+  // Layouts of the image subresources touched by the current flush. Barriers are only recorded when an operation needs
+  // another layout, merged in one command, and subresources go back to their resting layout once at the end.
+  struct subresource_key {
+    VkImage image_;
+    u32     level_, layer_;
+
+    bool operator==(const subresource_key &) const = default;
+  };
+  struct subresource_hash {
+    size_t operator()(const subresource_key &_key) const {
+      return std::hash<VkImage>{}(_key.image_) ^ ((_key.level_ * 31 + _key.layer_) * 0x9e3779b9u);
+    }
+  };
+  struct subresource_layout {
+    // Subresources not touched yet are expected to be sampled from
+    VkImageLayout current_ = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    VkImageLayout resting_ = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  };
+  std::unordered_map<subresource_key, subresource_layout, subresource_hash> staging_layouts_;
+  std::vector<image_barrier>                                                staging_barriers_;
+  std::vector<VkImageMemoryBarrier2KHR>                                     image_barriers2_;
+
+  PFN_vkCmdPipelineBarrier2KHR cmd_pipeline_barrier2_ = nullptr;  // Only with VK_KHR_synchronization2
+
+  void require_layout(VkImage _image, VkImageSubresourceRange _range, VkImageLayout _layout);
+  void record_layout_barriers();
+  void restore_layouts();
+
+  static image_barrier make_transition(VkImage _image, VkImageSubresourceRange _range, VkImageLayout _old_layout,
+                                       VkImageLayout _new_layout, bool _graphics_queue = true);
 
   static void transition_image(VkCommandBuffer _cb, VkImage _image, VkImageSubresourceRange _range,
-                               VkImageLayout _old_layout, VkImageLayout _new_layout);
+                               VkImageLayout _old_layout, VkImageLayout _new_layout, bool _graphics_queue = true);
 
   std::list<callback> posted_jobs_;
   std::mutex          posted_mutex_;
@@ -51,9 +51,12 @@ struct image_params {
   VkMemoryPropertyFlags properties_ = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
   VkSampleCountFlagBits samples_    = VK_SAMPLE_COUNT_1_BIT;
   VkImageCreateFlags    flags_      = 0;
+  bool                  array_      = false;  // View all the layers as a 2D array, even if there is only one
+  memory_category       category_   = MIMAGE;
 };
 
 class image {
+  friend class atlas;
   friend class offscreen;
 
  public:
@@ -115,8 +118,8 @@ class image {
     [[nodiscard]] uint      image_row_pitch() const { return target_->bpp() * (u16)subres_.coords_.width() / 8; }
   };
 
-  static std::shared_ptr<image> load_raw(display &_display, const shared_buffer &_storage, std::span<const u8> _data,
-                                         uint _data_row_pitch, const image_params &_params);
+  static std::shared_ptr<image> load_raw(display &_display, std::span<const u8> _data, uint _data_row_pitch,
+                                         const image_params &_params);
 
   image() = delete;
 
@@ -126,7 +129,8 @@ class image {
   image(image &&) noexcept            = delete;
   image &operator=(image &&) noexcept = delete;
 
-  image(display &_display, const shared_buffer &_storage, const image_params &_params);
+  // Memory comes from the display's device_memory
+  image(display &_display, const image_params &_params);
   ~image();
 
   void    update(subresource _subres, std::span<const u8> _data, uint _src_row_pitch);
@@ -147,7 +151,7 @@ class image {
   display     *display_;
   image_params params_;
 
-  shared_buffer_suballoc<u8> alloc_;
+  memory_block memory_;
 
   VkImage     image_ = VK_NULL_HANDLE;
   VkImageView view_  = VK_NULL_HANDLE;
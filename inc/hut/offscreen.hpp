@@ -27,6 +27,12 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "hut/buffer.hpp"
 #include "hut/image.hpp"
 #include "hut/render_target.hpp"
 
@@ -44,7 +50,45 @@ struct offscreen_params {
 };
 
 class offscreen final : public render_target {
+  struct readback_slot {
+    VkCommandBuffer cb_    = VK_NULL_HANDLE;
+    VkFence         fence_ = VK_NULL_HANDLE;
+  };
+
  public:
+  // Pending copy of a subresource into host memory, has to be destroyed before its offscreen
+  class readback {
+    friend class offscreen;
+
+   public:
+    readback() = delete;
+
+    readback(const readback &)            = delete;
+    readback &operator=(const readback &) = delete;
+
+    readback(readback &&) noexcept            = delete;
+    readback &operator=(readback &&) noexcept = delete;
+
+    ~readback();
+
+    [[nodiscard]] bool ready() const;
+    void               wait() const;
+    // Waits for the copy if needed
+    void read(std::span<u8> _dst, uint _data_row_pitch) const;
+
+   protected:
+    offscreen                     &parent_;
+    std::unique_ptr<readback_slot> slot_;
+    buffer_suballoc<u8>            memory_;
+    uint                           row_byte_size_;
+    uint                           buffer_row_pitch_;
+    uint                           rows_;
+
+    readback(offscreen &_parent, std::unique_ptr<readback_slot> &&_slot, buffer_suballoc<u8> &&_memory,
+             uint _row_byte_size, uint _buffer_row_pitch, uint _rows);
+  };
+  using unique_readback = std::unique_ptr<readback>;
+
   offscreen() = delete;
 
   offscreen(const offscreen &)            = delete;
@@ -53,13 +97,17 @@ class offscreen final : public render_target {
   offscreen(offscreen &&) noexcept            = delete;
   offscreen &operator=(offscreen &&) noexcept = delete;
 
-  explicit offscreen(const shared_image &_target, const shared_buffer &_storage, offscreen_params _init_params = {});
+  explicit offscreen(const shared_image &_target, offscreen_params _init_params = {});
   ~offscreen() final;
 
   using draw_callback = std::function<void(VkCommandBuffer)>;
   void draw(const draw_callback &_callback);
+  // Records each callback in its own secondary command buffer on the display recording workers, drawn in order
+  void draw(std::span<const draw_callback> _callbacks);
 
   void download(std::span<u8> _dst, uint _data_row_pitch, image::subresource _src = {});
+  // Returns once the copy is submitted, several readbacks can be in flight while the next frames are drawn
+  [[nodiscard]] unique_readback download_async(image::subresource _src = {});
 
  protected:
   offscreen_params params_;
@@ -67,7 +115,16 @@ class offscreen final : public render_target {
   VkCommandBuffer  cb_    = VK_NULL_HANDLE;
   VkFence          fence_ = VK_NULL_HANDLE;
 
-  void flush_cb();
+  std::vector<secondary_pool> secondaries_;  // One per callback of the parallel draw
+
+  std::mutex                                  readback_mutex_;
+  shared_buffer                               readback_buffer_;  // Created on first readback
+  std::vector<std::unique_ptr<readback_slot>> readback_slots_;   // Idle slots
+
+  void                           submit(VkCommandBuffer _cb, VkFence _fence);
+  void                           flush_cb();
+  std::unique_ptr<readback_slot> acquire_readback_slot();  // Requires readback_mutex_
+  void                           recycle_readback(readback &_readback);
 };
 
 }  // namespace hut
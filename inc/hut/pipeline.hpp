@@ -98,8 +98,10 @@ class pipeline {
     extra_attachments extras_;
   };
 
+  display     &display_;
   VkDevice     device_ref_;
   VkRenderPass render_pass_;
+  bool         update_unused_while_pending_ = false;  // Atlas pages can be appended while frames use the set
 
   VkShaderModule        vert_              = VK_NULL_HANDLE;
   VkShaderModule        frag_              = VK_NULL_HANDLE;
@@ -114,13 +116,15 @@ class pipeline {
 
   struct per_descriptor_atlas_info {
     shared_sampler sampler_;
-    uint           last_bound_ = 0;
+    uint           last_bound_      = 0;
+    u64            last_generation_ = 0;
   };
   struct per_atlas_info {
     std::unordered_map<uint, per_descriptor_atlas_info> descriptors_info_;
     uint                                                binding_;
   };
   std::unordered_map<shared_atlas, per_atlas_info> atlas_infos_;
+  std::mutex                                       atlas_mutex_;  // Layers sharing a renderer update it in parallel
 
   void init_bindings() {
     constexpr auto &VBINDINGS = TVertexRefl::DESCRIPTOR_BINDINGS;
@@ -179,11 +183,21 @@ class pipeline {
   void init_descriptor_layout(const display &_display) {
     const auto &features12 = _display.features12();
 
+    // Atlas arrays are only indexed up to the pages that exist, so new pages can be written while frames in flight,
+    // or cached command buffers, use the set
+    update_unused_while_pending_ = features12.descriptorBindingPartiallyBound == VK_TRUE
+                                && features12.descriptorBindingSampledImageUpdateAfterBind == VK_TRUE
+                                && features12.descriptorBindingUpdateUnusedWhilePending == VK_TRUE;
+
     std::vector<VkDescriptorBindingFlagsEXT> bindings_flags(bindings_.size(), 0);
     for (size_t i = 0; i < bindings_.size(); i++) {
       const VkDescriptorSetLayoutBinding &binding = bindings_[i];
       if (binding.descriptorCount > 1 && features12.descriptorBindingPartiallyBound == VK_TRUE)
         bindings_flags[i] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+      if (binding.descriptorCount > 1 && binding.descriptorType == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+          && update_unused_while_pending_)
+        bindings_flags[i] |= VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT
+                           | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
     }
 
     VkDescriptorSetLayoutBindingFlagsCreateInfo bindings_flags_info = {};
@@ -387,7 +401,8 @@ class pipeline {
   pipeline &operator=(pipeline &&) noexcept = delete;
 
   explicit pipeline(render_target &_target, const pipeline_params &_params = {})
-      : device_ref_(_target.parent().device())
+      : display_(_target.parent())
+      , device_ref_(_target.parent().device())
       , render_pass_(_target.renderpass()) {
     HUT_PROFILE_SCOPE(PPIPELINE, "pipeline({},{})::pipeline", TVertexRefl::FILENAME, TFragRefl::FILENAME)
     assert(render_pass_ != VK_NULL_HANDLE);
@@ -490,10 +505,10 @@ class pipeline {
     }
 
     void atlas(uint _binding, const shared_atlas &_atlas, const shared_sampler &_sampler) {
-      for (auto &page : _atlas->pages_) {
+      for (uint i = 0; i < _atlas->descriptor_count(); i++) {
         VkDescriptorImageInfo info = {};
         info.imageLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        info.imageView             = page.image_->view();
+        info.imageView             = _atlas->pages_[i].image_->view();
         info.sampler               = _sampler->underlying();
         images_.emplace_back(info);
       }
@@ -504,8 +519,8 @@ class pipeline {
       write.dstBinding           = _binding;
       write.dstArrayElement      = 0;
       write.descriptorType       = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-      write.descriptorCount      = _atlas->page_count();
-      write.pImageInfo           = &images_.back() - (_atlas->page_count() - 1);
+      write.descriptorCount      = _atlas->descriptor_count();
+      write.pImageInfo           = &images_.back() - (_atlas->descriptor_count() - 1);
       writes_.emplace_back(write);
     }
   };
@@ -561,11 +576,12 @@ class pipeline {
     _context.atlas(_binding, _atlas, _sampler);
     write_continue(_binding + 1, _context, std::forward<const TRest &>(_rest)...);
 
-    auto &atlas_info      = atlas_infos_[_atlas];
-    atlas_info.binding_   = _binding;
-    auto &desc_info       = atlas_info.descriptors_info_[_context.descriptor_index_];
-    desc_info.sampler_    = _sampler;
-    desc_info.last_bound_ = _atlas->page_count();
+    auto &atlas_info           = atlas_infos_[_atlas];
+    atlas_info.binding_        = _binding;
+    auto &desc_info            = atlas_info.descriptors_info_[_context.descriptor_index_];
+    desc_info.sampler_         = _sampler;
+    desc_info.last_bound_      = _atlas->descriptor_count();
+    desc_info.last_generation_ = _atlas->generation();
   }
 
   void write(uint _descriptor_index, const TExtraAttachments &..._attachments) {
@@ -581,21 +597,37 @@ class pipeline {
   }
 
   void update_atlas(uint _descriptor_index, const shared_atlas &_atlas) {
+    std::lock_guard lk(atlas_mutex_);
     assert(descriptor_attached(_descriptor_index));
     assert(atlas_infos_.find(_atlas) != atlas_infos_.end());
     auto &atlas_status = atlas_infos_[_atlas];
     assert(atlas_status.descriptors_info_.find(_descriptor_index) != atlas_status.descriptors_info_.end());
     auto &desc_info = atlas_status.descriptors_info_[_descriptor_index];
-    uint  new_count = _atlas->page_count();
-
-    assert(desc_info.last_bound_ <= new_count);
-    uint diff = new_count - desc_info.last_bound_;
+    uint  new_count = _atlas->descriptor_count();
+
+    // Compaction or growing layers replaces all the pages, and may leave less of them:
+    // stale entries are pointed to the first page
+    uint first = desc_info.last_bound_, count = new_count;
+    bool in_use = !update_unused_while_pending_;
+    if (desc_info.last_generation_ != _atlas->generation()) {
+      first                      = 0;
+      count                      = std::max(new_count, desc_info.last_bound_);
+      desc_info.last_generation_ = _atlas->generation();
+      in_use                     = true;
+    }
+    assert(first <= count);
+    uint diff = count - first;
     if (diff > 0) {
+      // Rewritten entries may be read by frames in flight, this is rare enough to wait for them
+      if (in_use)
+        display_.wait_graphics();
+
       std::vector<VkDescriptorImageInfo> image_infos(diff);
       for (uint i = 0; i < diff; i++) {
+        const uint             page = first + i < new_count ? first + i : 0;
         VkDescriptorImageInfo &info = image_infos[i];
         info.imageLayout            = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        info.imageView              = _atlas->pages_[desc_info.last_bound_ + i].image_->view();
+        info.imageView              = _atlas->pages_[page].image_->view();
         info.sampler                = desc_info.sampler_->underlying();
       }
 
@@ -603,14 +635,14 @@ class pipeline {
       write.sType                = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
       write.dstSet               = descriptors_[_descriptor_index];
       write.dstBinding           = atlas_status.binding_;
-      write.dstArrayElement      = desc_info.last_bound_;
+      write.dstArrayElement      = first;
       write.descriptorType       = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
       write.descriptorCount      = image_infos.size();
       write.pImageInfo           = image_infos.data();
 
       HUT_PVK(vkUpdateDescriptorSets, device_ref_, 1, &write, 0, nullptr);
-      desc_info.last_bound_ = new_count;
     }
+    desc_info.last_bound_ = new_count;
   }
 
   bool descriptor_attached(uint _descriptor_index) {
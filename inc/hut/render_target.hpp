@@ -50,6 +50,7 @@ struct render_target_params {
   VkImageLayout            initial_layout_      = VK_IMAGE_LAYOUT_UNDEFINED;
   VkImageLayout            final_layout_        = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
   flags                    flags_{};
+  bool                     partial_redraw_ = false;  // Also create a pass loading the target, see clear_area
 };
 
 class render_target {
@@ -79,13 +80,40 @@ class render_target {
   shared_image          msaa_rendertarget_;
   VkSampleCountFlagBits sample_count_ = VK_SAMPLE_COUNT_1_BIT;
 
-  VkRenderPass               renderpass_ = VK_NULL_HANDLE;
+  VkRenderPass               renderpass_         = VK_NULL_HANDLE;
+  VkRenderPass               renderpass_partial_ = VK_NULL_HANDLE;  // Starts from final_layout_ content
   std::vector<VkFramebuffer> fbos_;
 
-  void        reinit_pass(const shared_buffer &_storage, const render_target_params &_init_params,
-                          std::span<VkImageView> _images);
-  void        begin_rebuild_cb(VkFramebuffer _fbo, VkCommandBuffer _cb);
+  // Pass objects replaced by reinit_pass, that command buffers still in flight may reference
+  struct retired_pass {
+    VkRenderPass               renderpass_         = VK_NULL_HANDLE;
+    VkRenderPass               renderpass_partial_ = VK_NULL_HANDLE;
+    std::vector<VkFramebuffer> fbos_;
+    shared_image               depth_;
+    shared_image               msaa_rendertarget_;
+  };
+
+  // Secondary command buffers with their own command pool, so that each can be recorded on a different thread
+  struct secondary_pool {
+    VkCommandPool                pool_ = VK_NULL_HANDLE;
+    std::vector<VkCommandBuffer> cbs_;
+  };
+
+  void        alloc_secondary_pool(secondary_pool &_secondaries, uint _count);
+  void        destroy_secondary_pool(secondary_pool &_secondaries);
+  void        reinit_pass(const render_target_params &_init_params, std::span<VkImageView> _images,
+                          retired_pass *_retired = nullptr);
+  void        destroy_pass(retired_pass &_retired);
+  // A non null _area only renders there, with renderpass_partial_ and a matching scissor
+  void        begin_rebuild_cb(VkFramebuffer _fbo, VkCommandBuffer _cb,
+                               VkSubpassContents _contents = VK_SUBPASS_CONTENTS_INLINE,
+                               const VkRect2D   *_area     = nullptr);
   static void end_rebuild_cb(VkCommandBuffer _cb);
+  // With VK_NV_inherited_viewport_scissor, _area is ignored and the viewport and scissor come from the primary
+  void        begin_secondary_cb(VkFramebuffer _fbo, VkCommandBuffer _cb, const VkRect2D *_area = nullptr);
+  static void end_secondary_cb(VkCommandBuffer _cb);
+  void        clear_area(VkCommandBuffer _cb, const VkRect2D &_area);  // Color only, depth is cleared by the pass
+  void        set_viewport(VkCommandBuffer _cb, const VkRect2D *_scissor = nullptr);
 };
 
 }  // namespace hut
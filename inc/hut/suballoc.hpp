@@ -97,6 +97,16 @@ class suballoc {
   }
   updator_t update() { return update(0, size()); }
 
+  // Go through staging even on direct mapped pages, so that the write is ordered after the frames reading the range
+  updator_t update_staged_raw(uint _offset_bytes, uint _size_bytes) {
+    assert(_offset_bytes + _size_bytes <= size_bytes_);
+    return parent_->template update_staged_raw<TContained>(offset_bytes_ + _offset_bytes, _size_bytes);
+  }
+  updator_t update_staged(uint _offset, uint _size = 1) {
+    return update_staged_raw(_offset * sizeof(TContained), _size * sizeof(TContained));
+  }
+  updator_t update_staged() { return update_staged(0, size()); }
+
   void zero_raw(uint _offset_bytes, uint _size_bytes) {
     assert(_offset_bytes + _size_bytes <= size_bytes_);
     return parent_->zero_raw(offset_bytes_ + _offset_bytes, _size_bytes);
@@ -104,6 +114,14 @@ class suballoc {
   void zero(uint _offset, uint _size = 1) { zero_raw(_offset * sizeof(TContained), _size * sizeof(TContained)); }
   void zero() { zero(0, size()); }
 
+  void zero_staged_raw(uint _offset_bytes, uint _size_bytes) {
+    assert(_offset_bytes + _size_bytes <= size_bytes_);
+    return parent_->zero_raw(offset_bytes_ + _offset_bytes, _size_bytes, true);
+  }
+  void zero_staged(uint _offset, uint _size = 1) {
+    zero_staged_raw(_offset * sizeof(TContained), _size * sizeof(TContained));
+  }
+
   void set(std::span<const TContained> _data) { update().set(_data); }
   void set(std::initializer_list<TContained> _data) { update().set(_data); }
   void set(const TContained &_data) { set(std::span<const TContained>{&_data, 1}); }
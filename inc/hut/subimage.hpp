@@ -32,10 +32,14 @@
 namespace hut {
 
 class subimage {
+  friend class atlas;
+
  private:
   atlas     *atlas_ = nullptr;
   uint       page_{};
   u16bbox_px bounds_{};
+  u64        last_use_ = 0;  // Frame of the atlas when last touched, used for eviction
+  uint       pins_     = 0;
 
  public:
   subimage() = default;
@@ -45,12 +49,16 @@ class subimage {
   subimage(subimage &&_other) noexcept
       : atlas_(std::exchange(_other.atlas_, nullptr))
       , page_(_other.page_)
-      , bounds_(_other.bounds_) {}
+      , bounds_(_other.bounds_)
+      , last_use_(_other.last_use_)
+      , pins_(_other.pins_) {}
   subimage &operator=(subimage &&_other) noexcept {
     if (&_other != this) {
-      atlas_  = std::exchange(_other.atlas_, nullptr);
-      page_   = _other.page_;
-      bounds_ = _other.bounds_;
+      atlas_    = std::exchange(_other.atlas_, nullptr);
+      page_     = _other.page_;
+      bounds_   = _other.bounds_;
+      last_use_ = _other.last_use_;
+      pins_     = _other.pins_;
     }
     return *this;
   }
@@ -74,6 +82,13 @@ class subimage {
   [[nodiscard]] u16bbox_px bounds() const { return bounds_; }
   [[nodiscard]] vec4       texcoords() const;
 
+  // Only matter for atlases with eviction enabled, pinned sub-images are never evicted. Pins are counted, so that each
+  // user can pin what it draws, and unpinning touches the sub-image so that it ages from its last use.
+  void               touch();
+  void               pin() { pins_++; }
+  void               unpin();
+  [[nodiscard]] bool pinned() const { return pins_ != 0; }
+
   image::updator update(u16bbox_px _bounds);
   image::updator update() { return update(bounds_); }
 };
@@ -27,8 +27,15 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <bit>
+#include <deque>
+#include <map>
 #include <optional>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 
 #include "hut/utils/glm.hpp"
 
@@ -120,7 +127,10 @@ class linear1d {
       // Increase size of previous block, and offset of current, so that it's aligned
       blocks_[_fit.index_ - 1].size_ += align_bytes;
       blocks_[_fit.index_].offset_ = _fit.aligned_offset_;
+      if (blocks_[_fit.index_ - 1].used_)
+        allocated_size_ += align_bytes;
     }
+    allocated_size_ += _fit.aligned_size_;
     blocks_[_fit.index_].used_ = true;
     blocks_[_fit.index_].size_ = _fit.aligned_size_;
     assert(_fit.aligned_size_ > 0);
@@ -169,7 +179,6 @@ class linear1d {
     if (!first_fit)
       return {};
     last_found_fit_ = first_fit->index_;
-    allocated_size_ += _size;
     return split(*first_fit);
   }
 
@@ -199,6 +208,8 @@ class linear1d {
     return blocks_.size() == 1 && !blocks_[0].used_;
   }
 
+  [[nodiscard]] size_t metadata_byte_size() const { return sizeof(*this) + blocks_.capacity() * sizeof(block); }
+
   [[nodiscard]] TSizeType lower_bound() const {
     for (auto it = blocks_.cbegin(); it != blocks_.cend(); ++it) {
       if (it->used_)
@@ -223,6 +234,478 @@ class linear1d {
   }
 };
 
+template<typename TSizeType>
+class ring1d {
+  // NOTE JBL: Allocates after the last allocation and wraps around at the end of the pool, space is only reclaimed
+  //           in allocation order, which makes it a good fit for short lived allocations like staging.
+
+ public:
+  struct block {
+    bool      used_;
+    TSizeType offset_;
+    TSizeType size_;
+    bool      open_ = false;  // Shared block still being sub-allocated, see pack_shared
+    int64_t   refs_ = 1;      // Offers left before the block is reclaimed, may go negative while open
+  };
+
+ private:
+  using base_type = TSizeType;
+  using type      = TSizeType;
+
+  TSizeType         pool_size_, allocated_size_ = 0, high_water_ = 0;
+  TSizeType         head_ = 0;
+  std::deque<block> blocks_;  // Reserved ranges, including alignment padding, in allocation order
+
+  struct fit {
+    TSizeType begin_;
+    TSizeType aligned_offset_;
+    TSizeType end_;
+    bool      wraps_;
+  };
+
+  [[nodiscard]] bool wrapped() const { return !blocks_.empty() && head_ <= blocks_.front().offset_; }
+
+  [[nodiscard]] std::optional<fit> find_fit(TSizeType _size, TSizeType _align) const {
+    if (blocks_.empty()) {
+      if (_size > pool_size_)
+        return {};
+      return fit{0, 0, _size, false};
+    }
+
+    const auto tail           = blocks_.front().offset_;
+    const auto aligned_offset = align<TSizeType>(head_, _align);
+    if (wrapped()) {
+      if (aligned_offset + _size <= tail)
+        return fit{head_, aligned_offset, TSizeType(aligned_offset + _size), false};
+      return {};
+    }
+
+    if (aligned_offset + _size <= pool_size_)
+      return fit{head_, aligned_offset, TSizeType(aligned_offset + _size), false};
+    if (_size <= tail)
+      return fit{0, 0, _size, true};
+    return {};
+  }
+
+ public:
+  explicit ring1d(TSizeType _pool_size)
+      : pool_size_(_pool_size) {
+    reset();
+  }
+
+  std::optional<TSizeType> pack(TSizeType _size, TSizeType _align = 0) { return pack_impl(_size, _align, false); }
+
+  // Reserves a block that the caller sub-allocates, each sub-allocation is offered separately, and the block is
+  // reclaimed once close was called with the number of sub-allocations, and all of them were offered.
+  std::optional<TSizeType> pack_shared(TSizeType _size, TSizeType _align = 0) { return pack_impl(_size, _align, true); }
+
+  void close(TSizeType _offset, TSizeType _sub_count) {
+    auto &found = find_block(_offset);
+    assert(found.open_);
+    found.open_ = false;
+    found.refs_ += _sub_count;
+    release(found);
+  }
+
+  [[nodiscard]] bool try_fit(TSizeType _size, TSizeType _align = 0) const {
+    return find_fit(_size, _align).has_value();
+  }
+
+  void offer(TSizeType _offset) {
+    auto &found = find_block(_offset);
+    found.refs_--;
+    release(found);
+  }
+
+  void reset() {
+    blocks_.clear();
+    head_           = 0;
+    allocated_size_ = 0;
+  }
+
+  [[nodiscard]] TSizeType capacity() const { return pool_size_; }
+  [[nodiscard]] TSizeType allocated() const { return allocated_size_; }
+  [[nodiscard]] TSizeType free() const { return pool_size_ - allocated_size_; }
+  [[nodiscard]] TSizeType high_water() const { return high_water_; }
+  [[nodiscard]] bool      empty() const { return blocks_.empty(); }
+
+  [[nodiscard]] size_t metadata_byte_size() const { return sizeof(*this) + blocks_.size() * sizeof(block); }
+
+  [[nodiscard]] TSizeType lower_bound() const { return wrapped() || blocks_.empty() ? 0 : blocks_.front().offset_; }
+  [[nodiscard]] TSizeType upper_bound() const { return wrapped() ? pool_size_ : head_; }
+
+  template<typename TVisitor>
+  void visit_blocks(TVisitor _visitor) const {
+    for (const auto &block : blocks_)
+      if (!_visitor(block))
+        break;
+  }
+
+ private:
+  block &find_block(TSizeType _offset) {
+    // Usually the oldest block, so searching from the front is cheap
+    auto it = std::find_if(blocks_.begin(), blocks_.end(), [_offset](const block &_block) {
+      return _block.used_ && _offset >= _block.offset_ && _offset < _block.offset_ + _block.size_;
+    });
+    assert(it != blocks_.end());
+    return *it;
+  }
+
+  void release(block &_block) {
+    _block.used_ = _block.open_ || _block.refs_ != 0;
+    while (!blocks_.empty() && !blocks_.front().used_) {
+      allocated_size_ -= blocks_.front().size_;
+      blocks_.pop_front();
+    }
+  }
+
+  std::optional<TSizeType> pack_impl(TSizeType _size, TSizeType _align, bool _shared) {
+    assert(_size > 0);
+    auto found = find_fit(_size, _align);
+    if (!found)
+      return {};
+
+    if (blocks_.empty()) {
+      head_ = 0;
+    } else if (found->wraps_) {
+      // The end of the pool is lost until the last block is reclaimed
+      blocks_.back().size_ += pool_size_ - head_;
+      allocated_size_ += pool_size_ - head_;
+    }
+    const TSizeType reserved = found->end_ - found->begin_;
+    blocks_.emplace_back(block{true, found->begin_, reserved, _shared, _shared ? 0 : 1});
+    allocated_size_ += reserved;
+    high_water_ = std::max(high_water_, allocated_size_);
+    head_       = found->end_;
+    return found->aligned_offset_;
+  }
+};
+
+template<typename TSizeType>
+class tlsf1d {
+  // Two-level segregated fit: free blocks are binned by size, by power of two first, then linearly inside each power
+  // of two. Bitmaps of the non-empty bins find a big enough block in constant time, and used blocks are indexed by
+  // offset for offer. Block headers are kept out of the pool, so there's no minimal block size.
+
+ public:
+  struct block {
+    bool      used_;
+    TSizeType offset_;
+    TSizeType size_;
+  };
+
+ private:
+  using base_type = TSizeType;
+  using type      = TSizeType;
+
+  constexpr static uint SL_LOG2  = 4;
+  constexpr static uint SL_COUNT = 1u << SL_LOG2;
+  constexpr static uint FL_COUNT = sizeof(TSizeType) * 8 - SL_LOG2 + 1;
+  constexpr static u32  NONE     = ~u32(0);
+
+  struct node {
+    block block_;
+    u32   prev_phys_ = NONE, next_phys_ = NONE;  // Neighbours in the pool
+    u32   prev_free_ = NONE, next_free_ = NONE;  // Neighbours in the bin, while free
+  };
+
+  struct bin {
+    uint fl_, sl_;
+  };
+
+  TSizeType                                       pool_size_, allocated_size_ = 0;
+  std::vector<node>                               nodes_;
+  std::vector<u32>                                recycled_;
+  u32                                             first_ = NONE, last_ = NONE;
+  u64                                             fl_bitmap_ = 0;
+  std::array<u32, FL_COUNT>                       sl_bitmaps_;
+  std::array<std::array<u32, SL_COUNT>, FL_COUNT> bins_;
+  std::unordered_map<TSizeType, u32>              used_;  // Offset to node
+
+  [[nodiscard]] static bin mapping(TSizeType _size) {
+    if (_size < SL_COUNT)
+      return {0, uint(_size)};
+    const uint log2 = std::bit_width(_size) - 1;
+    return {log2 - SL_LOG2 + 1, uint(_size >> (log2 - SL_LOG2)) - SL_COUNT};
+  }
+
+  [[nodiscard]] static bool fits(const block &_block, TSizeType _size, TSizeType _align) {
+    const TSizeType aligned_offset = align<TSizeType>(_block.offset_, _align);
+    return aligned_offset - _block.offset_ + _size <= _block.size_;
+  }
+
+  [[nodiscard]] std::optional<u32> find_free(TSizeType _size, TSizeType _align) const {
+    // Worst case padding is requested, and rounded up to the next bin, so that any block of the found bin fits
+    TSizeType padded = _align > 1 ? _size + _align - 1 : _size;
+    if (padded > pool_size_)
+      return {};
+    const bin exact = mapping(padded);
+    if (padded >= SL_COUNT)
+      padded += (TSizeType(1) << (std::bit_width(padded) - 1 - SL_LOG2)) - 1;
+
+    auto [fl, sl] = mapping(padded);
+    u32 sl_map    = fl < FL_COUNT ? sl_bitmaps_[fl] & (~0u << sl) : 0;
+    if (sl_map == 0) {
+      const u64 fl_map = fl + 1 < FL_COUNT ? fl_bitmap_ & (~u64(0) << (fl + 1)) : 0;
+      if (fl_map != 0) {
+        fl     = std::countr_zero(fl_map);
+        sl_map = sl_bitmaps_[fl];
+      }
+    }
+    if (sl_map != 0)
+      return bins_[fl][std::countr_zero(sl_map)];
+
+    // Blocks of the bin holding the request itself may still be big enough
+    for (u32 index = bins_[exact.fl_][exact.sl_]; index != NONE; index = nodes_[index].next_free_) {
+      if (fits(nodes_[index].block_, _size, _align))
+        return index;
+    }
+    return {};
+  }
+
+  void insert_free(u32 _index) {
+    auto &inserted = nodes_[_index];
+    assert(!inserted.block_.used_);
+    const auto [fl, sl] = mapping(inserted.block_.size_);
+    inserted.prev_free_ = NONE;
+    inserted.next_free_ = bins_[fl][sl];
+    if (inserted.next_free_ != NONE)
+      nodes_[inserted.next_free_].prev_free_ = _index;
+    bins_[fl][sl] = _index;
+    sl_bitmaps_[fl] |= 1u << sl;
+    fl_bitmap_ |= u64(1) << fl;
+  }
+
+  void remove_free(u32 _index) {
+    auto &removed       = nodes_[_index];
+    const auto [fl, sl] = mapping(removed.block_.size_);
+    if (removed.prev_free_ != NONE)
+      nodes_[removed.prev_free_].next_free_ = removed.next_free_;
+    else
+      bins_[fl][sl] = removed.next_free_;
+    if (removed.next_free_ != NONE)
+      nodes_[removed.next_free_].prev_free_ = removed.prev_free_;
+
+    if (bins_[fl][sl] == NONE) {
+      sl_bitmaps_[fl] &= ~(1u << sl);
+      if (sl_bitmaps_[fl] == 0)
+        fl_bitmap_ &= ~(u64(1) << fl);
+    }
+  }
+
+  // Shrinks the block to _size, the rest goes to a new free block right after it, which is returned
+  u32 split(u32 _index, TSizeType _size) {
+    u32 tail;
+    if (recycled_.empty()) {
+      tail = u32(nodes_.size());
+      nodes_.emplace_back();
+    } else {
+      tail = recycled_.back();
+      recycled_.pop_back();
+    }
+
+    auto &head = nodes_[_index];
+    auto &rest = nodes_[tail];
+    rest       = node{block{false, TSizeType(head.block_.offset_ + _size), TSizeType(head.block_.size_ - _size)}};
+    head.block_.size_ = _size;
+    rest.prev_phys_   = _index;
+    rest.next_phys_   = head.next_phys_;
+    head.next_phys_   = tail;
+    if (rest.next_phys_ != NONE)
+      nodes_[rest.next_phys_].prev_phys_ = tail;
+    else
+      last_ = tail;
+    return tail;
+  }
+
+  // Grows the block over its next neighbour, that is recycled
+  void absorb_next(u32 _index) {
+    auto      &grown   = nodes_[_index];
+    const u32  next    = grown.next_phys_;
+    const auto removed = nodes_[next];
+    grown.block_.size_ += removed.block_.size_;
+    grown.next_phys_ = removed.next_phys_;
+    if (removed.next_phys_ != NONE)
+      nodes_[removed.next_phys_].prev_phys_ = _index;
+    else
+      last_ = _index;
+    recycled_.emplace_back(next);
+  }
+
+ public:
+  explicit tlsf1d(TSizeType _pool_size)
+      : pool_size_(_pool_size) {
+    reset();
+  }
+
+  std::optional<TSizeType> pack(TSizeType _size, TSizeType _align = 0) {
+    assert(_size > 0);
+    auto found = find_free(_size, _align);
+    if (!found)
+      return {};
+
+    u32 index = *found;
+    remove_free(index);
+    const TSizeType offset         = nodes_[index].block_.offset_;
+    const TSizeType aligned_offset = align<TSizeType>(offset, _align);
+    if (aligned_offset != offset) {
+      // The padding stays free on its own
+      const u32 padding = index;
+      index             = split(padding, aligned_offset - offset);
+      insert_free(padding);
+    }
+    if (nodes_[index].block_.size_ > _size)
+      insert_free(split(index, _size));
+
+    nodes_[index].block_.used_ = true;
+    used_.emplace(aligned_offset, index);
+    allocated_size_ += _size;
+    return aligned_offset;
+  }
+
+  [[nodiscard]] bool try_fit(TSizeType _size, TSizeType _align = 0) const {
+    return find_free(_size, _align).has_value();
+  }
+
+  void offer(TSizeType _offset) {
+    auto found = used_.find(_offset);
+    assert(found != used_.end());
+    u32 index = found->second;
+    used_.erase(found);
+
+    auto &offered = nodes_[index].block_;
+    allocated_size_ -= offered.size_;
+    offered.used_ = false;
+
+    // Free neighbours are merged right away, so free blocks never touch each other
+    const u32 next = nodes_[index].next_phys_;
+    if (next != NONE && !nodes_[next].block_.used_) {
+      remove_free(next);
+      absorb_next(index);
+    }
+    const u32 prev = nodes_[index].prev_phys_;
+    if (prev != NONE && !nodes_[prev].block_.used_) {
+      remove_free(prev);
+      absorb_next(prev);
+      index = prev;
+    }
+    insert_free(index);
+  }
+
+  void reset() {
+    nodes_.clear();
+    recycled_.clear();
+    used_.clear();
+    fl_bitmap_ = 0;
+    sl_bitmaps_.fill(0);
+    for (auto &sl_bins : bins_)
+      sl_bins.fill(NONE);
+
+    nodes_.emplace_back(node{block{false, 0, pool_size_}});
+    first_          = 0;
+    last_           = 0;
+    allocated_size_ = 0;
+    insert_free(first_);
+  }
+
+  [[nodiscard]] TSizeType capacity() const { return pool_size_; }
+  [[nodiscard]] TSizeType allocated() const { return allocated_size_; }
+  [[nodiscard]] TSizeType free() const { return pool_size_ - allocated_size_; }
+  [[nodiscard]] bool      empty() const { return used_.empty(); }
+
+  [[nodiscard]] size_t metadata_byte_size() const {
+    // Index entries are estimated as a hash node holding the pair and a next pointer
+    const size_t index_bytes = used_.bucket_count() * sizeof(void *)
+                             + used_.size() * (sizeof(std::pair<TSizeType, u32>) + sizeof(void *));
+    return sizeof(*this) + nodes_.capacity() * sizeof(node) + recycled_.capacity() * sizeof(u32) + index_bytes;
+  }
+
+  [[nodiscard]] TSizeType lower_bound() const {
+    if (used_.empty())
+      return 0;
+    const auto &first = nodes_[first_];
+    return first.block_.used_ ? first.block_.offset_ : nodes_[first.next_phys_].block_.offset_;
+  }
+
+  [[nodiscard]] TSizeType upper_bound() const {
+    if (used_.empty())
+      return 0;
+    const auto &last = nodes_[last_];
+    const auto &used = last.block_.used_ ? last.block_ : nodes_[last.prev_phys_].block_;
+    return used.offset_ + used.size_;
+  }
+
+  template<typename TVisitor>
+  void visit_blocks(TVisitor _visitor) const {
+    for (u32 index = first_; index != NONE; index = nodes_[index].next_phys_)
+      if (!_visitor(nodes_[index].block_))
+        break;
+  }
+};
+
+enum packer1d {
+  PLINEAR1D,  // First fit, allocations stay packed at the start of the pool
+  PTLSF1D,    // Constant time pack and offer, for pools with many live allocations
+};
+
+template<typename TSizeType>
+class dynamic1d {
+  // Packer picked at runtime, for containers that let their user choose
+  using impl_t = std::variant<linear1d<TSizeType>, tlsf1d<TSizeType>>;
+
+  impl_t impl_;
+
+  static impl_t make(packer1d _packer, TSizeType _pool_size) {
+    if (_packer == PTLSF1D)
+      return tlsf1d<TSizeType>{_pool_size};
+    return linear1d<TSizeType>{_pool_size};
+  }
+
+ public:
+  dynamic1d(packer1d _packer, TSizeType _pool_size)
+      : impl_(make(_packer, _pool_size)) {}
+
+  std::optional<TSizeType> pack(TSizeType _size, TSizeType _align = 0) {
+    return std::visit([=](auto &_impl) { return _impl.pack(_size, _align); }, impl_);
+  }
+  [[nodiscard]] bool try_fit(TSizeType _size, TSizeType _align = 0) const {
+    return std::visit([=](const auto &_impl) { return _impl.try_fit(_size, _align); }, impl_);
+  }
+  void offer(TSizeType _offset) {
+    std::visit([=](auto &_impl) { _impl.offer(_offset); }, impl_);
+  }
+  void reset() {
+    std::visit([](auto &_impl) { _impl.reset(); }, impl_);
+  }
+
+  [[nodiscard]] TSizeType capacity() const {
+    return std::visit([](const auto &_impl) { return _impl.capacity(); }, impl_);
+  }
+  [[nodiscard]] TSizeType allocated() const {
+    return std::visit([](const auto &_impl) { return _impl.allocated(); }, impl_);
+  }
+  [[nodiscard]] TSizeType free() const {
+    return std::visit([](const auto &_impl) { return _impl.free(); }, impl_);
+  }
+  [[nodiscard]] bool empty() const {
+    return std::visit([](const auto &_impl) { return _impl.empty(); }, impl_);
+  }
+  [[nodiscard]] size_t metadata_byte_size() const {
+    return std::visit([](const auto &_impl) { return _impl.metadata_byte_size(); }, impl_);
+  }
+  [[nodiscard]] TSizeType lower_bound() const {
+    return std::visit([](const auto &_impl) { return _impl.lower_bound(); }, impl_);
+  }
+  [[nodiscard]] TSizeType upper_bound() const {
+    return std::visit([](const auto &_impl) { return _impl.upper_bound(); }, impl_);
+  }
+
+  template<typename TVisitor>
+  void visit_blocks(TVisitor _visitor) const {
+    std::visit([&](const auto &_impl) { _impl.visit_blocks(_visitor); }, impl_);
+  }
+};
+
 template<typename TSizeType, typename TUnderlying>
 struct adaptor1d_dummy2d {
   // NOTE JBL: Dummy adapter to display a 1d as 2d
@@ -259,22 +742,36 @@ struct shelve_separator_pow {
 
 template<typename TSizeType, typename TShelveSelector>
 struct shelve {
-  // Uses a linear1d to maintain a shelves list, and another linear1d in each shelve to arrange elements horizontally
+  // Uses a linear1d to maintain a shelves list. Rows are indexed by y for offer, and by their largest free span inside
+  // their height class for pack, so full rows are never visited. Row spans live in a single shared pool.
   using base_type = TSizeType;
   using type      = vec<2, TSizeType>;
 
-  struct row {
-    TSizeType           y_;
-    linear1d<TSizeType> suballocator_;
+  constexpr static u32 NONE = ~u32(0);
+
+  using row_index = std::multimap<TSizeType, u32>;  // Largest free span -> row
 
-    row(TSizeType _y, TSizeType _sizex)
-        : y_(_y)
-        , suballocator_(_sizex) {}
+  struct span {
+    bool      used_;
+    TSizeType x_, width_;
+    u32       next_ = NONE;
+  };
+
+  struct row {
+    TSizeType                    y_, height_;
+    TSizeType                    largest_free_;
+    u32                          first_span_;
+    typename row_index::iterator by_free_;
   };
 
-  type                                    size_;
-  linear1d<TSizeType>                     shelves_allocator_;
-  std::unordered_multimap<TSizeType, row> rows_;
+  type                                     size_;
+  linear1d<TSizeType>                      shelves_allocator_;
+  std::vector<row>                         rows_;
+  std::vector<u32>                         recycled_rows_;
+  std::vector<span>                        spans_;
+  std::vector<u32>                         recycled_spans_;
+  std::unordered_map<TSizeType, u32>       rows_by_y_;
+  std::unordered_map<TSizeType, row_index> classes_;
 
   explicit shelve(const type &_size)
       : size_(_size)
@@ -283,44 +780,492 @@ struct shelve {
   }
 
   std::optional<type> pack(const type &_size) {
-    auto pow   = TShelveSelector{}.select_shelve(_size.y);
-    auto range = rows_.equal_range(pow);
-    for (auto it = range.first; it != range.second; it++) {
-      auto fit = it->second.suballocator_.pack(_size.x);
-      if (fit)
-        return type{*fit, it->second.y_};
+    if (_size.x == 0 || _size.x > size_.x)
+      return {};
+
+    auto  height = TShelveSelector{}.select_shelve(_size.y);
+    auto &index  = classes_[height];
+    auto  best   = index.lower_bound(_size.x);
+    u32   found;
+    if (best != index.end()) {
+      found = best->second;
+    } else {
+      auto new_row_y = shelves_allocator_.pack(height);
+      if (!new_row_y)
+        return {};
+      found = new_row(*new_row_y, height, index);
+    }
+
+    auto &target = rows_[found];
+    for (u32 current = target.first_span_; current != NONE; current = spans_[current].next_) {
+      if (spans_[current].used_ || spans_[current].width_ < _size.x)
+        continue;
+      if (spans_[current].width_ > _size.x) {
+        auto remainder = new_span(span{false, TSizeType(spans_[current].x_ + _size.x),
+                                       TSizeType(spans_[current].width_ - _size.x), spans_[current].next_});
+        spans_[current].width_ = _size.x;
+        spans_[current].next_  = remainder;
+      }
+      spans_[current].used_ = true;
+      update_largest_free(target, index);
+      return type{spans_[current].x_, target.y_};
+    }
+    assert(false);
+    return {};
+  }
+
+  void offer(const type &_free) {
+    auto it = rows_by_y_.find(_free.y);
+    assert(it != rows_by_y_.end());
+    if (it == rows_by_y_.end())
+      return;
+
+    auto  found  = it->second;
+    auto &target = rows_[found];
+    auto &index  = classes_[target.height_];
+    u32   prev   = NONE;
+    u32   current;
+    for (current = target.first_span_; current != NONE && spans_[current].x_ != _free.x;
+         current = spans_[current].next_)
+      prev = current;
+    assert(current != NONE && spans_[current].used_);
+    if (current == NONE)
+      return;
+
+    spans_[current].used_ = false;
+    auto next             = spans_[current].next_;
+    if (next != NONE && !spans_[next].used_) {
+      spans_[current].width_ += spans_[next].width_;
+      spans_[current].next_ = spans_[next].next_;
+      recycled_spans_.emplace_back(next);
+    }
+    if (prev != NONE && !spans_[prev].used_) {
+      spans_[prev].width_ += spans_[current].width_;
+      spans_[prev].next_ = spans_[current].next_;
+      recycled_spans_.emplace_back(current);
     }
 
-    auto new_row_y = shelves_allocator_.pack(pow);
-    if (!new_row_y)
+    auto &first = spans_[target.first_span_];
+    if (!first.used_ && first.next_ == NONE) {
+      shelves_allocator_.offer(target.y_);
+      index.erase(target.by_free_);
+      recycled_spans_.emplace_back(target.first_span_);
+      recycled_rows_.emplace_back(found);
+      rows_by_y_.erase(it);
+    } else {
+      update_largest_free(target, index);
+    }
+  }
+
+  void reset() {
+    rows_.clear();
+    recycled_rows_.clear();
+    spans_.clear();
+    recycled_spans_.clear();
+    rows_by_y_.clear();
+    classes_.clear();
+    shelves_allocator_.reset();
+  }
+
+  [[nodiscard]] bool empty() const { return shelves_allocator_.empty(); }
+
+  [[nodiscard]] size_t metadata_byte_size() const {
+    // Hash and tree nodes are estimated as their payload plus a next pointer for hashes, and three pointers for trees
+    size_t result = sizeof(*this) - sizeof(shelves_allocator_) + shelves_allocator_.metadata_byte_size();
+    result += rows_.capacity() * sizeof(row) + recycled_rows_.capacity() * sizeof(u32);
+    result += spans_.capacity() * sizeof(span) + recycled_spans_.capacity() * sizeof(u32);
+    result += rows_by_y_.bucket_count() * sizeof(void *);
+    result += rows_by_y_.size() * (sizeof(typename decltype(rows_by_y_)::value_type) + sizeof(void *));
+    result += classes_.bucket_count() * sizeof(void *);
+    for (const auto &[height, index] : classes_) {
+      result += sizeof(height) + sizeof(index) + sizeof(void *);
+      result += index.size() * (sizeof(typename row_index::value_type) + 3 * sizeof(void *));
+    }
+    return result;
+  }
+
+ private:
+  u32 new_span(const span &_span) {
+    if (recycled_spans_.empty()) {
+      spans_.emplace_back(_span);
+      return u32(spans_.size() - 1);
+    }
+    auto result = recycled_spans_.back();
+    recycled_spans_.pop_back();
+    spans_[result] = _span;
+    return result;
+  }
+
+  u32 new_row(TSizeType _y, TSizeType _height, row_index &_index) {
+    row created{_y, _height, size_.x, new_span(span{false, 0, size_.x}), _index.emplace(size_.x, NONE)};
+    u32 result;
+    if (recycled_rows_.empty()) {
+      rows_.emplace_back(created);
+      result = u32(rows_.size() - 1);
+    } else {
+      result = recycled_rows_.back();
+      recycled_rows_.pop_back();
+      rows_[result] = created;
+    }
+    created.by_free_->second = result;
+    rows_by_y_.emplace(_y, result);
+    return result;
+  }
+
+  void update_largest_free(row &_row, row_index &_index) {
+    TSizeType largest = 0;
+    for (u32 current = _row.first_span_; current != NONE; current = spans_[current].next_)
+      if (!spans_[current].used_)
+        largest = std::max(largest, spans_[current].width_);
+    if (largest == _row.largest_free_)
+      return;
+    auto found = _row.by_free_->second;
+    _index.erase(_row.by_free_);
+    _row.largest_free_ = largest;
+    _row.by_free_      = _index.emplace(largest, found);
+  }
+};
+
+template<typename TSizeType>
+struct skyline {
+  // Bottom-left skyline: the top of the packed area is kept as horizontal segments, and rects go where their bottom
+  // edge ends up the lowest. Offer lowers the skyline to the highest rect left under it, holes below the skyline are
+  // only recovered once everything above them is freed.
+  using base_type = TSizeType;
+  using type      = vec<2, TSizeType>;
+
+  struct segment {
+    TSizeType x_, width_, y_;
+  };
+
+  type                          size_;
+  std::vector<segment>          segments_;
+  std::unordered_map<u64, type> used_;  // Origin to size
+
+  explicit skyline(const type &_size)
+      : size_(_size) {
+    reset();
+  }
+
+  std::optional<type> pack(const type &_size) {
+    if (_size.x == 0 || _size.y == 0 || _size.x > size_.x || _size.y > size_.y)
+      return {};
+
+    std::optional<type> best;
+    uint                best_bottom = ~0u;
+    for (size_t i = 0; i < segments_.size() && size_.x - segments_[i].x_ >= _size.x; i++) {
+      const auto x = segments_[i].x_;
+      TSizeType  y = 0;
+      for (size_t j = i; j < segments_.size() && segments_[j].x_ < x + _size.x; j++)
+        y = std::max(y, segments_[j].y_);
+      if (size_.y - y < _size.y || uint(y + _size.y) >= best_bottom)
+        continue;
+      best        = type{x, y};
+      best_bottom = y + _size.y;
+    }
+    if (!best)
       return {};
 
-    auto new_row = rows_.emplace(pow, row{*new_row_y, size_.x});
-    auto fit     = new_row->second.suballocator_.pack(_size.x);
-    assert(fit);
-    return type{*fit, new_row->second.y_};
+    assign(best->x, best->x + _size.x, TSizeType(best_bottom));
+    used_.emplace(key(*best), _size);
+    return best;
   }
 
   void offer(const type &_free) {
-    for (auto it = rows_.begin(); it != rows_.end(); it++) {
-      if (it->second.y_ == _free.y) {
-        auto &allocator = it->second.suballocator_;
-        allocator.offer(_free.x);
-        if (allocator.empty()) {
-          shelves_allocator_.offer(_free.y);
-          rows_.erase(it);
+    auto it = used_.find(key(_free));
+    assert(it != used_.end());
+    if (it == used_.end())
+      return;
+    const TSizeType begin = _free.x, end = _free.x + it->second.x, bottom = _free.y + it->second.y;
+    used_.erase(it);
+    if (used_.empty()) {
+      reset();
+      return;
+    }
+
+    // The skyline only moves where the freed rect was its highest point
+    bool reached = false;
+    for (size_t i = find(begin); i < segments_.size() && segments_[i].x_ < end; i++)
+      reached |= segments_[i].y_ == bottom;
+    if (!reached)
+      return;
+
+    std::vector<TSizeType> edges{begin, end};
+    for (const auto &[origin, size] : used_) {
+      const TSizeType x = origin >> 32;
+      if (x < end && x + size.x > begin) {
+        edges.emplace_back(std::max(x, begin));
+        edges.emplace_back(std::min(TSizeType(x + size.x), end));
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    for (size_t i = 0; i + 1 < edges.size(); i++) {
+      TSizeType highest = 0;
+      for (const auto &[origin, size] : used_) {
+        const TSizeType x = origin >> 32, y = origin & 0xFFFFFFFF;
+        if (x < edges[i + 1] && x + size.x > edges[i])
+          highest = std::max(highest, TSizeType(y + size.y));
+      }
+      assign(edges[i], edges[i + 1], highest);
+    }
+  }
+
+  void reset() {
+    segments_.assign(1, segment{0, size_.x, 0});
+    used_.clear();
+  }
+
+  [[nodiscard]] bool empty() const { return used_.empty(); }
+
+  [[nodiscard]] size_t metadata_byte_size() const {
+    // Hash nodes are estimated as their payload plus a next pointer
+    size_t result = sizeof(*this) + segments_.capacity() * sizeof(segment);
+    result += used_.bucket_count() * sizeof(void *);
+    result += used_.size() * (sizeof(typename decltype(used_)::value_type) + sizeof(void *));
+    return result;
+  }
+
+ private:
+  static u64 key(const type &_origin) { return u64(_origin.x) << 32 | u64(_origin.y); }
+
+  size_t find(TSizeType _x) const {
+    auto it = std::upper_bound(segments_.begin(), segments_.end(), _x,
+                               [](TSizeType _lhs, const segment &_rhs) { return _lhs < _rhs.x_; });
+    return it - segments_.begin() - 1;
+  }
+
+  void split(TSizeType _x) {
+    if (_x >= size_.x)
+      return;
+    auto  index   = find(_x);
+    auto &current = segments_[index];
+    if (current.x_ == _x)
+      return;
+    segment right{_x, TSizeType(current.x_ + current.width_ - _x), current.y_};
+    current.width_ = _x - current.x_;
+    segments_.insert(segments_.begin() + index + 1, right);
+  }
+
+  void assign(TSizeType _begin, TSizeType _end, TSizeType _y) {
+    split(_begin);
+    split(_end);
+    auto first = find(_begin), last = first + 1;
+    while (last < segments_.size() && segments_[last].x_ < _end)
+      last++;
+    segments_[first] = segment{_begin, TSizeType(_end - _begin), _y};
+    segments_.erase(segments_.begin() + first + 1, segments_.begin() + last);
+
+    if (first + 1 < segments_.size() && segments_[first + 1].y_ == _y) {
+      segments_[first].width_ += segments_[first + 1].width_;
+      segments_.erase(segments_.begin() + first + 1);
+    }
+    if (first > 0 && segments_[first - 1].y_ == _y) {
+      segments_[first - 1].width_ += segments_[first].width_;
+      segments_.erase(segments_.begin() + first);
+    }
+  }
+};
+
+template<typename TSizeType>
+struct maxrects {
+  // Keeps every maximal free rect and packs with best short side fit. A freed rect is merged with free rects sharing a
+  // whole edge before going back in the list, so free rects aren't always maximal until the packer empties again.
+  using base_type = TSizeType;
+  using type      = vec<2, TSizeType>;
+
+  struct rect {
+    TSizeType x_, y_, width_, height_;
+  };
+
+  type                          size_;
+  std::vector<rect>             free_;
+  std::vector<rect>             scratch_;
+  std::unordered_map<u64, type> used_;  // Origin to size
+
+  explicit maxrects(const type &_size)
+      : size_(_size) {
+    reset();
+  }
+
+  std::optional<type> pack(const type &_size) {
+    if (_size.x == 0 || _size.y == 0)
+      return {};
+
+    const rect *best = nullptr;
+    uint        best_short = ~0u, best_long = ~0u;
+    for (const auto &candidate : free_) {
+      if (candidate.width_ < _size.x || candidate.height_ < _size.y)
+        continue;
+      const uint leftover_x = candidate.width_ - _size.x, leftover_y = candidate.height_ - _size.y;
+      const uint short_side = std::min(leftover_x, leftover_y), long_side = std::max(leftover_x, leftover_y);
+      if (short_side < best_short || (short_side == best_short && long_side < best_long)) {
+        best       = &candidate;
+        best_short = short_side;
+        best_long  = long_side;
+      }
+    }
+    if (best == nullptr)
+      return {};
+
+    const rect placed{best->x_, best->y_, _size.x, _size.y};
+    scratch_.clear();
+    std::erase_if(free_, [&](const rect &_current) {
+      if (!intersects(_current, placed))
+        return false;
+      const uint current_right = _current.x_ + _current.width_, current_bottom = _current.y_ + _current.height_;
+      const uint placed_right = placed.x_ + placed.width_, placed_bottom = placed.y_ + placed.height_;
+      if (placed.x_ > _current.x_)
+        scratch_.emplace_back(rect{_current.x_, _current.y_, TSizeType(placed.x_ - _current.x_), _current.height_});
+      if (placed_right < current_right)
+        scratch_.emplace_back(
+            rect{TSizeType(placed_right), _current.y_, TSizeType(current_right - placed_right), _current.height_});
+      if (placed.y_ > _current.y_)
+        scratch_.emplace_back(rect{_current.x_, _current.y_, _current.width_, TSizeType(placed.y_ - _current.y_)});
+      if (placed_bottom < current_bottom)
+        scratch_.emplace_back(
+            rect{_current.x_, TSizeType(placed_bottom), _current.width_, TSizeType(current_bottom - placed_bottom)});
+      return true;
+    });
+    const auto first_new = free_.size();
+    free_.insert(free_.end(), scratch_.begin(), scratch_.end());
+    prune(first_new);
+
+    const type result{placed.x_, placed.y_};
+    used_.emplace(key(result), _size);
+    return result;
+  }
+
+  void offer(const type &_free) {
+    auto it = used_.find(key(_free));
+    assert(it != used_.end());
+    if (it == used_.end())
+      return;
+    rect merged{_free.x, _free.y, it->second.x, it->second.y};
+    used_.erase(it);
+    if (used_.empty()) {
+      reset();
+      return;
+    }
+
+    for (bool grown = true; grown;) {
+      grown = false;
+      for (size_t i = 0; i < free_.size(); i++) {
+        const auto &other = free_[i];
+        if (other.y_ == merged.y_ && other.height_ == merged.height_
+            && (other.x_ + other.width_ == merged.x_ || merged.x_ + merged.width_ == other.x_)) {
+          merged.x_ = std::min(merged.x_, other.x_);
+          merged.width_ += other.width_;
+        } else if (other.x_ == merged.x_ && other.width_ == merged.width_
+                   && (other.y_ + other.height_ == merged.y_ || merged.y_ + merged.height_ == other.y_)) {
+          merged.y_ = std::min(merged.y_, other.y_);
+          merged.height_ += other.height_;
+        } else {
+          continue;
         }
-        return;
+        free_.erase(free_.begin() + i);
+        grown = true;
+        break;
       }
     }
+    free_.emplace_back(merged);
+    prune(free_.size() - 1);
   }
 
   void reset() {
-    rows_.clear();
-    shelves_allocator_.reset();
+    free_.assign(1, rect{0, 0, size_.x, size_.y});
+    used_.clear();
+  }
+
+  [[nodiscard]] bool empty() const { return used_.empty(); }
+
+  [[nodiscard]] size_t metadata_byte_size() const {
+    // Hash nodes are estimated as their payload plus a next pointer
+    size_t result = sizeof(*this) + (free_.capacity() + scratch_.capacity()) * sizeof(rect);
+    result += used_.bucket_count() * sizeof(void *);
+    result += used_.size() * (sizeof(typename decltype(used_)::value_type) + sizeof(void *));
+    return result;
+  }
+
+ private:
+  static u64 key(const type &_origin) { return u64(_origin.x) << 32 | u64(_origin.y); }
+
+  static bool intersects(const rect &_a, const rect &_b) {
+    return _a.x_ < _b.x_ + _b.width_ && _b.x_ < _a.x_ + _a.width_ && _a.y_ < _b.y_ + _b.height_
+           && _b.y_ < _a.y_ + _a.height_;
+  }
+
+  static bool contains(const rect &_outer, const rect &_inner) {
+    return _inner.x_ >= _outer.x_ && _inner.y_ >= _outer.y_ && _inner.x_ + _inner.width_ <= _outer.x_ + _outer.width_
+           && _inner.y_ + _inner.height_ <= _outer.y_ + _outer.height_;
+  }
+
+  void prune(size_t _first_new) {
+    // Rects before _first_new were already pruned against each other, only the new ones need checking
+    for (size_t i = _first_new; i < free_.size(); i++) {
+      for (size_t j = 0; j < free_.size(); j++) {
+        if (i == j)
+          continue;
+        if (contains(free_[j], free_[i])) {
+          free_.erase(free_.begin() + i--);
+          break;
+        }
+        if (contains(free_[i], free_[j])) {
+          free_.erase(free_.begin() + j);
+          if (j < i)
+            i--;
+          j--;
+        }
+      }
+    }
+  }
+};
+
+enum packer2d {
+  PSHELVE2D,    // Rows per height class, fast but loses the rounded up height in each row
+  PSKYLINE2D,   // Bottom-left skyline, dense with similar heights, holes under the skyline are lost until freed
+  PMAXRECTS2D,  // Best short side fit over the free rects, densest with mixed sizes but slowest
+};
+
+template<typename TSizeType>
+class dynamic2d {
+  // Packer picked at runtime, for containers that let their user choose
+  using shelve_t = shelve<TSizeType, shelve_separator_align<TSizeType, 8>>;
+  using impl_t   = std::variant<shelve_t, skyline<TSizeType>, maxrects<TSizeType>>;
+
+  impl_t impl_;
+
+  static impl_t make(packer2d _packer, const vec<2, TSizeType> &_size) {
+    if (_packer == PSKYLINE2D)
+      return skyline<TSizeType>{_size};
+    if (_packer == PMAXRECTS2D)
+      return maxrects<TSizeType>{_size};
+    return shelve_t{_size};
+  }
+
+ public:
+  using base_type = TSizeType;
+  using type      = vec<2, TSizeType>;
+
+  dynamic2d(packer2d _packer, const type &_size)
+      : impl_(make(_packer, _size)) {}
+
+  std::optional<type> pack(const type &_size) {
+    return std::visit([&](auto &_impl) { return _impl.pack(_size); }, impl_);
+  }
+  void offer(const type &_free) {
+    std::visit([&](auto &_impl) { _impl.offer(_free); }, impl_);
+  }
+  void reset() {
+    std::visit([](auto &_impl) { _impl.reset(); }, impl_);
   }
 
-  bool empty() { return shelves_allocator_.empty(); }
+  [[nodiscard]] bool empty() const {
+    return std::visit([](const auto &_impl) { return _impl.empty(); }, impl_);
+  }
+  [[nodiscard]] size_t metadata_byte_size() const {
+    return std::visit([](const auto &_impl) { return _impl.metadata_byte_size(); }, impl_);
+  }
 };
 
 }  // namespace hut::binpack
@@ -130,6 +130,7 @@ enum type : u8 {
   END,
   INSTANT,
   COMPLETE,
+  COUNTER,
 };
 inline std::ostream &operator<<(std::ostream &_os, const type &_in) {
   switch (_in) {
@@ -137,6 +138,7 @@ inline std::ostream &operator<<(std::ostream &_os, const type &_in) {
     case type::END: return _os << "E";
     case type::INSTANT: return _os << "I";
     case type::COMPLETE: return _os << "X";
+    case type::COUNTER: return _os << "C";
   }
   return _os;
 }
@@ -314,18 +316,28 @@ class basic_event : public TFirstParent {
 
   static void dump_impl_rec(std::ostream &_os, size_t _index) {}
 
+  template<typename TArg>
+  static void dump_arg(std::ostream &_os, TArg &&_arg) {
+    // Counters are only plotted from numbers
+    if constexpr (std::is_arithmetic_v<std::decay_t<TArg>>)
+      _os << "\":" << +_arg;
+    else
+      _os << "\":\"" << _arg << '"';
+  }
+
   template<fixed_string_array TArgNames, typename TLast>
   static void dump_impl_rec(std::ostream &_os, size_t _index, TLast &&_last) {
     _os << '"';
     escape_json(_os, TArgNames.at(_index));
-    _os << "\":\"" << _last << '"';
+    dump_arg(_os, std::forward<TLast>(_last));
   }
 
   template<fixed_string_array TArgNames, typename TFirst, typename... TArgs>
   static void dump_impl_rec(std::ostream &_os, size_t _index, TFirst &&_first, TArgs &&..._rest) {
     _os << '"';
     escape_json(_os, TArgNames.at(_index));
-    _os << "\":\"" << _first << "\",";
+    dump_arg(_os, std::forward<TFirst>(_first));
+    _os << ',';
     basic_event::dump_impl_rec<TArgNames>(_os, _index + 1, std::forward<TArgs>(_rest)...);
   }
 
@@ -645,6 +657,17 @@ auto make_complete_event_scope(std::vector<TEventType> &_buffer, std::tuple<TEve
                                                          hash,    this_thread<threadid_u16>(), s_slot};
 }
 
+template<fixed_string TFormat, fixed_string_array TArgNames, profiling_category TProfileCat, typename TEventType,
+         typename... TEventArgs>
+void push_counter_event(std::vector<TEventType> &_buffer, std::tuple<TEventArgs...> &&_event_args) {
+  static auto s_slot = dispatcher_repository<dispatcher_u16>::slot(
+      dispatcher_impl<TFormat, TArgNames, type::COUNTER, TProfileCat, TEventType, TEventArgs...>);
+
+  auto hash = register_stacktrace(stacktrace{1, STACKTRACE_DEPTH});
+  _buffer.emplace_back(std::move(_event_args), clock_f32::now(), clock_f32::duration{}, hash,
+                       this_thread<threadid_u16>(), s_slot);
+}
+
 #  define HUT_PROFILE_TRANSFORM_STRINGIFY(MR, MData, MElement) BOOST_PP_STRINGIZE(MElement)
 
 #  define HUT_PROFILE_MAP_DETAIL(MTransform, MSeq) BOOST_PP_SEQ_TO_TUPLE(BOOST_PP_SEQ_TRANSFORM(MTransform, _, MSeq))
@@ -666,6 +689,11 @@ auto make_complete_event_scope(std::vector<TEventType> &_buffer, std::tuple<TEve
 #  define HUT_PROFILE_SCOPE_NAMED(MCat, MFormat, MArgNames, ...)                                                       \
     HUT_PROFILE_SCOPE_IMPL(MCat, MFormat, MArgNames, __VA_ARGS__)
 
+// Samples the values of a counter, args are plotted as stacked series
+#  define HUT_PROFILE_COUNTER_NAMED(MCat, MName, MArgNames, ...)                                                       \
+    ::hut::profiling::push_counter_event<MName, ::hut::fixed_string_array{BOOST_PP_TUPLE_ENUM(MArgNames)}, MCat>(      \
+        ::hut::profiling::threads_data::my_queue(), std::make_tuple(__VA_ARGS__))
+
 #  define HUT_PROFILE_FUN(MCat, ...) HUT_PROFILE_SCOPE(MCat, __FUNCTION__, __VA_ARGS__)
 #  define HUT_PROFILE_FUN_NAMED(MCat, MArgNames, ...)                                                                  \
     HUT_PROFILE_SCOPE_NAMED(MCat, __FUNCTION__, MArgNames, __VA_ARGS__)
@@ -709,6 +737,8 @@ auto make_complete_event_scope(std::vector<TEventType> &_buffer, std::tuple<TEve
 #  define HUT_PROFILE_SCOPE(MCat, MFormat, ...)
 #  define HUT_PROFILE_SCOPE_NAMED(MCat, MFormat, MArgNames, ...)
 
+#  define HUT_PROFILE_COUNTER_NAMED(MCat, MName, MArgNames, ...)
+
 #  define HUT_PROFILE_FUN(MCat, ...)
 #  define HUT_PROFILE_FUN_NAMED(MCat, MArgNames, ...)
 
@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include <map>
 #include <string>
 #include <unordered_set>
 
@@ -64,12 +65,14 @@ struct window_params {
     FVSYNC,
     FTRANSPARENT,
     FFULLSCREEN,
-    FLAG_LAST_VALUE = FFULLSCREEN,
+    FPARTIAL_REDRAW,  // only render what was invalidated, on_draw_ and layers must not set their own scissor
+    FLAG_LAST_VALUE = FPARTIAL_REDRAW,
   };
   using flags = flagged<flag, flag::FLAG_LAST_VALUE>;
 
   flags flags_{FVSYNC};
   uvec2 size_ = {800, 600}, min_size_ = {0, 0}, max_size_ = {0, 0};
+  uint  frames_in_flight_ = 2;  // frames the CPU may record ahead of the GPU
 };
 
 class window final : public render_target {
@@ -83,7 +86,7 @@ class window final : public render_target {
   event<bool>              on_focus_;   // sys gave keyboard focus to win
   event<>                  on_close_;   // overridable, sys requested win to close
   event<u16bbox_px>        on_expose_;  // sys request win to redraw this rect
-  event<VkCommandBuffer>   on_draw_;    // win is dirty, needs to rebuild command buffer
+  event<VkCommandBuffer>   on_draw_;    // win is dirty, needs to rebuild its secondary command buffer
   event<display::duration> on_frame_;   // win will soon be drawn (use this to animate values)
 
 #if defined(HUT_ENABLE_TIME_EVENTS)
@@ -105,13 +108,13 @@ class window final : public render_target {
   window(window &&) noexcept            = delete;
   window &operator=(window &&) noexcept = delete;
 
-  explicit window(display &_display, shared_buffer _storage, const window_params &_init_params = {});
+  explicit window(display &_display, const window_params &_init_params = {});
   ~window() final;
 
   void close();
   void pause();
 
-  void invalidate(const uvec4 &_rect, bool _redraw);
+  void invalidate(const uvec4 &_rect, bool _redraw);  // _rect is left, top, right, bottom in window coordinates
   void invalidate(bool _redraw);
   void maximize(bool _set = true);
   void fullscreen(bool _set = true);
@@ -119,6 +122,10 @@ class window final : public render_target {
   u16vec2_px size() const { return size_; }
   u32        scale() const { return scale_; }
 
+  // Slot of the frame being prepared, in [0, frames_in_flight()), use it to rotate per-frame resources
+  uint frame_index() const { return frame_index_; }
+  uint frames_in_flight() const { return frames_.size(); }
+
   void interactive_resize(edge _edge);
   void interactive_move();
 
@@ -137,6 +144,16 @@ class window final : public render_target {
 
   void dragndrop_target(const std::shared_ptr<drop_target_interface> &_received) { drop_target_interface_ = _received; }
 
+  // Content recorded in its own secondary command buffers, drawn after on_draw_ in creation order.
+  // They are replayed as is until invalidate_layer(), instead of being rebuilt with every invalidate(true).
+  // Stale layers are recorded in parallel on the display recording workers, alongside on_draw_. What they may share is
+  // described by display::record_parallel.
+  using layer_callback = std::function<void(VkCommandBuffer)>;
+  uint add_layer(layer_callback &&_record);
+  void invalidate_layer(uint _layer);
+  void invalidate_layer(uint _layer, const uvec4 &_rect);
+  void remove_layer(uint _layer);
+
   using send_dragndrop_data
       = std::function<void(dragndrop_action /*_action*/, clipboard_format /*_selected_format*/, clipboard_sender &)>;
   void dragndrop_start(dragndrop_actions _supported_actions, clipboard_formats _supported_formats,
@@ -144,7 +161,6 @@ class window final : public render_target {
 
  protected:
   display      &display_;
-  shared_buffer storage_;
   window_params params_;
 
   VkSurfaceKHR surface_ = VK_NULL_HANDLE;
@@ -158,9 +174,49 @@ class window final : public render_target {
   std::vector<VkCommandBuffer> primary_cbs_;
   std::vector<VkCommandBuffer> cbs_;
   std::vector<u8>              dirty_;
+  std::vector<VkSemaphore>     sems_rendered_;     // per swapchain image, presentation may hold it past the fence
+  std::vector<VkFence>         images_in_flight_;  // fence of the last frame that rendered to each swapchain image
+
+  struct frame_sync {
+    VkSemaphore available_ = VK_NULL_HANDLE;
+    VkFence     fence_     = VK_NULL_HANDLE;
+    u64         serial_    = 0;  // serial of the last frame submitted in this slot
+  };
+  std::vector<frame_sync> frames_;
+  uint                    frame_index_  = 0;
+  u64                     frame_serial_ = 0;
+
+  // Replaced swapchain (through oldSwapchain), removed layer or trimmed buffer pages, destroyed once the frames
+  // submitted before are done
+  struct retired_objects {
+    VkSwapchainKHR                     swapchain_ = VK_NULL_HANDLE;
+    std::vector<VkImageView>           imageviews_;
+    std::vector<VkCommandBuffer>       primary_cbs_;
+    std::vector<secondary_pool>        secondaries_;
+    std::vector<VkSemaphore>           sems_rendered_;
+    retired_pass                       pass_;
+    std::vector<std::shared_ptr<void>> retained_;
+    u64                                serial_ = 0;
+  };
+  std::vector<retired_objects> retired_;
+  bool                         surface_outdated_ = false;  // resize received, recreate on next redraw
 
-  VkSemaphore sem_available_ = VK_NULL_HANDLE;
-  VkSemaphore sem_rendered_  = VK_NULL_HANDLE;
+  struct draw_layer {
+    layer_callback  record_;
+    secondary_pool  secondaries_;  // per swapchain image
+    std::vector<u8> dirty_;        // per swapchain image
+  };
+  std::map<uint, draw_layer> layers_;
+  uint                       next_layer_ = 0;
+  secondary_pool             draw_secondaries_;   // per swapchain image, recorded by on_draw_
+  secondary_pool             clear_secondaries_;  // per swapchain image, clears the render area of partial passes
+  std::vector<u8>            primary_dirty_;      // per swapchain image, secondaries or render area changed
+
+  // Per swapchain image, in buffer pixels: what changed since it was last rendered, and the area its command buffers
+  // render to. Images keep their content between frames, so only the damage has to be rendered again.
+  std::vector<uvec4>    damage_;
+  std::vector<VkRect2D> render_areas_;
+  VkExtent2D            render_granularity_ = {1, 1};
 
   u16vec2_px          size_{0_px};
   u16vec2_px          pos_{0_px};
@@ -172,9 +228,16 @@ class window final : public render_target {
 
   std::shared_ptr<drop_target_interface> drop_target_interface_;
 
-  void init_vulkan_surface();
-  void destroy_vulkan();
-  void redraw(display::time_point _tp);
+  void     init_vulkan_surface();
+  void     init_frames();
+  void     damage(const uvec4 &_rect);
+  VkRect2D damaged_area(u32 _image_index);
+  void     collect_retired();
+  void     destroy_retired(retired_objects &_retired);
+  void     retire(std::shared_ptr<void> _resource);  // Released once the frames submitted before are done
+  void     invalidate_layers();                        // Records on_draw_ and every layer again
+  void     destroy_vulkan();
+  void     redraw(display::time_point _tp);
 
   static void surface_enter(void *_data, wl_surface *_surface, wl_output *_output);
   static void surface_leave(void *_data, wl_surface *_surface, wl_output *_output);
@@ -32,24 +32,78 @@
 
 namespace hut {
 
-atlas::atlas(display &_display, shared_buffer _storage, const image_params &_params)
+atlas::atlas(display &_display, const image_params &_params, binpack::packer2d _packer, bool _layered)
     : display_(_display)
-    , storage_(std::move(_storage))
-    , params_(_params) {
+    , params_(_params)
+    , packer_(_packer)
+    , layered_(_layered) {
   HUT_PROFILE_FUN(PIMAGE)
   const auto max_bounds = u16vec2_px{u16_px{_display.limits().maxImageDimension2D}};
   if (params_.size_ == u16vec2_px{0, 0}) {
     params_.size_ = max_bounds;
   }
-  params_.size_ = min(max_bounds, params_.size_);
+  params_.size_     = min(max_bounds, params_.size_);
+  params_.category_ = MATLAS;
   assert(params_.size_.x > 0_px);
   assert(params_.size_.y > 0_px);
+  params_.usage_ |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;  // Pages are copied from by compact
+  if (layered_) {
+    // Linear tiling is only guaranteed for a single layer
+    params_.tiling_ = VK_IMAGE_TILING_OPTIMAL;
+    params_.array_  = true;
+  }
   add_page();
 }
 
 void atlas::add_page() {
   HUT_PROFILE_FUN(PIMAGE)
-  pages_.emplace_back(std::make_shared<image>(display_, storage_, params_));
+  if (!layered_) {
+    pages_.emplace_back(std::make_shared<image>(display_, params_), packer_);
+    return;
+  }
+  if (layers_ == nullptr || pages_.size() == layers_->layers())
+    grow_layers(pages_.size() + 1);
+  pages_.emplace_back(layers_, packer_);
+}
+
+void atlas::grow_layers(uint _layers) {
+  HUT_PROFILE_FUN(PIMAGE, _layers)
+  if (_layers > std::min<uint>(display_.limits().maxImageArrayLayers, NUMAX<u16>))
+    throw std::runtime_error("layered atlas can't grow past the max image array layers");
+  auto params    = params_;
+  params.layers_ = _layers;
+  auto grown     = std::make_shared<image>(display_, params);
+
+  if (layers_ != nullptr) {
+    std::unique_lock lk(display_.staging_mutex_);
+    display::image_copy copy = {};
+    copy.source_             = layers_->image_;
+    copy.destination_        = grown->image_;
+    copy.srcSubresource      = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, layers_->layers()};
+    copy.dstSubresource      = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, layers_->layers()};
+    copy.extent              = {u32(params_.size_.x), u32(params_.size_.y), 1};
+    display_.queue_command(copy);
+    lk.unlock();
+    // Read by the copy, and by the frames in flight until they are recorded again with the grown image
+    display_.retire(std::move(layers_));
+  }
+
+  layers_ = std::move(grown);
+  for (auto &page : pages_)
+    page.image_ = layers_;
+  generation_++;
+  display_.invalidate_layers();
+}
+
+shared_subimage atlas::emplace(uint _page, const u16vec2 &_origin, const u16vec2_px &_bounds) {
+  auto      &page   = pages_[_page];
+  const auto padded = _bounds + PADDING;
+  page.used_px_ += uint(padded.x) * uint(padded.y);
+  page.subimages_++;
+  auto result = std::make_shared<subimage>(this, _page, u16bbox_px::with_origin_size(u16vec2_px{_origin}, _bounds));
+  result->last_use_ = frame();
+  page.live_.emplace(u32(_origin.x) << 16 | u32(_origin.y), result);
+  return result;
 }
 
 shared_subimage atlas::alloc(const u16vec2_px &_bounds) {
@@ -62,33 +116,184 @@ shared_subimage atlas::alloc(const u16vec2_px &_bounds) {
   for (uint i = 0; i < pages_.size(); i++) {
     auto packed = pages_[i].packer_.pack(padded);
     if (packed)
-      return std::make_shared<subimage>(this, i, u16bbox_px::with_origin_size(u16vec2_px{*packed}, _bounds));
+      return emplace(i, *packed, _bounds);
+  }
+  if (evict_ && pages_.size() >= max_pages_) {
+    auto evicted = evict_and_pack(padded);
+    if (evicted)
+      return emplace(evicted->first, evicted->second, _bounds);
   }
   add_page();
   auto packed = pages_.back().packer_.pack(padded);
   assert(packed.has_value());
-  return std::make_shared<subimage>(this, pages_.size() - 1,
-                                    u16bbox_px::with_origin_size(u16vec2_px{*packed}, _bounds));
+  return emplace(pages_.size() - 1, *packed, _bounds);
+}
+
+std::optional<std::pair<uint, u16vec2>> atlas::evict_and_pack(const u16vec2_px &_padded) {
+  HUT_PROFILE_FUN(PIMAGE, _padded)
+  struct candidate {
+    u64                     last_use_;
+    uint                    page_;
+    std::weak_ptr<subimage> sub_;
+  };
+  std::vector<candidate> candidates;
+  const u64              now = frame();
+  for (uint i = 0; i < pages_.size(); i++) {
+    for (const auto &[origin, weak] : pages_[i].live_) {
+      auto sub = weak.lock();
+      if (sub && !sub->pinned() && now - sub->last_use_ >= min_age_)
+        candidates.emplace_back(candidate{sub->last_use_, i, weak});
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const candidate &_a, const candidate &_b) { return _a.last_use_ < _b.last_use_; });
+
+  // Evict one at a time, so that only what's needed to fit the new sub-image is lost
+  for (auto &candidate : candidates) {
+    auto sub = candidate.sub_.lock();
+    if (!sub || !sub->valid())
+      continue;  // Released by an owner while handling a previous eviction
+    on_evict_.fire(sub);
+    sub->release();
+    auto packed = pages_[candidate.page_].packer_.pack(_padded);
+    if (packed)
+      return std::make_pair(candidate.page_, *packed);
+  }
+  return {};
+}
+
+u64 atlas::frame() const {
+  return display_.frame();
+}
+
+void atlas::enable_eviction(uint _max_pages, uint _min_age) {
+  assert(_max_pages > 0);
+  evict_     = true;
+  max_pages_ = _max_pages;
+  min_age_   = _min_age;
 }
 
 shared_subimage atlas::pack(const u16vec2_px &_bounds, std::span<const u8> _data, uint _src_row_pitch) {
   HUT_PROFILE_FUN(PIMAGE, _bounds)
   shared_subimage result = alloc(_bounds);
-  pages_[result->page()].image_->update({result->bounds()}, _data, _src_row_pitch);
+  pages_[result->page()].image_->update({result->bounds(), 0, layer(result->page())}, _data, _src_row_pitch);
   return result;
 }
 
 image::updator atlas::update(const subimage &_sub, const u16bbox_px &_bounds) {
   HUT_PROFILE_FUN(PIMAGE, _sub.page(), _sub.bounds(), _bounds)
   assert(_sub.from(this));
-  return pages_[_sub.page()].image_->update({_bounds});
+  return pages_[_sub.page()].image_->update({_bounds, 0, layer(_sub.page())});
 }
 
 void atlas::free(subimage &&_sub) {
   HUT_PROFILE_FUN(PIMAGE, _sub.bounds())
   assert(_sub.from(this));
-  auto &l = pages_[_sub.page()];
+  auto      &l      = pages_[_sub.page()];
+  const auto padded = _sub.bounds().size() + PADDING;
   l.packer_.offer(_sub.bounds());
+  assert(l.subimages_ > 0);
+  l.used_px_ -= uint(padded.x) * uint(padded.y);
+  l.subimages_--;
+  l.live_.erase(u32(_sub.bounds().x) << 16 | u32(_sub.bounds().y));
+  _sub.atlas_ = nullptr;
+}
+
+bool atlas::compact() {
+  HUT_PROFILE_FUN(PIMAGE, pages_.size())
+  struct relocation {
+    shared_subimage sub_;
+    u16vec2_px      padded_;
+    uint            page_ = 0;
+    u16vec2         origin_;
+  };
+  std::vector<relocation> relocations;
+  for (auto &page : pages_) {
+    for (const auto &[origin, weak] : page.live_) {
+      auto sub = weak.lock();
+      if (sub && sub->valid())
+        relocations.emplace_back(relocation{sub, sub->bounds_.size() + PADDING});
+    }
+  }
+
+  // Plan the new layout first, tallest first which all the packers handle best
+  std::sort(relocations.begin(), relocations.end(), [](const relocation &_a, const relocation &_b) {
+    return _a.padded_.y != _b.padded_.y ? _a.padded_.y > _b.padded_.y : _a.padded_.x > _b.padded_.x;
+  });
+  std::vector<binpack::dynamic2d<u16>> packers;
+  packers.emplace_back(packer_, params_.size_);
+  for (auto &reloc : relocations) {
+    std::optional<u16vec2> packed;
+    for (uint i = 0; i < packers.size() && !packed; i++) {
+      packed      = packers[i].pack(reloc.padded_);
+      reloc.page_ = i;
+    }
+    if (!packed) {
+      if (packers.size() + 1 >= pages_.size())
+        return false;
+      packers.emplace_back(packer_, params_.size_);
+      packed      = packers.back().pack(reloc.padded_);
+      reloc.page_ = packers.size() - 1;
+    }
+    assert(packed.has_value());
+    reloc.origin_ = *packed;
+  }
+  if (packers.size() >= pages_.size())
+    return false;
+
+  std::vector<page_data> old_pages;
+  old_pages.swap(pages_);
+  if (layered_) {
+    layers_ = nullptr;
+    grow_layers(packers.size());
+  }
+  for (auto &packer : packers) {
+    add_page();
+    pages_.back().packer_ = std::move(packer);
+  }
+
+  std::unique_lock lk(display_.staging_mutex_);
+  for (auto &reloc : relocations) {
+    auto      &sub    = *reloc.sub_;
+    auto      &page   = pages_[reloc.page_];
+    const auto size   = sub.bounds_.size();
+    const auto origin = sub.bounds_.origin();
+
+    display::image_copy copy = {};
+    copy.source_             = old_pages[sub.page_].image_->image_;
+    copy.destination_        = page.image_->image_;
+    copy.srcSubresource      = {VK_IMAGE_ASPECT_COLOR_BIT, 0, layer(sub.page_), 1};
+    copy.dstSubresource      = {VK_IMAGE_ASPECT_COLOR_BIT, 0, layer(reloc.page_), 1};
+    copy.srcOffset           = {i32(origin.x), i32(origin.y), 0};
+    copy.dstOffset           = {i32(reloc.origin_.x), i32(reloc.origin_.y), 0};
+    copy.extent              = {u32(size.x), u32(size.y), 1};
+    display_.queue_command(copy);
+
+    sub.page_   = reloc.page_;
+    sub.bounds_ = u16bbox_px::with_origin_size(u16vec2_px{reloc.origin_}, size);
+    page.used_px_ += uint(reloc.padded_.x) * uint(reloc.padded_.y);
+    page.subimages_++;
+    page.live_.emplace(u32(reloc.origin_.x) << 16 | u32(reloc.origin_.y), reloc.sub_);
+  }
+
+  lk.unlock();
+
+  // Old pages are still read by the copies, and by the frames in flight until they are recorded again
+  for (auto &page : old_pages)
+    display_.retire(std::move(page.image_));
+
+  generation_++;
+  display_.invalidate_layers();
+  return true;
+}
+
+std::vector<atlas::page_occupancy> atlas::occupancy() const {
+  const uint                  total = uint(params_.size_.x) * uint(params_.size_.y);
+  std::vector<page_occupancy> result;
+  result.reserve(pages_.size());
+  for (const auto &page : pages_)
+    result.emplace_back(page_occupancy{page.used_px_, total, page.subimages_, page.packer_.metadata_byte_size()});
+  return result;
 }
 
 }  // namespace hut
@@ -25,6 +25,8 @@
  * SOFTWARE.
  */
 
+#include <cstring>
+
 #ifdef HUT_DEBUG_STAGING
 #  include <iostream>
 #endif
@@ -41,29 +43,147 @@ buffer::buffer(display &_display, const buffer_params &_params)
     : display_(_display)
     , params_(_params) {
   grow(_params.initial_byte_size_);
+  std::lock_guard lk(display_.buffers_mutex_);
+  display_.buffers_.emplace_back(this);
+}
+
+buffer::~buffer() {
+  std::lock_guard lk(display_.buffers_mutex_);
+  std::erase(display_.buffers_, this);
+}
+
+buffer_suballoc<u8> buffer::track(details::buffer_page_data &_page, uint _offset_bytes, uint _size_bytes) {
+  track_high_water();
+  _page.empty_since_ = {};
+  return {&_page, _offset_bytes, _size_bytes};
+}
+
+void buffer::track_high_water() {
+  uint allocated = 0;
+  for (const auto &page : pages_)
+    allocated += page.allocated();
+  high_water_mark_ = std::max(high_water_mark_, allocated);
+}
+
+uint buffer::allocated_bytes() const {
+  std::lock_guard lk(pages_mutex_);
+  uint            result = 0;
+  for (const auto &page : pages_)
+    result += page.allocated();
+  return result;
+}
+
+uint buffer::reserved_bytes() const {
+  std::lock_guard lk(pages_mutex_);
+  uint            result = 0;
+  for (const auto &page : pages_)
+    result += page.size();
+  return result;
+}
+
+uint buffer::trim(display::duration _min_idle) {
+  HUT_PROFILE_FUN(PBUFFER)
+  const auto threshold = display::clock::now() - _min_idle;
+  auto       retired   = std::make_shared<std::list<details::buffer_page_data>>();
+  uint       released  = 0;
+  {
+    std::lock_guard lk(pages_mutex_);
+    for (auto it = std::next(pages_.begin()); it != pages_.end();) {
+      const bool idle = it->empty_since_ != display::time_point{} && it->empty_since_ <= threshold;
+      if (!it->transient_ && idle) {
+        released += it->size();
+        retired->splice(retired->end(), pages_, it++);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Updates and frames submitted before it became empty may still use the page
+  if (!retired->empty())
+    display_.retire(std::move(retired));
+  return released;
 }
 
 buffer_suballoc<u8> buffer::allocate_raw(uint _size_bytes, uint _align) {
   HUT_PROFILE_FUN(PBUFFER, _size_bytes, _align)
+  std::lock_guard lk(pages_mutex_);
+  auto            existing = try_allocate_impl(_size_bytes, _align);
+  if (existing)
+    return std::move(*existing);
+
+  uint  aligned_new_size = align<uint>(_size_bytes, _align);
+  auto &new_buffer       = grow(std::max<uint>(aligned_new_size, pages_.back().size() * 2));
+  auto  fit              = new_buffer.pack(_size_bytes, _align);
+  assert(fit);
+
+  return track(new_buffer, *fit, _size_bytes);
+}
+
+std::optional<buffer_suballoc<u8>> buffer::try_allocate_raw(uint _size_bytes, uint _align) {
+  std::lock_guard lk(pages_mutex_);
+  return try_allocate_impl(_size_bytes, _align);
+}
+
+std::optional<buffer_suballoc<u8>> buffer::try_allocate_impl(uint _size_bytes, uint _align) {
   for (auto &page : pages_) {
-    auto fit = page.suballocator_.pack(_size_bytes, _align);
+    if (page.transient_)
+      continue;
+    auto fit = page.pack(_size_bytes, _align);
     if (fit)
-      return {&page, *fit, _size_bytes};
+      return track(page, *fit, _size_bytes);
   }
+  return {};
+}
 
-  uint  aligned_new_size = align<uint>(_size_bytes, _align);
-  auto &new_buffer       = grow(std::max<uint>(aligned_new_size, pages_.back().size() * 2));
-  auto  fit              = new_buffer.suballocator_.pack(_size_bytes, _align);
+buffer_suballoc<u8> buffer::allocate_transient_raw(uint _size_bytes, uint _align) {
+  HUT_PROFILE_FUN(PBUFFER, _size_bytes, _align)
+  std::lock_guard lk(pages_mutex_);
+  auto           &page = pages_.emplace_back(*this, align<uint>(_size_bytes, _align), true);
+  auto            fit  = page.pack(_size_bytes, _align);
   assert(fit);
+  return track(page, *fit, _size_bytes);
+}
+
+std::optional<buffer::shared_range> buffer::try_allocate_shared_raw(uint _size_bytes, uint _align) {
+  HUT_PROFILE_FUN(PBUFFER, _size_bytes, _align)
+  assert(params_.packer_ == buffer_params::PACK_RING1D);
+  std::lock_guard lk(pages_mutex_);
+  auto           &page = pages_.front();
+  auto            fit  = std::get<binpack::ring1d<uint>>(page.suballocator_).pack_shared(_size_bytes, _align);
+  if (!fit)
+    return {};
+  track_high_water();
+  page.empty_since_ = {};
+  return shared_range{&page, *fit};
+}
+
+void buffer::close_shared_raw(const shared_range &_range, uint _sub_count) {
+  std::lock_guard lk(pages_mutex_);
+  std::get<binpack::ring1d<uint>>(_range.page_->suballocator_).close(_range.offset_bytes_, _sub_count);
+}
 
-  return {&new_buffer, *fit, _size_bytes};
+void buffer::release_transient_pages() {
+  std::lock_guard lk(pages_mutex_);
+  pages_.remove_if([](const details::buffer_page_data &_page) { return _page.transient_ && _page.empty(); });
 }
 
 namespace details {
 
-buffer_page_data::buffer_page_data(buffer &_parent, uint _size)
+static buffer_page_data::suballocator_t make_suballocator(buffer_params::packer _packer, uint _size) {
+  switch (_packer) {
+    case buffer_params::PACK_RING1D: return binpack::ring1d<uint>{_size};
+    case buffer_params::PACK_TLSF1D: return binpack::tlsf1d<uint>{_size};
+    case buffer_params::PACK_LINEAR1D: break;
+  }
+  return binpack::linear1d<uint>{_size};
+}
+
+buffer_page_data::buffer_page_data(buffer &_parent, uint _size, bool _transient)
     : parent_(&_parent)
-    , suballocator_(_size) {
+    , display_(&_parent.display_)
+    , suballocator_(make_suballocator(_transient ? buffer_params::PACK_LINEAR1D : _parent.params_.packer_, _size))
+    , transient_(_transient) {
   HUT_PROFILE_FUN(PBUFFER, _size)
   VkBufferCreateInfo create_info = {};
   create_info.sType              = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -71,24 +191,38 @@ buffer_page_data::buffer_page_data(buffer &_parent, uint _size)
   create_info.usage              = _parent.params_.usage_;
   create_info.sharingMode        = VK_SHARING_MODE_EXCLUSIVE;
 
+  constexpr auto TRANSFER_USAGE = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  const auto     families       = _parent.display_.transfer_families();
+  if (_parent.display_.staging_transfer_ && (_parent.params_.usage_ & TRANSFER_USAGE) != 0) {
+    create_info.sharingMode           = VK_SHARING_MODE_CONCURRENT;
+    create_info.queueFamilyIndexCount = families.size();
+    create_info.pQueueFamilyIndices   = families.data();
+  }
+
   auto *device = _parent.display_.device();
   HUT_VVK(HUT_PVK(vkCreateBuffer, device, &create_info, nullptr, &buffer_));
 
   VkMemoryRequirements requirements;
   HUT_PVK(vkGetBufferMemoryRequirements, device, buffer_, &requirements);
 
-  auto type = _parent.display_.find_memory_type(requirements.memoryTypeBits, _parent.params_.type_);
+  constexpr auto DIRECT_TYPE = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  auto          &display     = _parent.display_;
+  const auto     filter      = requirements.memoryTypeBits;
 
-  VkMemoryAllocateInfo alloc_info = {};
-  alloc_info.sType                = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  alloc_info.allocationSize       = requirements.size;
-  alloc_info.memoryTypeIndex      = type.first;
+  direct_ = _parent.params_.direct_map_ && !_transient
+         && display.try_find_memory_type(filter, _parent.params_.type_ | DIRECT_TYPE).has_value();
 
-  HUT_VVK(HUT_PVK(vkAllocateMemory, device, &alloc_info, nullptr, &memory_));
-  HUT_VVK(HUT_PVK(vkBindBufferMemory, device, buffer_, memory_, 0));
+  device_memory::request request = {};
+  request.requirements_          = requirements;
+  request.properties_            = _parent.params_.type_ | (direct_ ? DIRECT_TYPE : 0);
+  request.category_              = _parent.params_.category_;
+  request.whole_                 = true;  // Pages are big, and mapped as a whole
+  memory_                        = display.memory().allocate(request);
 
-  if (parent_->params_.permanent_map_) {
-    HUT_VVK(HUT_PVK(vkMapMemory, device, memory_, 0, _size, 0, reinterpret_cast<void **>(&permanent_map_)));
+  HUT_VVK(HUT_PVK(vkBindBufferMemory, device, buffer_, memory_.memory(), 0));
+
+  if (parent_->params_.permanent_map_ || direct_) {
+    HUT_VVK(HUT_PVK(vkMapMemory, device, memory_.memory(), 0, _size, 0, reinterpret_cast<void **>(&permanent_map_)));
     assert(permanent_map_);
   } else {
     permanent_map_ = nullptr;
@@ -98,14 +232,14 @@ buffer_page_data::buffer_page_data(buffer &_parent, uint _size)
 buffer_page_data::~buffer_page_data() {
   if (parent_ != nullptr) {
     HUT_PROFILE_FUN(PBUFFER)
-    auto *device = parent_->display_.device();
+    auto *device = display_->device();
 
     if (permanent_map_ != nullptr)
-      HUT_PVK(vkUnmapMemory, device, memory_);
-    if (buffer_ != nullptr)
+      HUT_PVK(vkUnmapMemory, device, memory_.memory());
+    if (buffer_ != nullptr) {
+      display_->forget_destination(buffer_);
       HUT_PVK(vkDestroyBuffer, device, buffer_, nullptr);
-    if (memory_ != nullptr)
-      HUT_PVK(vkFreeMemory, device, memory_, nullptr);
+    }
   }
 }
 
@@ -113,16 +247,23 @@ void buffer_page_data::release_impl(buffer_suballoc<u8> *_suballoc) {
   HUT_PROFILE_FUN(PBUFFER)
   assert(parent_);
   assert(_suballoc->parent_ == this);
-  suballocator_.offer(_suballoc->offset_bytes());
+  std::lock_guard lk(parent_->pages_mutex_);
+  std::visit([_suballoc](auto &_suballocator) { _suballocator.offer(_suballoc->offset_bytes()); }, suballocator_);
+  if (empty())
+    empty_since_ = display::clock::now();
 }
 
-buffer_updator<u8> buffer_page_data::update_raw_impl(uint _offset_bytes, uint _size_bytes) {
+buffer_updator<u8> buffer_page_data::update_raw_impl(uint _offset_bytes, uint _size_bytes, bool _staged) {
   HUT_PROFILE_FUN(PBUFFER, _offset_bytes, _size_bytes)
   assert(parent_);
   assert(_offset_bytes + _size_bytes <= size());
+  if (direct_ && !_staged) {
+    std::span<u8> direct_span{permanent_map_ + _offset_bytes, _size_bytes};
+    return buffer_updator<u8>{*this, buffer_suballoc<u8>{nullptr, 0, 0}, direct_span, _offset_bytes};
+  }
+
   auto         &display = parent_->display_;
-  auto          lk      = std::lock_guard{display.staging_mutex_};
-  auto          staging = display.staging_->allocate_raw(_size_bytes);
+  auto          staging = display.allocate_staging(_size_bytes);
   std::span<u8> staging_span{staging.parent_->permanent_map_ + staging.offset_bytes(), _size_bytes};
   return buffer_updator<u8>{*this, std::move(staging), staging_span, _offset_bytes};
 }
@@ -131,6 +272,8 @@ void buffer_page_data::finalize_impl(buffer_updator<u8> *_updator) {
   HUT_PROFILE_FUN_NAMED(PBUFFER, ("offset", "size"), _updator->offset_bytes(), _updator->size_bytes())
   assert(parent_);
   assert(_updator->parent_ == this);
+  if (_updator->staging_alloc_.parent() == nullptr)
+    return;  // Written directly
   auto &display = parent_->display_;
 
   auto copy         = display::buffer_copy{};
@@ -140,30 +283,26 @@ void buffer_page_data::finalize_impl(buffer_updator<u8> *_updator) {
   copy.dstOffset    = _updator->offset_bytes();
   copy.destination_ = buffer_;
 
-  std::lock_guard lk(display.staging_mutex_);
-  display.staging_jobs_++;
-  display.preflush([&display, copy]() {
-    display.stage_copy(copy);
-    display.staging_jobs_--;
-  });
-  display.postflush_collect(std::move(_updator->staging_alloc_));
+  display.post_copy(copy, std::move(_updator->staging_alloc_));
 }
 
-void buffer_page_data::zero_raw(uint _offset_bytes, uint _size_bytes) const {
+void buffer_page_data::zero_raw(uint _offset_bytes, uint _size_bytes, bool _staged) const {
   HUT_PROFILE_FUN(PBUFFER, _offset_bytes, _size_bytes)
   assert(parent_);
   assert(_offset_bytes + _size_bytes <= size());
+  if (direct_ && !_staged) {
+    memset(permanent_map_ + _offset_bytes, 0, _size_bytes);
+    return;
+  }
+
   display::buffer_zero zero = {};
   zero.size_                = _size_bytes;
   zero.offset_              = _offset_bytes;
   zero.destination_         = buffer_;
 
-  auto &dsp = parent_->display_;
-  dsp.staging_jobs_++;
-  dsp.preflush([&dsp, zero]() {
-    dsp.stage_zero(zero);
-    dsp.staging_jobs_--;
-  });
+  auto           &dsp = parent_->display_;
+  std::lock_guard lk(dsp.staging_mutex_);
+  dsp.queue_command(zero);
 }
 
 }  // namespace details
@@ -171,10 +310,11 @@ void buffer_page_data::zero_raw(uint _offset_bytes, uint _size_bytes) const {
 #ifdef HUT_DEBUG_STAGING
 void buffer::debug() {
   std::cout << "[hut] buffer " << this << " contents:" << std::endl;
+  std::lock_guard lk(pages_mutex_);
   for (const auto &page : pages_) {
     std::cout << "\tVkBuffer " << page.buffer_ << " size:" << page.size() << std::endl;
 
-    page.suballocator_.visit_blocks([](const auto &_block) {
+    page.visit_blocks([](const auto &_block) {
       std::cout << "\t\trange " << _block.offset_ << " - " << (_block.offset_ + _block.size_) << ": " << _block.used_
                 << std::endl;
       return true;
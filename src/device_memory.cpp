@@ -0,0 +1,217 @@
+/*  _ _ _   _       _
+ * | |_| |_| |_ _ _| |_
+ * | | | . |   | | |  _|
+ * |_|_|___|_|_|___|_|
+ * Hobby graphics and GUI library under the MIT License (MIT)
+ *
+ * Copyright (c) 2014 Jean-Baptiste Lepesme github.com/jiboo/libhut
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "hut/device_memory.hpp"
+
+#include "hut/utils/profiling.hpp"
+
+#include "hut/display.hpp"
+
+namespace hut {
+
+const char *memory_category_name(memory_category _category) {
+  switch (_category) {
+    case MSTAGING: return "staging";
+    case MBUFFER: return "buffer";
+    case MATLAS: return "atlas";
+    case MRENDER_TARGET: return "render_target";
+    case MIMAGE: return "image";
+    case MEMORY_CATEGORY_COUNT: break;
+  }
+  return "???";
+}
+
+memory_block::~memory_block() {
+  if (parent_ != nullptr)
+    parent_->release(*this);
+}
+
+memory_block &memory_block::operator=(memory_block &&_other) noexcept {
+  if (&_other != this) {
+    if (parent_ != nullptr)
+      parent_->release(*this);
+    parent_   = std::exchange(_other.parent_, nullptr);
+    page_     = std::exchange(_other.page_, nullptr);
+    memory_   = std::exchange(_other.memory_, (VkDeviceMemory)VK_NULL_HANDLE);
+    offset_   = std::exchange(_other.offset_, 0);
+    size_     = std::exchange(_other.size_, 0);
+    type_     = _other.type_;
+    category_ = _other.category_;
+  }
+  return *this;
+}
+
+device_memory::device_memory(display &_display, uint _page_byte_size)
+    : display_(_display)
+    , page_byte_size_(_page_byte_size) {}
+
+device_memory::~device_memory() {
+  for (auto &type_heaps : heaps_) {
+    for (auto &heap : type_heaps) {
+      for (auto &page : heap) {
+        assert(page.packer_.empty());
+        destroy_page(page);
+      }
+    }
+  }
+}
+
+memory_block device_memory::allocate(const request &_request) {
+  HUT_PROFILE_FUN(PBUFFER, _request.requirements_.size, _request.requirements_.alignment)
+  const u32 type = display_.find_memory_type(_request.requirements_.memoryTypeBits, _request.properties_).first;
+
+  std::lock_guard lk(mutex_);
+  const bool dedicated = _request.dedicated_image_ != VK_NULL_HANDLE || _request.dedicated_buffer_ != VK_NULL_HANDLE;
+  // Big resources would leave most of a page unusable to others
+  if (_request.whole_ || dedicated || _request.requirements_.size > page_byte_size_ / 2)
+    return allocate_whole(_request, type);
+  return allocate_shared(_request, type);
+}
+
+VkDeviceMemory device_memory::allocate_memory(u32 _type, VkDeviceSize _size, VkImage _image, VkBuffer _buffer) {
+  VkMemoryDedicatedAllocateInfo dedicated_info = {};
+  dedicated_info.sType                         = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+  dedicated_info.image                         = _image;
+  dedicated_info.buffer                        = _buffer;
+
+  VkMemoryAllocateInfo alloc_info = {};
+  alloc_info.sType                = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  alloc_info.allocationSize       = _size;
+  alloc_info.memoryTypeIndex      = _type;
+  if (_image != VK_NULL_HANDLE || _buffer != VK_NULL_HANDLE)
+    alloc_info.pNext = &dedicated_info;
+
+  VkDeviceMemory result = VK_NULL_HANDLE;
+  HUT_VVK(HUT_PVK(vkAllocateMemory, display_.device(), &alloc_info, nullptr, &result));
+  reserved_bytes_ += _size;
+  heap_bytes_[display_.mem_props_.memoryTypes[_type].heapIndex] += _size;
+  allocation_count_++;
+  return result;
+}
+
+void device_memory::free_memory(VkDeviceMemory _memory, u32 _type, VkDeviceSize _size) {
+  HUT_PVK(vkFreeMemory, display_.device(), _memory, nullptr);
+  reserved_bytes_ -= _size;
+  heap_bytes_[display_.mem_props_.memoryTypes[_type].heapIndex] -= _size;
+  allocation_count_--;
+}
+
+void device_memory::collect(memory_stats &_stats) const {
+  std::lock_guard lk(mutex_);
+  _stats.categories_     = category_bytes_;
+  _stats.reserved_bytes_ = reserved_bytes_;
+  _stats.allocations_    = allocation_count_;
+  if (_stats.budget_)
+    return;
+
+  const auto &props = display_.mem_props_;
+  _stats.heaps_.resize(props.memoryHeapCount);
+  for (u32 i = 0; i < props.memoryHeapCount; i++)
+    _stats.heaps_[i] = {props.memoryHeaps[i].size, props.memoryHeaps[i].size, heap_bytes_[i],
+                        props.memoryHeaps[i].flags};
+}
+
+memory_block device_memory::allocate_whole(const request &_request, u32 _type) {
+  const auto size   = _request.requirements_.size;
+  auto       memory = allocate_memory(_type, size, _request.dedicated_image_, _request.dedicated_buffer_);
+  allocated_bytes_ += size;
+  category_bytes_[_request.category_] += size;
+  return {this, nullptr, memory, 0, size, _type, _request.category_};
+}
+
+memory_block device_memory::allocate_shared(const request &_request, u32 _type) {
+  const auto &requirements = _request.requirements_;
+  auto       &heap         = heaps_[_type][_request.tiling_];
+  for (auto &page : heap) {
+    auto fit = page.packer_.pack(requirements.size, requirements.alignment);
+    if (fit) {
+      allocated_bytes_ += requirements.size;
+      category_bytes_[_request.category_] += requirements.size;
+      return {this, &page, page.memory_, *fit, requirements.size, _type, _request.category_};
+    }
+  }
+
+  auto &page   = heap.emplace_back(_type, _request.tiling_, page_byte_size_);
+  page.memory_ = allocate_memory(_type, page_byte_size_, VK_NULL_HANDLE, VK_NULL_HANDLE);
+
+  if (_request.tiling_ == TLINEAR && display_.staging_transfer_) {
+    VkBufferCreateInfo create_info    = {};
+    create_info.sType                 = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_info.size                  = page_byte_size_;
+    create_info.usage                 = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    const auto families               = display_.transfer_families();
+    create_info.sharingMode           = VK_SHARING_MODE_CONCURRENT;
+    create_info.queueFamilyIndexCount = families.size();
+    create_info.pQueueFamilyIndices   = families.data();
+
+    auto *device = display_.device();
+    HUT_VVK(HUT_PVK(vkCreateBuffer, device, &create_info, nullptr, &page.alias_));
+    VkMemoryRequirements alias_requirements;
+    HUT_PVK(vkGetBufferMemoryRequirements, device, page.alias_, &alias_requirements);
+    if ((alias_requirements.memoryTypeBits & (1u << _type)) != 0 && alias_requirements.size <= page_byte_size_) {
+      HUT_VVK(HUT_PVK(vkBindBufferMemory, device, page.alias_, page.memory_, 0));
+    } else {
+      HUT_PVK(vkDestroyBuffer, device, page.alias_, nullptr);
+      page.alias_ = VK_NULL_HANDLE;
+    }
+  }
+
+  auto fit = page.packer_.pack(requirements.size, requirements.alignment);
+  assert(fit);
+  allocated_bytes_ += requirements.size;
+  category_bytes_[_request.category_] += requirements.size;
+  return {this, &page, page.memory_, *fit, requirements.size, _type, _request.category_};
+}
+
+void device_memory::destroy_page(details::memory_page &_page) {
+  if (_page.alias_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroyBuffer, display_.device(), _page.alias_, nullptr);
+  free_memory(_page.memory_, _page.type_, _page.packer_.capacity());
+}
+
+void device_memory::release(memory_block &_block) {
+  HUT_PROFILE_FUN(PBUFFER, _block.size_)
+  std::lock_guard lk(mutex_);
+  allocated_bytes_ -= _block.size_;
+  category_bytes_[_block.category_] -= _block.size_;
+  if (_block.page_ == nullptr) {
+    free_memory(_block.memory_, _block.type_, _block.size_);
+    return;
+  }
+
+  auto &page = *_block.page_;
+  page.packer_.offer(_block.offset_);
+  auto &heap = heaps_[page.type_][page.tiling_];
+  // Keep a page per heap, so that resources created and destroyed in a loop don't reallocate it every time
+  if (page.packer_.empty() && heap.size() > 1) {
+    destroy_page(page);
+    heap.remove_if([&page](const details::memory_page &_page) { return &_page == &page; });
+  }
+}
+
+}  // namespace hut
@@ -31,8 +31,11 @@
 
 #include <algorithm>
 #include <iostream>
+#include <memory>
+#include <numeric>
 #include <set>
 #include <unordered_set>
+#include <variant>
 
 #include "hut/utils/profiling.hpp"
 #include "hut/utils/vulkan.hpp"
@@ -511,17 +514,68 @@ void display::init_vulkan_device(VkSurfaceKHR _dummy) {
       VK_KHR_SWAPCHAIN_EXTENSION_NAME,
   };
 
+  bool sync2 = false;
   for (const auto &extension : available_extensions) {
 #ifdef HUT_ENABLE_PROFILING
     if (strcmp(extension.extensionName, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME) == 0)
       extensions.emplace_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
 #endif
+    if (strcmp(extension.extensionName, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME) == 0)
+      sync2 = true;
+    if (strcmp(extension.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0)
+      memory_budget_ = true;
+    if (strcmp(extension.extensionName, VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME) == 0)
+      incremental_present_ = true;
+    if (strcmp(extension.extensionName, VK_NV_INHERITED_VIEWPORT_SCISSOR_EXTENSION_NAME) == 0)
+      inherited_viewport_scissor_ = true;
+  }
+  if (memory_budget_)
+    extensions.emplace_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  if (incremental_present_)
+    extensions.emplace_back(VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME);
+
+  auto sync2_features  = VkPhysicalDeviceSynchronization2FeaturesKHR{};
+  sync2_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+  if (sync2) {
+    VkPhysicalDeviceFeatures2 sync2_query = {};
+    sync2_query.sType                     = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    sync2_query.pNext                     = &sync2_features;
+    HUT_PVK(vkGetPhysicalDeviceFeatures2, pdevice_, &sync2_query);
+    sync2 = sync2_features.synchronization2 == VK_TRUE;
+  }
+  if (sync2)
+    extensions.emplace_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+
+  auto inherited_features  = VkPhysicalDeviceInheritedViewportScissorFeaturesNV{};
+  inherited_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_INHERITED_VIEWPORT_SCISSOR_FEATURES_NV;
+  if (inherited_viewport_scissor_) {
+    VkPhysicalDeviceFeatures2 inherited_query = {};
+    inherited_query.sType                     = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    inherited_query.pNext                     = &inherited_features;
+    HUT_PVK(vkGetPhysicalDeviceFeatures2, pdevice_, &inherited_query);
+    inherited_viewport_scissor_ = inherited_features.inheritedViewportScissor2D == VK_TRUE;
+  }
+  if (inherited_viewport_scissor_)
+    extensions.emplace_back(VK_NV_INHERITED_VIEWPORT_SCISSOR_EXTENSION_NAME);
+
+  void *features_chain = nullptr;
+  if (inherited_viewport_scissor_)
+    features_chain = &inherited_features;
+  if (sync2) {
+    sync2_features.pNext = features_chain;
+    features_chain       = &sync2_features;
   }
 
   VkPhysicalDeviceVulkan12Features features12_request          = {};
   features12_request.sType                                     = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
   features12_request.shaderSampledImageArrayNonUniformIndexing = features12().shaderSampledImageArrayNonUniformIndexing;
   features12_request.descriptorBindingPartiallyBound           = features12().descriptorBindingPartiallyBound;
+  features12_request.timelineSemaphore                         = features12().timelineSemaphore;
+  features12_request.pNext                                     = features_chain;
+  features12_request.descriptorBindingSampledImageUpdateAfterBind
+      = features12().descriptorBindingSampledImageUpdateAfterBind;
+  features12_request.descriptorBindingUpdateUnusedWhilePending
+      = features12().descriptorBindingUpdateUnusedWhilePending;
 
   VkPhysicalDeviceVulkan11Features features11_request = {};
   features11_request.sType                            = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
@@ -549,6 +603,10 @@ void display::init_vulkan_device(VkSurfaceKHR _dummy) {
 #ifdef HUT_ENABLE_VOLK
   HUT_PVK(volkLoadDevice, device_);
 #endif
+  if (sync2) {
+    cmd_pipeline_barrier2_ = reinterpret_cast<PFN_vkCmdPipelineBarrier2KHR>(
+        HUT_PVK(vkGetDeviceProcAddr, device_, "vkCmdPipelineBarrier2KHR"));
+  }
 
   HUT_PVK(vkGetDeviceQueue, device_, prefered_rate.iqueueg_, 0, &queueg_);
   HUT_PVK(vkGetDeviceQueue, device_, prefered_rate.iqueuec_, 0, &queuec_);
@@ -562,31 +620,95 @@ void display::init_vulkan_device(VkSurfaceKHR _dummy) {
   pool_info.flags                   = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
   HUT_VVK(HUT_PVK(vkCreateCommandPool, device_, &pool_info, nullptr, &commandg_pool_));
 
+#ifndef HUT_DISABLE_TRANSFER_QUEUE
+  staging_transfer_ = iqueuet_ != iqueueg_ && features12().timelineSemaphore == VK_TRUE;
+#endif
+  VkSemaphoreTypeCreateInfo timeline_info = {};
+  timeline_info.sType                     = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  timeline_info.semaphoreType             = VK_SEMAPHORE_TYPE_TIMELINE;
+  timeline_info.initialValue              = 0;
+  VkSemaphoreCreateInfo semaphore_info    = {};
+  semaphore_info.sType                    = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphore_info.pNext                    = &timeline_info;
+  if (features12().timelineSemaphore == VK_TRUE)
+    HUT_VVK(HUT_PVK(vkCreateSemaphore, device_, &semaphore_info, nullptr, &graphics_timeline_));
+  // Staging records its command buffers under staging_mutex_, from any thread, so it keeps its own pool
+  pool_info.queueFamilyIndex = staging_transfer_ ? iqueuet_ : iqueueg_;
+  HUT_VVK(HUT_PVK(vkCreateCommandPool, device_, &pool_info, nullptr, &commandt_pool_));
+  if (staging_transfer_)
+    HUT_VVK(HUT_PVK(vkCreateSemaphore, device_, &semaphore_info, nullptr, &transfer_timeline_));
+
+  memory_ = std::make_unique<device_memory>(*this, params_.memory_page_byte_size_);
+
   buffer_params staging_params;
-  staging_params.permanent_map_ = true;
-  staging_params.type_          = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  staging_params.permanent_map_     = true;
+  staging_params.initial_byte_size_ = params_.staging_byte_size_;
+  staging_params.packer_            = buffer_params::PACK_RING1D;
+  staging_params.category_          = MSTAGING;
+  staging_params.type_              = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
   staging_params.usage_ = VkBufferUsageFlagBits(VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
   staging_              = std::make_shared<buffer>(*this, staging_params);
 
   VkCommandBufferAllocateInfo alloc_info = {};
   alloc_info.sType                       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   alloc_info.level                       = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  alloc_info.commandPool                 = commandg_pool_;
+  alloc_info.commandPool                 = commandt_pool_;
   alloc_info.commandBufferCount          = 1;
-  HUT_VVK(HUT_PVK(vkAllocateCommandBuffers, device_, &alloc_info, &staging_cb_));
 
-  VkCommandBufferBeginInfo begin_info = {};
-  begin_info.sType                    = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  begin_info.flags                    = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  HUT_VVK(HUT_PVK(vkBeginCommandBuffer, staging_cb_, &begin_info));
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType             = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  for (auto &submission : staging_submissions_) {
+    HUT_VVK(HUT_PVK(vkAllocateCommandBuffers, device_, &alloc_info, &submission.cb_));
+    HUT_VVK(HUT_PVK(vkCreateFence, device_, &fence_info, nullptr, &submission.fence_));
+  }
+
+  staging_current_ = 0;
+  begin_staging();
+
+  for (uint i = 0; i < params_.record_threads_; i++)
+    record_workers_.emplace_back(&display::record_worker, this);
 }
 
 void display::destroy_vulkan() {
   HUT_PROFILE_FUN(PDISPLAY)
+  {
+    std::lock_guard lk(record_mutex_);
+    record_stop_ = true;
+  }
+  record_cv_.notify_all();
+  for (auto &worker : record_workers_)
+    worker.join();
+  record_workers_.clear();
+
   HUT_PVK(vkDeviceWaitIdle, device_);
 
+  drain_staging_records();
+  postflush_garbage_.clear();
+  postflush_retained_.clear();
+  staging_commands_.clear();
+  pending_buffer_copies_.clear();
+  pending_image_copies_.clear();
+  staging_arenas_.clear();
+  for (auto &submission : staging_submissions_) {
+    submission.garbage_.clear();
+    submission.retained_.clear();
+    if (submission.fence_ != VK_NULL_HANDLE)
+      HUT_PVK(vkDestroyFence, device_, submission.fence_, nullptr);
+    if (submission.cb_ != VK_NULL_HANDLE)
+      HUT_PVK(vkFreeCommandBuffers, device_, commandt_pool_, 1, &submission.cb_);
+    submission = {};
+  }
+  staging_cb_ = VK_NULL_HANDLE;
   staging_.reset();
-  HUT_PVK(vkFreeCommandBuffers, device_, commandg_pool_, 1, &staging_cb_);
+  memory_.reset();
+
+  if (graphics_timeline_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroySemaphore, device_, graphics_timeline_, nullptr);
+  if (transfer_timeline_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroySemaphore, device_, transfer_timeline_, nullptr);
+  if (commandt_pool_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroyCommandPool, device_, commandt_pool_, nullptr);
 
   if (commandg_pool_ != VK_NULL_HANDLE)
     HUT_PVK(vkDestroyCommandPool, device_, commandg_pool_, nullptr);
@@ -605,13 +727,20 @@ void display::destroy_vulkan() {
 }
 
 std::pair<u32, VkMemoryPropertyFlags> display::find_memory_type(u32 _type_filter, VkMemoryPropertyFlags _properties) {
+  auto found = try_find_memory_type(_type_filter, _properties);
+  if (!found)
+    throw std::runtime_error("failed to find suitable memory type!");
+  return *found;
+}
+
+std::optional<std::pair<u32, VkMemoryPropertyFlags>> display::try_find_memory_type(u32 _type_filter,
+                                                                                   VkMemoryPropertyFlags _properties) {
   for (u32 i = 0; i < mem_props_.memoryTypeCount; i++) {
     if (((_type_filter & (1 << i)) != 0u) && (mem_props_.memoryTypes[i].propertyFlags & _properties) == _properties) {
-      return {i, mem_props_.memoryTypes[i].propertyFlags};
+      return std::pair{i, mem_props_.memoryTypes[i].propertyFlags};
     }
   }
-
-  throw std::runtime_error("failed to find suitable memory type!");
+  return {};
 }
 
 std::ostream &operator<<(std::ostream &_os, const VkImageLayout _layout) {
@@ -632,10 +761,38 @@ std::ostream &operator<<(std::ostream &_os, const VkExtent3D _extent) {
   return _os << "extent " << uvec3{_extent.width, _extent.height, _extent.depth};
 }
 
-void display::transition_image(VkCommandBuffer _cb, VkImage _image, VkImageSubresourceRange _range,
-                               VkImageLayout _old_layout, VkImageLayout _new_layout) {
+struct layout_usage {
+  VkAccessFlags        access_;
+  VkPipelineStageFlags stage_;
+};
+
+static layout_usage usage_of(VkImageLayout _layout) {
+  switch (_layout) {
+    case VK_IMAGE_LAYOUT_UNDEFINED: return {0, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT};
+    case VK_IMAGE_LAYOUT_PREINITIALIZED: return {VK_ACCESS_HOST_WRITE_BIT, VK_PIPELINE_STAGE_HOST_BIT};
+    case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL: return {VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT};
+    case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL: return {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT};
+    case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
+      return {VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT};
+    case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL:
+      return {VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+              VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+    case VK_IMAGE_LAYOUT_GENERAL:
+      return {VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+    default: throw std::invalid_argument("unsupported layout transition!");
+  }
+}
+
+display::image_barrier display::make_transition(VkImage _image, VkImageSubresourceRange _range,
+                                                VkImageLayout _old_layout, VkImageLayout _new_layout,
+                                                bool _graphics_queue) {
+  const auto src = usage_of(_old_layout);
+  const auto dst = usage_of(_new_layout);
+
   VkImageMemoryBarrier barrier = {};
   barrier.sType                = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask        = src.access_;
+  barrier.dstAccessMask        = dst.access_;
   barrier.oldLayout            = _old_layout;
   barrier.newLayout            = _new_layout;
   barrier.srcQueueFamilyIndex  = VK_QUEUE_FAMILY_IGNORED;
@@ -643,96 +800,305 @@ void display::transition_image(VkCommandBuffer _cb, VkImage _image, VkImageSubre
   barrier.image                = _image;
   barrier.subresourceRange     = _range;
 
-  VkPipelineStageFlagBits src_stage;
-  VkPipelineStageFlagBits dst_stage;
-
-  if (_old_layout == VK_IMAGE_LAYOUT_PREINITIALIZED && _new_layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    src_stage             = VK_PIPELINE_STAGE_HOST_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_TRANSFER_BIT;
-  } else if (_old_layout == VK_IMAGE_LAYOUT_PREINITIALIZED && _new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    src_stage             = VK_PIPELINE_STAGE_HOST_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_TRANSFER_BIT;
-  } else if (_old_layout == VK_IMAGE_LAYOUT_PREINITIALIZED && _new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    src_stage             = VK_PIPELINE_STAGE_HOST_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-
-  } else if (_old_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-             && _new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    barrier.dstAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-    src_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_HOST_BIT;
-  } else if (_old_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-             && _new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    src_stage             = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-
-  } else if (_old_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-             && _new_layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    src_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_TRANSFER_BIT;
-  } else if (_old_layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
-             && _new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    src_stage             = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-
-  } else if (_old_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-             && _new_layout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-    src_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-  } else if (_old_layout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
-             && _new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    src_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    dst_stage             = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-
-  } else {
-    throw std::invalid_argument("unsupported layout transition!");
+  VkPipelineStageFlags src_stage = src.stage_;
+  VkPipelineStageFlags dst_stage = dst.stage_;
+  if (!_graphics_queue) {
+    // Shader accesses happen on the graphics queue, ordering against them is done by semaphores
+    if (src_stage == VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT) {
+      src_stage             = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+      barrier.srcAccessMask = 0;
+    }
+    if (dst_stage == VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT) {
+      dst_stage             = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+      barrier.dstAccessMask = 0;
+    }
   }
 
+  return {barrier, src_stage, dst_stage};
+}
+
+void display::transition_image(VkCommandBuffer _cb, VkImage _image, VkImageSubresourceRange _range,
+                               VkImageLayout _old_layout, VkImageLayout _new_layout, bool _graphics_queue) {
+  auto transition = make_transition(_image, _range, _old_layout, _new_layout, _graphics_queue);
   HUT_PVK_NAMED_ALIASED(vkCmdPipelineBarrier, ("dest", "from", "to"), ((void *)_image, _old_layout, _new_layout), _cb,
-                        src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+                        transition.src_stage_, transition.dst_stage_, 0, 0, nullptr, 0, nullptr, 1,
+                        &transition.barrier_);
 }
 
 void display::postflush_collect(buffer_suballoc<u8> &&_callback) {
   postflush_garbage_.emplace_back(std::move(_callback));
 }
 
+void display::postflush_retain(std::shared_ptr<void> _resource) {
+  postflush_retained_.emplace_back(std::move(_resource));
+}
+
+void display::retire(std::shared_ptr<void> _resource) {
+  for (auto wpair : windows_)
+    wpair.second->retire(_resource);
+  std::lock_guard lk(staging_mutex_);
+  postflush_retain(std::move(_resource));
+}
+
+void display::invalidate_layers() {
+  for (auto wpair : windows_)
+    wpair.second->invalidate_layers();
+}
+
+display::staging_command &display::emplace_command(staging_command::kind _kind) {
+  auto &command     = staging_commands_.emplace_back();
+  command.kind_     = _kind;
+  command.sequence_ = staging_sequence_++;
+  return command;
+}
+
+void display::queue_command(const buffer_zero &_info) {
+  emplace_command(staging_command::ZERO).zero_ = _info;
+}
+
+void display::queue_command(const image_transition &_info, VkImageSubresourceRange _range) {
+  auto &command       = emplace_command(staging_command::TRANSITION);
+  command.range_      = _range;
+  command.transition_ = _info;
+}
+
+void display::queue_command(const image_clear &_info, VkImageSubresourceRange _range) {
+  auto &command  = emplace_command(staging_command::CLEAR);
+  command.range_ = _range;
+  command.clear_ = _info;
+}
+
+void display::queue_command(const image_copy &_info) {
+  emplace_command(staging_command::COPY).copy_ = _info;
+}
+
+void display::stage_command(const staging_command &_command) {
+  switch (_command.kind_) {
+    case staging_command::ZERO:
+      sync_transfer(_command.zero_.destination_);
+      stage_zero(_command.zero_);
+      staging_unsynced_buffers_.emplace(_command.zero_.destination_);
+      break;
+    case staging_command::TRANSITION: stage_transition(_command.transition_, _command.range_); break;
+    case staging_command::CLEAR:
+      sync_transfer(_command.clear_.destination_);
+      stage_clear(_command.clear_, _command.range_);
+      staging_unsynced_images_.emplace(_command.clear_.destination_);
+      break;
+    case staging_command::COPY:
+      sync_transfer(_command.copy_.source_);
+      sync_transfer(_command.copy_.destination_);
+      stage_copy(_command.copy_);
+      staging_unsynced_images_.emplace(_command.copy_.destination_);
+      break;
+  }
+}
+
+bool display::touches_batch(const staging_command &_command) const {
+  switch (_command.kind_) {
+    case staging_command::ZERO: return staging_batch_buffers_.contains(_command.zero_.destination_);
+    case staging_command::TRANSITION: return staging_batch_images_.contains(_command.transition_.destination_);
+    case staging_command::CLEAR: return staging_batch_images_.contains(_command.clear_.destination_);
+    case staging_command::COPY:
+      return staging_batch_images_.contains(_command.copy_.source_)
+          || staging_batch_images_.contains(_command.copy_.destination_);
+  }
+  return false;
+}
+
+template<typename THandle>
+void display::track_destination(std::unordered_map<THandle, u64> &_written, THandle _destination) {
+  const u64 now       = graphics_timeline_value_;
+  auto [it, inserted] = _written.try_emplace(_destination, now);
+  if (!inserted) {
+    staging_read_since_ = std::min(staging_read_since_, it->second);
+    it->second          = now;
+  }
+}
+
+void display::track_destinations() {
+  std::lock_guard lk(staging_written_mutex_);
+  for (const auto &command : staging_commands_) {
+    switch (command.kind_) {
+      case staging_command::ZERO: track_destination(staging_written_buffers_, command.zero_.destination_); break;
+      case staging_command::TRANSITION:
+        track_destination(staging_written_images_, command.transition_.destination_);
+        break;
+      case staging_command::CLEAR: track_destination(staging_written_images_, command.clear_.destination_); break;
+      case staging_command::COPY:
+        // The source changes layout as well
+        track_destination(staging_written_images_, command.copy_.source_);
+        track_destination(staging_written_images_, command.copy_.destination_);
+        break;
+    }
+  }
+  for (const auto &copy : pending_buffer_copies_)
+    track_destination(staging_written_buffers_, copy.destination_);
+  for (const auto &copy : pending_image_copies_)
+    track_destination(staging_written_images_, copy.destination_);
+}
+
+void display::forget_destination(VkBuffer _destination) {
+  std::lock_guard lk(staging_written_mutex_);
+  staging_written_buffers_.erase(_destination);
+}
+
+void display::forget_destination(VkImage _destination) {
+  std::lock_guard lk(staging_written_mutex_);
+  staging_written_images_.erase(_destination);
+}
+
+struct display::staging_record {
+  staging_record                         *next_ = nullptr;
+  std::variant<buffer_copy, image_update> copy_;
+  buffer_suballoc<u8>                     staging_;
+};
+
+void display::post_copy(const buffer_copy &_info, buffer_suballoc<u8> &&_staging) {
+  auto copy      = _info;
+  copy.sequence_ = staging_sequence_++;
+  push_staging_record(new staging_record{nullptr, copy, std::move(_staging)});
+}
+
+void display::post_copy(const image_update &_info, buffer_suballoc<u8> &&_staging) {
+  auto copy      = _info;
+  copy.sequence_ = staging_sequence_++;
+  push_staging_record(new staging_record{nullptr, copy, std::move(_staging)});
+}
+
+void display::push_staging_record(staging_record *_record) {
+  _record->next_ = staging_records_.load(std::memory_order_relaxed);
+  while (!staging_records_.compare_exchange_weak(_record->next_, _record, std::memory_order_release,
+                                                 std::memory_order_relaxed))
+    ;
+}
+
+void display::drain_staging_records() {
+  // Pushed as a stack, reverse it so that copies to the same range are queued in the order they were finalized
+  staging_record *fifo   = nullptr;
+  staging_record *record = staging_records_.exchange(nullptr, std::memory_order_acquire);
+  while (record != nullptr) {
+    auto *next    = record->next_;
+    record->next_ = fifo;
+    fifo          = record;
+    record        = next;
+  }
+
+  while (fifo != nullptr) {
+    std::unique_ptr<staging_record> current{std::exchange(fifo, fifo->next_)};
+    std::visit([this](const auto &_copy) { queue_copy(_copy); }, current->copy_);
+    postflush_collect(std::move(current->staging_));
+  }
+}
+
 void display::stage_transition(const image_transition &_info, VkImageSubresourceRange _range) {
 #ifdef HUT_DEBUG_STAGING
   std::cout << "[staging] transition " << _info.destination_ << " from " << _info.old_layout_ << " to "
             << _info.new_layout_ << std::endl;
 #endif
 
-  transition_image(staging_cb_, _info.destination_, _range, _info.old_layout_, _info.new_layout_);
+  // Only sets the layout the subresources rest in after the flush, the barrier is recorded when they are used
+  for (u32 level = _range.baseMipLevel; level < _range.baseMipLevel + _range.levelCount; level++) {
+    for (u32 layer = _range.baseArrayLayer; layer < _range.baseArrayLayer + _range.layerCount; layer++) {
+      const subresource_key    key{_info.destination_, level, layer};
+      const subresource_layout initial{_info.old_layout_, _info.new_layout_};
+      staging_layouts_.try_emplace(key, initial).first->second.resting_ = _info.new_layout_;
+    }
+  }
+}
+
+void display::require_layout(VkImage _image, VkImageSubresourceRange _range, VkImageLayout _layout) {
+  for (u32 level = _range.baseMipLevel; level < _range.baseMipLevel + _range.levelCount; level++) {
+    for (u32 layer = _range.baseArrayLayer; layer < _range.baseArrayLayer + _range.layerCount; layer++) {
+      auto &current = staging_layouts_[{_image, level, layer}].current_;
+      if (current == _layout)
+        continue;
+
+      // Layers are iterated last, so neighbours with the same transition extend the previous barrier
+      if (!staging_barriers_.empty()) {
+        auto &last  = staging_barriers_.back().barrier_;
+        auto &range = last.subresourceRange;
+        if (last.image == _image && last.oldLayout == current && last.newLayout == _layout && range.levelCount == 1
+            && range.baseMipLevel == level && range.baseArrayLayer + range.layerCount == layer) {
+          range.layerCount++;
+          current = _layout;
+          continue;
+        }
+      }
+      const VkImageSubresourceRange subresource{_range.aspectMask, level, 1, layer, 1};
+      staging_barriers_.emplace_back(make_transition(_image, subresource, current, _layout, !staging_transfer_));
+      current = _layout;
+    }
+  }
+}
+
+void display::record_layout_barriers() {
+  if (staging_barriers_.empty())
+    return;
+  staging_stats_.transitions_ += staging_barriers_.size();
+
+  if (cmd_pipeline_barrier2_ != nullptr) {
+    // Each barrier keeps its own stages, instead of waiting on the union of all of them
+    image_barriers2_.clear();
+    for (const auto &transition : staging_barriers_) {
+      const auto              &barrier = transition.barrier_;
+      VkImageMemoryBarrier2KHR barrier2 = {};
+      barrier2.sType                    = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR;
+      barrier2.srcStageMask             = transition.src_stage_;
+      barrier2.srcAccessMask            = barrier.srcAccessMask;
+      barrier2.dstStageMask             = transition.dst_stage_;
+      barrier2.dstAccessMask            = barrier.dstAccessMask;
+      barrier2.oldLayout                = barrier.oldLayout;
+      barrier2.newLayout                = barrier.newLayout;
+      barrier2.srcQueueFamilyIndex      = barrier.srcQueueFamilyIndex;
+      barrier2.dstQueueFamilyIndex      = barrier.dstQueueFamilyIndex;
+      barrier2.image                    = barrier.image;
+      barrier2.subresourceRange         = barrier.subresourceRange;
+      image_barriers2_.emplace_back(barrier2);
+    }
+    VkDependencyInfoKHR dependency     = {};
+    dependency.sType                   = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    dependency.imageMemoryBarrierCount = (u32)image_barriers2_.size();
+    dependency.pImageMemoryBarriers    = image_barriers2_.data();
+    HUT_PVK(cmd_pipeline_barrier2_, staging_cb_, &dependency);
+  } else {
+    image_barriers_.clear();
+    VkPipelineStageFlags src_stages = 0, dst_stages = 0;
+    for (const auto &transition : staging_barriers_) {
+      image_barriers_.emplace_back(transition.barrier_);
+      src_stages |= transition.src_stage_;
+      dst_stages |= transition.dst_stage_;
+    }
+    HUT_PVK(vkCmdPipelineBarrier, staging_cb_, src_stages, dst_stages, 0, 0, nullptr, 0, nullptr,
+            (u32)image_barriers_.size(), image_barriers_.data());
+  }
+  staging_barriers_.clear();
+}
+
+void display::restore_layouts() {
+  for (auto &[key, layout] : staging_layouts_) {
+    if (layout.current_ == layout.resting_)
+      continue;
+    const VkImageSubresourceRange subresource{VK_IMAGE_ASPECT_COLOR_BIT, key.level_, 1, key.layer_, 1};
+    staging_barriers_.emplace_back(
+        make_transition(key.image_, subresource, layout.current_, layout.resting_, !staging_transfer_));
+  }
+  record_layout_barriers();
+  staging_layouts_.clear();
 }
 
-void display::stage_copy(const buffer_copy &_info) {
+void display::stage_copy(VkBuffer _source, VkBuffer _destination, std::span<const VkBufferCopy> _regions) {
 #ifdef HUT_DEBUG_STAGING
-  std::cout << "[staging] buffer_copy " << _info.source_ << '[' << _info.srcOffset << "-"
-            << (_info.srcOffset + _info.size) << "] to " << _info.destination_ << '[' << _info.dstOffset << "-"
-            << (_info.dstOffset + _info.size) << ']' << std::endl;
+  for (const auto &region : _regions) {
+    std::cout << "[staging] buffer_copy " << _source << '[' << region.srcOffset << "-"
+              << (region.srcOffset + region.size) << "] to " << _destination << '[' << region.dstOffset << "-"
+              << (region.dstOffset + region.size) << ']' << std::endl;
+  }
 #endif
 
-  HUT_PVK_NAMED_ALIASED(
-      vkCmdCopyBuffer, ("src", "srcOffset", "size", "dst", "dstOffset"),
-      ((void *)_info.source_, _info.srcOffset, _info.size, (void *)_info.destination_, _info.dstOffset), staging_cb_,
-      _info.source_, _info.destination_, 1, &_info);
+  HUT_PVK_NAMED_ALIASED(vkCmdCopyBuffer, ("src", "dst", "regions"),
+                        ((void *)_source, (void *)_destination, _regions.size()), staging_cb_, _source, _destination,
+                        (u32)_regions.size(), _regions.data());
 }
 
 void display::stage_zero(const display::buffer_zero &_info) {
@@ -740,6 +1106,7 @@ void display::stage_zero(const display::buffer_zero &_info) {
   std::cout << "[staging] buffer_zero " << _info.destination_ << '[' << _info.offset_ << "-"
             << (_info.offset_ + _info.size_) << "]" << std::endl;
 #endif
+  staging_stats_.zeroes_++;
 
   HUT_PVK_NAMED_ALIASED(vkCmdFillBuffer, ("dst", "dstOffset", "size", "data"),
                         ((void *)_info.destination_, _info.offset_, _info.size_, 0), staging_cb_, _info.destination_,
@@ -752,6 +1119,15 @@ void display::stage_copy(const image_copy &_info) {
             << "] to image " << _info.destination_ << "[" << _info.dstOffset.x << ", " << _info.dstOffset.y << "] size "
             << _info.extent.width << ", " << _info.extent.height << "]" << std::endl;
 #endif
+  staging_stats_.copies_++;
+
+  const auto &src = _info.srcSubresource;
+  const auto &dst = _info.dstSubresource;
+  require_layout(_info.source_, {src.aspectMask, src.mipLevel, 1, src.baseArrayLayer, src.layerCount},
+                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  require_layout(_info.destination_, {dst.aspectMask, dst.mipLevel, 1, dst.baseArrayLayer, dst.layerCount},
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  record_layout_barriers();
 
   HUT_PVK_NAMED_ALIASED(vkCmdCopyImage, ("src", "dst", "srcOffset", "dstOffset", "extent"),
                         ((void *)_info.source_, (void *)_info.destination_, offset3_16(_info.srcOffset),
@@ -760,66 +1136,712 @@ void display::stage_copy(const image_copy &_info) {
                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &_info);
 }
 
-void display::stage_copy(const buffer_image_copy &_info) {
+void display::stage_copy(VkBuffer _source, VkImage _destination, std::span<const VkBufferImageCopy> _regions) {
 #ifdef HUT_DEBUG_STAGING
-  std::cout << "[staging] buffer2image_copy " << _info.source_ << '[' << _info.bufferOffset << "-"
-            << (_info.bufferOffset + _info.bytes_size_) << "] to image " << _info.destination_ << "["
-            << _info.imageOffset.x << ", " << _info.imageOffset.y << ", " << _info.imageExtent.width << ", "
-            << _info.imageExtent.height << "]" << std::endl;
+  for (const auto &region : _regions) {
+    std::cout << "[staging] buffer2image_copy " << _source << '[' << region.bufferOffset << "] to image "
+              << _destination << "[" << region.imageOffset.x << ", " << region.imageOffset.y << ", "
+              << region.imageExtent.width << ", " << region.imageExtent.height << "]" << std::endl;
+  }
 #endif
 
-  HUT_PVK_NAMED_ALIASED(vkCmdCopyBufferToImage, ("src", "dst", "srcOffset", "srcSize", "dstOffset", "dstExtent"),
-                        ((void *)_info.source_, (void *)_info.destination_, _info.bufferOffset, _info.bytes_size_,
-                         offset3_16(_info.imageOffset), extent3_16(_info.imageExtent)),
-                        staging_cb_, _info.source_, _info.destination_, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-                        &_info);
+  HUT_PVK_NAMED_ALIASED(vkCmdCopyBufferToImage, ("src", "dst", "regions"),
+                        ((void *)_source, (void *)_destination, _regions.size()), staging_cb_, _source, _destination,
+                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (u32)_regions.size(), _regions.data());
 }
 
 void display::stage_clear(const image_clear &_info, VkImageSubresourceRange _range) {
 #ifdef HUT_DEBUG_STAGING
   std::cout << "[staging] image_clear " << _info.destination_ << std::endl;
 #endif
+  staging_stats_.clears_++;
+  if (staging_transfer_) {
+    assert(_info.storage_ != VK_NULL_HANDLE);
+    HUT_PVK(vkCmdFillBuffer, staging_cb_, _info.storage_, _info.storage_offset_, _info.storage_size_, 0);
+
+    VkMemoryBarrier barrier = {};
+    barrier.sType           = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask   = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask   = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    HUT_PVK(vkCmdPipelineBarrier, staging_cb_, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+            &barrier, 0, nullptr, 0, nullptr);
+    return;
+  }
+
+  require_layout(_info.destination_, _range, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  record_layout_barriers();
   HUT_PVK_NAMED_ALIASED(vkCmdClearColorImage, ("dst", "color"), ((void *)_info.destination_, color4_32(_info.color_)),
                         staging_cb_, _info.destination_, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &_info.color_, 1,
                         &_range);
 }
 
+void display::stage_transfer_barrier() {
+  VkMemoryBarrier barrier = {};
+  barrier.sType           = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask   = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask   = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+  HUT_PVK(vkCmdPipelineBarrier, staging_cb_, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+          &barrier, 0, nullptr, 0, nullptr);
+  staging_unsynced_buffers_.clear();
+  staging_unsynced_images_.clear();
+}
+
+template<typename THandle>
+bool handle_less(THandle _a, THandle _b) {
+  return std::less<THandle>{}(_a, _b);
+}
+
+void display::stage_pending_buffer_copies(std::span<const buffer_copy> _copies) {
+  const auto &copies = _copies;
+  auto       &order  = pending_order_;
+  if (copies.empty())
+    return;
+
+  // Indices are in submission order, sort them by destination range while keeping that order between equal ranges
+  order.resize(copies.size());
+  std::iota(order.begin(), order.end(), 0);
+  const auto by_destination = [&copies](uint _a, uint _b) {
+    const auto &a = copies[_a];
+    const auto &b = copies[_b];
+    if (a.destination_ != b.destination_)
+      return handle_less(a.destination_, b.destination_);
+    return std::tie(a.dstOffset, a.size) < std::tie(b.dstOffset, b.size);
+  };
+  std::stable_sort(order.begin(), order.end(), by_destination);
+
+  // An update entirely overwritten by a later one of the same range is skipped
+  const auto same_range = [&copies](uint _a, uint _b) {
+    const auto &a = copies[_a];
+    const auto &b = copies[_b];
+    return a.destination_ == b.destination_ && a.dstOffset == b.dstOffset && a.size == b.size;
+  };
+  uint kept = 0;
+  for (uint i = 0; i < order.size(); i++) {
+    if (i + 1 < order.size() && same_range(order[i], order[i + 1]))
+      continue;
+    order[kept++] = order[i];
+  }
+  order.resize(kept);
+
+  const auto emit = [this, &copies](std::span<const uint> _indices) {
+    buffer_regions_.clear();
+    for (uint index : _indices) {
+      buffer_regions_.emplace_back(copies[index]);
+      staging_stats_.bytes_ += copies[index].size;
+    }
+    staging_stats_.copies_ += _indices.size();
+    const auto &first = copies[_indices.front()];
+    stage_copy(first.source_, first.destination_, buffer_regions_);
+  };
+
+  auto group_begin = order.begin();
+  while (group_begin != order.end()) {
+    auto group_end = std::find_if(group_begin, order.end(), [&copies, group_begin](uint _index) {
+      return copies[_index].destination_ != copies[*group_begin].destination_;
+    });
+
+    bool overlaps = false;
+    for (auto it = group_begin; it + 1 < group_end; ++it) {
+      const auto &current = copies[*it];
+      if (current.dstOffset + current.size > copies[*(it + 1)].dstOffset) {
+        overlaps = true;
+        break;
+      }
+    }
+
+    if (overlaps) {
+      // Rare, keep submission order and serialize the copies
+      std::sort(group_begin, group_end);
+      for (auto it = group_begin; it != group_end; ++it) {
+        if (it != group_begin)
+          stage_transfer_barrier();
+        emit({&*it, 1});
+      }
+    } else {
+      std::stable_sort(group_begin, group_end,
+                       [&copies](uint _a, uint _b) { return handle_less(copies[_a].source_, copies[_b].source_); });
+      auto run_begin = group_begin;
+      while (run_begin != group_end) {
+        auto run_end = std::find_if(run_begin, group_end, [&copies, run_begin](uint _index) {
+          return copies[_index].source_ != copies[*run_begin].source_;
+        });
+        emit({&*run_begin, size_t(run_end - run_begin)});
+        run_begin = run_end;
+      }
+    }
+    group_begin = group_end;
+  }
+}
+
+void display::stage_pending_image_copies(std::span<const image_update> _copies) {
+  const auto &copies = _copies;
+  auto       &order  = pending_order_;
+  if (copies.empty())
+    return;
+
+  const auto key = [](const image_update &_copy) {
+    const auto &subres = _copy.imageSubresource;
+    return std::tuple{subres.mipLevel,         subres.baseArrayLayer,    _copy.imageOffset.x,
+                      _copy.imageOffset.y,     _copy.imageExtent.width, _copy.imageExtent.height};
+  };
+  order.resize(copies.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&copies, &key](uint _a, uint _b) {
+    const auto &a = copies[_a];
+    const auto &b = copies[_b];
+    if (a.destination_ != b.destination_)
+      return handle_less(a.destination_, b.destination_);
+    return key(a) < key(b);
+  });
+
+  uint kept = 0;
+  for (uint i = 0; i < order.size(); i++) {
+    if (i + 1 < order.size()) {
+      const auto &a = copies[order[i]];
+      const auto &b = copies[order[i + 1]];
+      if (a.destination_ == b.destination_ && key(a) == key(b))
+        continue;
+    }
+    order[kept++] = order[i];
+  }
+  order.resize(kept);
+
+  const auto emit = [this, &copies](std::span<const uint> _indices) {
+    image_regions_.clear();
+    for (uint index : _indices) {
+      image_regions_.emplace_back(copies[index]);
+      staging_stats_.bytes_ += copies[index].bytes_size_;
+    }
+    staging_stats_.copies_ += _indices.size();
+    const auto &first = copies[_indices.front()];
+    stage_copy(first.source_, first.destination_, image_regions_);
+  };
+
+  const auto intersects = [](const image_update &_a, const image_update &_b) {
+    if (_a.imageSubresource.mipLevel != _b.imageSubresource.mipLevel
+        || _a.imageSubresource.baseArrayLayer != _b.imageSubresource.baseArrayLayer)
+      return false;
+    return _a.imageOffset.x < _b.imageOffset.x + (int)_b.imageExtent.width
+        && _b.imageOffset.x < _a.imageOffset.x + (int)_a.imageExtent.width
+        && _a.imageOffset.y < _b.imageOffset.y + (int)_b.imageExtent.height
+        && _b.imageOffset.y < _a.imageOffset.y + (int)_a.imageExtent.height;
+  };
+
+  // One barrier for all the images, the transitions back happen in restore_layouts
+  for (uint index : order) {
+    const auto &copy = copies[index];
+    require_layout(copy.destination_, copy.range_, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  }
+  record_layout_barriers();
+
+  auto group_begin = order.begin();
+  while (group_begin != order.end()) {
+    auto group_end = std::find_if(group_begin, order.end(), [&copies, group_begin](uint _index) {
+      return copies[_index].destination_ != copies[*group_begin].destination_;
+    });
+
+    // Sorted by level, layer and x, so only following regions starting before the end of the current one may overlap
+    bool overlaps = false;
+    for (auto it = group_begin; it != group_end && !overlaps; ++it) {
+      const auto &current = copies[*it];
+      for (auto next = it + 1; next != group_end && !overlaps; ++next) {
+        const auto &other = copies[*next];
+        if (other.imageSubresource.mipLevel != current.imageSubresource.mipLevel
+            || other.imageSubresource.baseArrayLayer != current.imageSubresource.baseArrayLayer
+            || other.imageOffset.x >= current.imageOffset.x + (int)current.imageExtent.width)
+          break;
+        overlaps = intersects(current, other);
+      }
+    }
+
+    if (overlaps) {
+      std::sort(group_begin, group_end);
+      for (auto it = group_begin; it != group_end; ++it) {
+        if (it != group_begin)
+          stage_transfer_barrier();
+        emit({&*it, 1});
+      }
+    } else {
+      std::stable_sort(group_begin, group_end,
+                       [&copies](uint _a, uint _b) { return handle_less(copies[_a].source_, copies[_b].source_); });
+      auto run_begin = group_begin;
+      while (run_begin != group_end) {
+        auto run_end = std::find_if(run_begin, group_end, [&copies, run_begin](uint _index) {
+          return copies[_index].source_ != copies[*run_begin].source_;
+        });
+        emit({&*run_begin, size_t(run_end - run_begin)});
+        run_begin = run_end;
+      }
+    }
+    group_begin = group_end;
+  }
+}
+
+void display::stage_batch(std::span<const buffer_copy> _buffers, std::span<const image_update> _images) {
+  if (_buffers.empty() && _images.empty())
+    return;
+
+  // Zeroes, clears and copies recorded before to the same destinations must land first
+  const auto unsynced_buffer = [this](VkBuffer _buffer) { return staging_unsynced_buffers_.contains(_buffer); };
+  const auto unsynced_image  = [this](VkImage _image) { return staging_unsynced_images_.contains(_image); };
+  if (std::ranges::any_of(staging_batch_buffers_, unsynced_buffer)
+      || std::ranges::any_of(staging_batch_images_, unsynced_image))
+    stage_transfer_barrier();
+
+  stage_pending_buffer_copies(_buffers);
+  stage_pending_image_copies(_images);
+  staging_unsynced_buffers_.insert(staging_batch_buffers_.begin(), staging_batch_buffers_.end());
+  staging_unsynced_images_.insert(staging_batch_images_.begin(), staging_batch_images_.end());
+  staging_batch_buffers_.clear();
+  staging_batch_images_.clear();
+}
+
+void display::stage_ordered() {
+  HUT_PROFILE_FUN(PDISPLAY, staging_commands_.size(), pending_buffer_copies_.size(), pending_image_copies_.size())
+
+  // Records are drained in the order they were pushed, which may differ slightly from the order they were numbered in
+  const auto by_sequence = [](const auto &_a, const auto &_b) { return _a.sequence_ < _b.sequence_; };
+  std::ranges::stable_sort(pending_buffer_copies_, by_sequence);
+  std::ranges::stable_sort(pending_image_copies_, by_sequence);
+
+  // Copies are batched until a command touches one of their destinations, the batch is then recorded before it
+  std::span<const buffer_copy>  buffers         = pending_buffer_copies_;
+  std::span<const image_update> images          = pending_image_copies_;
+  size_t                        batched_buffers = 0, batched_images = 0;
+
+  const auto extend_batch = [&](u64 _sequence) {
+    for (; batched_buffers < buffers.size() && buffers[batched_buffers].sequence_ < _sequence; batched_buffers++)
+      staging_batch_buffers_.emplace(buffers[batched_buffers].destination_);
+    for (; batched_images < images.size() && images[batched_images].sequence_ < _sequence; batched_images++)
+      staging_batch_images_.emplace(images[batched_images].destination_);
+  };
+  const auto flush_batch = [&]() {
+    stage_batch(buffers.first(batched_buffers), images.first(batched_images));
+    buffers         = buffers.subspan(batched_buffers);
+    images          = images.subspan(batched_images);
+    batched_buffers = batched_images = 0;
+  };
+
+  for (const auto &command : staging_commands_) {
+    extend_batch(command.sequence_);
+    if (touches_batch(command))
+      flush_batch();
+    stage_command(command);
+  }
+  extend_batch(NUMAX<u64>);
+  flush_batch();
+
+  staging_commands_.clear();
+  pending_buffer_copies_.clear();
+  pending_image_copies_.clear();
+  staging_unsynced_buffers_.clear();
+  staging_unsynced_images_.clear();
+}
+
+void display::begin_staging() {
+  auto &submission = staging_submissions_[staging_current_];
+  assert(!submission.pending_);
+  staging_cb_ = submission.cb_;
+
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType                    = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags                    = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  HUT_VVK(HUT_PVK(vkBeginCommandBuffer, staging_cb_, &begin_info));
+}
+
+void display::retire_staging(staging_submission &_submission, bool _wait) {
+  if (!_submission.pending_)
+    return;
+
+  if (_wait) {
+    HUT_PROFILE_SCOPE(PDISPLAY, "Staging wait")
+    const bool nested = staging_stall_.has_value();
+    if (!nested)
+      begin_stall();
+    HUT_VVK(HUT_PVK(vkWaitForFences, device_, 1, &_submission.fence_, VK_TRUE, NUMAX<u64>));
+    if (!nested)
+      end_stall();
+  } else if (HUT_PVK(vkGetFenceStatus, device_, _submission.fence_) != VK_SUCCESS) {
+    return;
+  }
+
+  HUT_VVK(HUT_PVK(vkResetFences, device_, 1, &_submission.fence_));
+  _submission.garbage_.clear();
+  _submission.retained_.clear();
+  _submission.pending_ = false;
+  staging_->release_transient_pages();
+}
+
+display::staging_arena &display::thread_staging_arena() {
+  // Keyed by uid as a display may be destroyed and another one allocated at the same address
+  thread_local std::vector<std::pair<u64, staging_arena *>> t_arenas;
+  for (auto &[uid, arena] : t_arenas) {
+    if (uid == staging_uid_)
+      return *arena;
+  }
+
+  std::lock_guard lk(staging_mutex_);
+  auto           &arena = staging_arenas_.emplace_back();
+  t_arenas.emplace_back(staging_uid_, &arena);
+  return arena;
+}
+
+std::optional<buffer_suballoc<u8>> display::try_allocate_arena(staging_arena &_arena, uint _size, uint _align) {
+  // Only the owning thread sub-allocates, others may only close the arena, so page_ and offset_bytes_ are stable here
+  auto state = _arena.state_.load(std::memory_order_relaxed);
+  while (state != STAGING_ARENA_CLOSED) {
+    const uint offset_bytes = align(_arena.offset_bytes_ + uint(state), _align);
+    const uint used         = offset_bytes + _size - _arena.offset_bytes_;
+    if (used > params_.staging_arena_byte_size_)
+      return {};
+    const u64 next = (((state >> 32) + 1) << 32) | used;
+    if (_arena.state_.compare_exchange_weak(state, next, std::memory_order_relaxed))
+      return buffer_suballoc<u8>{_arena.page_, offset_bytes, _size};
+  }
+  return {};
+}
+
+void display::close_arena(staging_arena &_arena) {
+  const auto state = _arena.state_.exchange(STAGING_ARENA_CLOSED);
+  if (state != STAGING_ARENA_CLOSED)
+    staging_->close_shared_raw({_arena.page_, _arena.offset_bytes_}, uint(state >> 32));
+}
+
+buffer_suballoc<u8> display::allocate_staging(uint _size_bytes, uint _align) {
+  HUT_PROFILE_FUN(PSTAGING, _size_bytes, _align)
+  // Bigger allocations would waste most of the arena they close
+  if (_size_bytes > params_.staging_arena_byte_size_ / 4) {
+    std::lock_guard lk(staging_mutex_);
+    return allocate_staging_impl(_size_bytes, _align);
+  }
+
+  auto &arena = thread_staging_arena();
+  auto  fit   = try_allocate_arena(arena, _size_bytes, _align);
+  if (fit)
+    return std::move(*fit);
+
+  std::lock_guard lk(staging_mutex_);
+  close_arena(arena);
+  auto range = staging_->try_allocate_shared_raw(params_.staging_arena_byte_size_);
+  if (!range)
+    return allocate_staging_impl(_size_bytes, _align);
+  arena.page_         = range->page_;
+  arena.offset_bytes_ = range->offset_bytes_;
+  arena.state_        = 0;
+  fit                 = try_allocate_arena(arena, _size_bytes, _align);
+  assert(fit);
+  return std::move(*fit);
+}
+
+void display::begin_stall() {
+  staging_stall_ = clock::now();
+}
+
+void display::account_stall() {
+  if (!staging_stall_)
+    return;
+  const auto now = clock::now();
+  staging_stats_.blocked_ += now - *staging_stall_;
+  staging_stall_ = now;
+}
+
+void display::end_stall() {
+  account_stall();
+  staging_stall_.reset();
+}
+
+buffer_suballoc<u8> display::allocate_staging_impl(uint _size_bytes, uint _align) {
+  HUT_PROFILE_FUN(PSTAGING, _size_bytes, _align)
+  auto fit = staging_->try_allocate_raw(_size_bytes, _align);
+  if (fit)
+    return std::move(*fit);
+
+  // Everything from here on stalls the caller: retire waits, flushing early, or a dedicated allocation
+  begin_stall();
+
+  // The ring is reclaimed in allocation order, so retire oldest submissions first
+  const auto retire_until_fit = [this, &fit, _size_bytes, _align]() {
+    for (uint i = 1; i < STAGING_SUBMISSIONS && !fit; i++) {
+      auto &submission = staging_submissions_[(staging_current_ + i) % STAGING_SUBMISSIONS];
+      if (!submission.pending_)
+        continue;
+      retire_staging(submission, true);
+      fit = staging_->try_allocate_raw(_size_bytes, _align);
+    }
+  };
+
+  const auto policy = params_.staging_overflow_;
+  if (policy != display_params::SDEDICATED && _size_bytes <= params_.staging_byte_size_) {
+    if (policy == display_params::SBLOCK)
+      retire_until_fit();
+    if (!fit) {
+      flush_staged_impl();
+      retire_until_fit();
+    }
+  }
+
+  if (fit) {
+    end_stall();
+    return std::move(*fit);
+  }
+
+  // Either by policy, or because the ring is held by updators that are not finalized yet
+#ifdef HUT_DEBUG_STAGING
+  std::cout << "[staging] ring full, dedicated allocation of " << _size_bytes << " bytes" << std::endl;
+#endif
+  auto dedicated = staging_->allocate_transient_raw(_size_bytes, _align);
+  end_stall();
+  return dedicated;
+}
+
+uint display::staging_high_water_mark() {
+  std::lock_guard lk(staging_mutex_);
+  return staging_->high_water_mark();
+}
+
+staging_stats display::last_staging_stats() {
+  std::lock_guard lk(staging_mutex_);
+  return last_staging_stats_;
+}
+
+staging_stats display::total_staging_stats() {
+  std::lock_guard lk(staging_mutex_);
+  return total_staging_stats_;
+}
+
+memory_stats display::memory_usage() {
+  HUT_PROFILE_FUN(PDISPLAY)
+  memory_stats result;
+  result.budget_ = memory_budget_;
+  if (memory_budget_) {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+    budget.sType                                     = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    VkPhysicalDeviceMemoryProperties2 props          = {};
+    props.sType                                      = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    props.pNext                                      = &budget;
+    HUT_PVK(vkGetPhysicalDeviceMemoryProperties2, pdevice_, &props);
+
+    const auto &heaps = props.memoryProperties.memoryHeaps;
+    result.heaps_.resize(props.memoryProperties.memoryHeapCount);
+    for (u32 i = 0; i < props.memoryProperties.memoryHeapCount; i++)
+      result.heaps_[i] = {heaps[i].size, budget.heapBudget[i], budget.heapUsage[i], heaps[i].flags};
+  }
+  memory_->collect(result);
+
+  std::lock_guard lk(staging_mutex_);
+  size_t          garbage = postflush_garbage_.size() + postflush_retained_.size();
+  for (const auto &submission : staging_submissions_)
+    garbage += submission.garbage_.size() + submission.retained_.size();
+  result.pending_garbage_ = garbage;
+  return result;
+}
+
+void display::trim_buffers(time_point _now) {
+  HUT_PROFILE_FUN(PDISPLAY)
+  if (_now - last_pressure_check_ > std::chrono::seconds(1)) {
+    last_pressure_check_ = _now;
+    memory_pressure_     = false;
+    for (const auto &heap : memory_usage().heaps_)
+      memory_pressure_ |= heap.usage_ > heap.budget_ / 10 * 9;
+  }
+
+  std::lock_guard lk(buffers_mutex_);
+  for (auto *buf : buffers_)
+    buf->trim(memory_pressure_ ? buf->params_.trim_pressure_delay_ : buf->params_.trim_delay_);
+}
+
+#ifdef HUT_ENABLE_PROFILING
+void display::profile_memory_usage() {
+  const auto  stats = memory_usage();
+  const auto &bytes = stats.categories_;
+  HUT_PROFILE_COUNTER_NAMED(PDISPLAY, "memory", ("staging", "buffer", "atlas", "render_target", "image"),
+                            bytes[MSTAGING], bytes[MBUFFER], bytes[MATLAS], bytes[MRENDER_TARGET], bytes[MIMAGE]);
+  HUT_PROFILE_COUNTER_NAMED(PDISPLAY, "memory objects", ("allocations", "pending_garbage"), stats.allocations_,
+                            stats.pending_garbage_);
+  for (const auto &heap : stats.heaps_) {
+    if ((heap.flags_ & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0) {
+      HUT_PROFILE_COUNTER_NAMED(PDISPLAY, "device local heap", ("usage", "budget"), heap.usage_, heap.budget_);
+      break;
+    }
+  }
+}
+#endif  // HUT_ENABLE_PROFILING
+
+void display::record_parallel(std::span<const record_job> _jobs) {
+  HUT_PROFILE_FUN(PDISPLAY)
+  if (record_workers_.empty() || _jobs.size() < 2) {
+    for (const auto &job : _jobs)
+      job();
+    return;
+  }
+
+  std::unique_lock lk(record_mutex_);
+  record_done_cv_.wait(lk, [this] { return record_jobs_.empty(); });
+  record_jobs_    = _jobs;
+  record_next_    = 1;
+  record_pending_ = _jobs.size() - 1;
+  lk.unlock();
+  record_cv_.notify_all();
+
+  _jobs[0]();
+
+  lk.lock();
+  while (record_next_ < record_jobs_.size())
+    run_record_job(lk);
+  record_done_cv_.wait(lk, [this] { return record_pending_ == 0; });
+  record_jobs_ = {};
+  lk.unlock();
+  record_done_cv_.notify_all();
+}
+
+void display::run_record_job(std::unique_lock<std::mutex> &_lock) {
+  const auto &job = record_jobs_[record_next_++];
+  _lock.unlock();
+  job();
+  _lock.lock();
+  if (--record_pending_ == 0)
+    record_done_cv_.notify_all();
+}
+
+void display::record_worker() {
+  std::unique_lock lk(record_mutex_);
+  while (true) {
+    record_cv_.wait(lk, [this] { return record_stop_ || record_next_ < record_jobs_.size(); });
+    if (record_stop_)
+      return;
+    run_record_job(lk);
+  }
+}
+
 void display::flush_staged() {
   HUT_PROFILE_FUN(PDISPLAY)
   std::lock_guard lk(staging_mutex_);
-  if (staging_jobs_ == 0)
+  flush_staged_impl();
+}
+
+void display::wait_graphics() {
+  HUT_PROFILE_FUN(PDISPLAY)
+  if (graphics_timeline_ == VK_NULL_HANDLE) {
+    std::lock_guard queues_lk(queues_mutex_);
+    HUT_VVK(HUT_PVK(vkQueueWaitIdle, queueg_));
+    return;
+  }
+
+  const u64           value     = graphics_timeline_value_;
+  VkSemaphoreWaitInfo wait_info = {};
+  wait_info.sType               = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  wait_info.semaphoreCount      = 1;
+  wait_info.pSemaphores         = &graphics_timeline_;
+  wait_info.pValues             = &value;
+  HUT_VVK(HUT_PVK(vkWaitSemaphores, device_, &wait_info, NUMAX<u64>));
+}
+
+void display::flush_staged_impl() {
+  for (auto &submission : staging_submissions_)
+    retire_staging(submission, false);
+  for (auto &arena : staging_arenas_)
+    close_arena(arena);
+  drain_staging_records();
+
+  if (staging_commands_.empty() && pending_buffer_copies_.empty() && pending_image_copies_.empty()) {
+    // Nothing queued can use them anymore, only the submissions in flight
+    for (auto &submission : staging_submissions_) {
+      if (submission.pending_)
+        submission.retained_.insert(submission.retained_.end(), postflush_retained_.begin(), postflush_retained_.end());
+    }
+    postflush_retained_.clear();
     return;
+  }
 
 #ifdef HUT_DEBUG_STAGING
   std::cout << "[staging] doing preflush" << std::endl;
 #endif
-  for (auto &preflush : preflush_jobs_)
-    preflush();
-  preflush_jobs_.clear();
+  // Previous staging batches end with a barrier, later ones are ordered after them. Graphics work is only waited for
+  // if it may read what this batch overwrites, on the graphics queue with an execution dependency, or through the
+  // timeline on submit.
+  track_destinations();
+  if (!staging_transfer_ && staging_read_since_ != NUMAX<u64>) {
+    HUT_PVK(vkCmdPipelineBarrier, staging_cb_, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+            0, nullptr, 0, nullptr, 0, nullptr);
+  }
+  stage_ordered();
+  restore_layouts();
 
-  if (staging_jobs_ > 0)
-    return;
+  VkMemoryBarrier barrier = {};
+  barrier.sType           = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask   = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask   = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+  HUT_PVK(vkCmdPipelineBarrier, staging_cb_, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1,
+          &barrier, 0, nullptr, 0, nullptr);
+  HUT_VVK(HUT_PVK(vkEndCommandBuffer, staging_cb_));
 
-  HUT_PVK(vkEndCommandBuffer, staging_cb_);
+  auto &current = staging_submissions_[staging_current_];
 
   VkSubmitInfo submit_info       = {};
   submit_info.sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO;
   submit_info.commandBufferCount = 1;
-  submit_info.pCommandBuffers    = &staging_cb_;
+  submit_info.pCommandBuffers    = &current.cb_;
 
 #ifdef HUT_DEBUG_STAGING
-  std::cout << "[staging] submitting!" << std::endl;
+  std::cout << "[staging] submitting " << staging_current_ << "!" << std::endl;
 #endif
-  HUT_PVK(vkQueueSubmit, queueg_, 1, &submit_info, VK_NULL_HANDLE);
-  HUT_PVK(vkQueueWaitIdle, queueg_);
-
-  VkCommandBufferBeginInfo begin_info = {};
-  begin_info.sType                    = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  begin_info.flags                    = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-  HUT_PVK(vkBeginCommandBuffer, staging_cb_, &begin_info);
-
-  postflush_garbage_.clear();
+  std::unique_lock queues_lk(queues_mutex_);
+  if (staging_transfer_) {
+    // Graphics submissions since the last write of a destination may still read it, the latest one is waited for
+    // unless it already completed. Graphics submissions wait on the signaled value through staging_handoff().
+    const u64 read_value = graphics_timeline_value_;
+    u64       completed  = 0;
+    if (staging_read_since_ < read_value)
+      HUT_VVK(HUT_PVK(vkGetSemaphoreCounterValue, device_, graphics_timeline_, &completed));
+    const bool wait = staging_read_since_ < read_value && completed < read_value;
+
+    const u64                     handoff_value = transfer_timeline_value_ + 1;
+    const VkPipelineStageFlags    wait_stage    = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkTimelineSemaphoreSubmitInfo timeline      = {};
+    timeline.sType                              = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline.waitSemaphoreValueCount            = wait ? 1 : 0;
+    timeline.pWaitSemaphoreValues               = &read_value;
+    timeline.signalSemaphoreValueCount          = 1;
+    timeline.pSignalSemaphoreValues             = &handoff_value;
+    submit_info.pNext                           = &timeline;
+    submit_info.waitSemaphoreCount              = wait ? 1 : 0;
+    submit_info.pWaitSemaphores                 = &graphics_timeline_;
+    submit_info.pWaitDstStageMask               = &wait_stage;
+    submit_info.signalSemaphoreCount            = 1;
+    submit_info.pSignalSemaphores               = &transfer_timeline_;
+    HUT_VVK(HUT_PVK(vkQueueSubmit, queuet_, 1, &submit_info, current.fence_));
+    transfer_timeline_value_ = handoff_value;
+    staging_stats_.submissions_++;
+  } else {
+    HUT_VVK(HUT_PVK(vkQueueSubmit, queueg_, 1, &submit_info, current.fence_));
+    staging_stats_.submissions_++;
+  }
+  queues_lk.unlock();
+  staging_read_since_ = NUMAX<u64>;
+  current.pending_    = true;
+  current.garbage_.swap(postflush_garbage_);
+  current.retained_.swap(postflush_retained_);
+
+  // Only blocks if all the staging command buffers are still in flight
+  staging_current_ = (staging_current_ + 1) % STAGING_SUBMISSIONS;
+  retire_staging(staging_submissions_[staging_current_], true);
+  begin_staging();
+
+  account_stall();  // When flushing early to make room
+  auto &stats               = staging_stats_;
+  stats.flushes_            = 1;
+  stats.staging_allocated_  = staging_->allocated_bytes();
+  stats.staging_high_water_ = staging_->high_water_mark();
+  HUT_PROFILE_COUNTER_NAMED(PSTAGING, "staging commands", ("copies", "zeroes", "clears", "transitions", "submissions"),
+                            stats.copies_, stats.zeroes_, stats.clears_, stats.transitions_, stats.submissions_);
+  HUT_PROFILE_COUNTER_NAMED(PSTAGING, "staging bytes", ("uploaded"), stats.bytes_);
+  HUT_PROFILE_COUNTER_NAMED(PSTAGING, "staging ring", ("allocated"), stats.staging_allocated_);
+  HUT_PROFILE_COUNTER_NAMED(PSTAGING, "staging ring high water", ("bytes"), stats.staging_high_water_);
+  HUT_PROFILE_COUNTER_NAMED(PSTAGING, "staging blocked", ("us"),
+                            std::chrono::duration_cast<std::chrono::microseconds>(stats.blocked_).count());
+  last_staging_stats_ = stats;
+  total_staging_stats_ += stats;
+  stats = {};
 
 #ifdef HUT_DEBUG_STAGING
   std::cout << "[staging] done, staging pool status:" << std::endl;
@@ -38,13 +38,13 @@
 
 namespace hut {
 
-std::shared_ptr<image> image::load_raw(display &_display, const shared_buffer &_storage, std::span<const u8> _data,
-                                       uint _data_row_pitch, const image_params &_params) {
+std::shared_ptr<image> image::load_raw(display &_display, std::span<const u8> _data, uint _data_row_pitch,
+                                       const image_params &_params) {
   HUT_PROFILE_FUN(PIMAGE)
   assert(_params.levels_ == 1);
   assert(_params.layers_ == 1);
 
-  auto dst = std::make_shared<image>(_display, _storage, _params);
+  auto dst = std::make_shared<image>(_display, _params);
   dst->update({u16bbox_px{0, 0, _params.size_}}, _data, _data_row_pitch);
 
   return dst;
@@ -54,10 +54,11 @@ image::~image() {
   HUT_PROFILE_FUN(PIMAGE)
   auto *const device = display_->device();
   HUT_PVK(vkDestroyImageView, device, view_, nullptr);
+  display_->forget_destination(image_);
   HUT_PVK(vkDestroyImage, device, image_, nullptr);
 }
 
-image::image(display &_display, const shared_buffer &_storage, const image_params &_params)
+image::image(display &_display, const image_params &_params)
     : display_(&_display)
     , params_(_params) {
   HUT_PROFILE_FUN(PIMAGE)
@@ -87,27 +88,57 @@ image::image(display &_display, const shared_buffer &_storage, const image_param
   image_info.sharingMode       = VK_SHARING_MODE_EXCLUSIVE;
   image_info.flags             = _params.flags_;
 
-  HUT_VVK(HUT_PVK(vkCreateImage, _display.device(), &image_info, nullptr, &image_));
-
-  VkMemoryRequirements mem_req;
-  HUT_PVK(vkGetImageMemoryRequirements, _display.device(), image_, &mem_req);
+  constexpr auto TRANSFER_USAGE = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  const auto     families       = _display.transfer_families();
+  if (_display.staging_transfer_ && (_params.usage_ & TRANSFER_USAGE) != 0) {
+    image_info.sharingMode           = VK_SHARING_MODE_CONCURRENT;
+    image_info.queueFamilyIndexCount = families.size();
+    image_info.pQueueFamilyIndices   = families.data();
+  }
 
-  // FIXME: Assert that mem_req.memoryTypeBits is compatible with _storage
-  alloc_ = _storage->allocate<u8>(mem_req.size, mem_req.alignment);
+  HUT_VVK(HUT_PVK(vkCreateImage, _display.device(), &image_info, nullptr, &image_));
 
-  HUT_PVK(vkBindImageMemory, _display.device(), image_, alloc_->parent()->memory_, alloc_->offset_bytes());
+  VkMemoryDedicatedRequirements dedicated_req = {};
+  dedicated_req.sType                         = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+  VkMemoryRequirements2 mem_req               = {};
+  mem_req.sType                               = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+  mem_req.pNext                               = &dedicated_req;
+  VkImageMemoryRequirementsInfo2 req_info     = {};
+  req_info.sType                              = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+  req_info.image                              = image_;
+  HUT_PVK(vkGetImageMemoryRequirements2, _display.device(), &req_info, &mem_req);
+
+  // Big attachments are reallocated on resize, and drivers may place them in a better spot when dedicated
+  constexpr auto ATTACHMENT_USAGE = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  const auto     size             = mem_req.memoryRequirements.size;
+  const bool     attachment       = (_params.usage_ & ATTACHMENT_USAGE) != 0;
+  const bool     big_attachment   = attachment && size >= _display.params_.dedicated_byte_size_;
+  const bool     prefers          = dedicated_req.prefersDedicatedAllocation == VK_TRUE;
+  const bool     required         = dedicated_req.requiresDedicatedAllocation == VK_TRUE;
+  const bool     linear           = _params.tiling_ == VK_IMAGE_TILING_LINEAR;
+
+  device_memory::request request = {};
+  request.requirements_          = mem_req.memoryRequirements;
+  request.properties_            = _params.properties_;
+  request.tiling_                = linear ? device_memory::TLINEAR : device_memory::TOPTIMAL;
+  request.category_              = _params.category_;
+  request.dedicated_image_       = prefers || required || big_attachment ? image_ : VK_NULL_HANDLE;
+  memory_                        = _display.memory().allocate(request);
+
+  HUT_PVK(vkBindImageMemory, _display.device(), image_, memory_.memory(), memory_.offset());
 
   const bool            cubemap             = (params_.flags_ & VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT) != 0u;
+  const VkImageViewType flat_type           = params_.array_ ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
   VkImageViewCreateInfo view_info           = {};
   view_info.sType                           = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   view_info.image                           = image_;
-  view_info.viewType                        = cubemap ? VK_IMAGE_VIEW_TYPE_CUBE : VK_IMAGE_VIEW_TYPE_2D;
+  view_info.viewType                        = cubemap ? VK_IMAGE_VIEW_TYPE_CUBE : flat_type;
   view_info.format                          = _params.format_;
   view_info.subresourceRange.aspectMask     = _params.aspect_;
   view_info.subresourceRange.baseMipLevel   = 0;
   view_info.subresourceRange.levelCount     = _params.levels_;
   view_info.subresourceRange.baseArrayLayer = 0;
-  view_info.subresourceRange.layerCount     = cubemap ? 6 : 1;
+  view_info.subresourceRange.layerCount     = cubemap ? 6 : (params_.array_ ? _params.layers_ : 1);
 
   HUT_VVK(HUT_PVK(vkCreateImageView, _display.device(), &view_info, nullptr, &view_));
 
@@ -131,16 +162,32 @@ image::image(display &_display, const shared_buffer &_storage, const image_param
   display::image_clear clear     = {};
   clear.destination_             = image_;
   clear.color_                   = {};
+  clear.storage_                 = memory_.alias();
+  clear.storage_offset_          = memory_.offset();
+  clear.storage_size_            = memory_.size() & ~3u;
+
+  // From the transfer queue, linear images are cleared by filling the buffer aliasing their page. Without one, zeroes
+  // are uploaded through staging instead, ordered between both transitions.
+  const bool linear_clear = params_.tiling_ == VK_IMAGE_TILING_LINEAR;
+  const bool clearable    = linear_clear && (!display_->staging_transfer_ || clear.storage_ != VK_NULL_HANDLE);
+
+  std::unique_lock lk(display_->staging_mutex_);
+  display_->queue_command(pre, range);
+  if (clearable)
+    display_->queue_command(clear, range);
+  lk.unlock();
+
+  if (linear_clear && !clearable) {
+    for (u16 level = 0; level < _params.levels_; level++) {
+      for (u16 layer = 0; layer < _params.layers_; layer++) {
+        auto updto = update({u16bbox_px{0, 0, params_.size_ >> level}, level, layer});
+        memset(updto.data(), 0, updto.size_bytes());
+      }
+    }
+  }
 
-  std::lock_guard lk(display_->staging_mutex_);
-  display_->staging_jobs_++;
-  display_->preflush([this, pre, post, clear, range]() {
-    display_->stage_transition(pre, range);
-    if ((params_.tiling_ & VK_IMAGE_TILING_LINEAR) != 0)  // FIXME
-      display_->stage_clear(clear, range);
-    display_->stage_transition(post, range);
-    display_->staging_jobs_--;
-  });
+  lk.lock();
+  display_->queue_command(post, range);
 }
 
 void image::update(subresource _subres, std::span<const u8> _data, uint _src_row_pitch) {
@@ -151,7 +198,9 @@ void image::update(subresource _subres, std::span<const u8> _data, uint _src_row
   auto mip_size = params_.size_ >> _subres.level_;
   assert(mip_size.x >= size.x && mip_size.y >= size.y);
 
-  if (_src_row_pitch == updto.staging_row_pitch() || params_.tiling_ == VK_IMAGE_TILING_OPTIMAL) {
+  // Compressed formats are copied as a whole, rows of blocks don't map to rows of texels
+  const bool compressed = format_info::from(params_.format_).compressed();
+  if (_src_row_pitch == updto.staging_row_pitch() || compressed) {
     memcpy(updto.data(), _data.data(), _data.size_bytes());
   } else {
     uint row_bit_size = (uint)size.x * bpp();
@@ -177,9 +226,7 @@ image::updator image::update(subresource _subres) {
   uint staging_row_pitch = align(row_byte_size, buffer_align);
   auto byte_size         = (uint)size.y * staging_row_pitch;
 
-  std::lock_guard lk(display_->staging_mutex_);
-
-  auto staging_alloc = display_->staging_->allocate_raw(byte_size, offset_align);
+  auto staging_alloc = display_->allocate_staging(byte_size, offset_align);
   auto span          = std::span<u8>{staging_alloc.parent()->permanent_map_ + staging_alloc.offset_bytes(), byte_size};
   return {*this, std::move(staging_alloc), span, staging_row_pitch, _subres};
 }
@@ -202,36 +249,21 @@ void image::finalize_update(image::updator &_update) {
   subres_range.baseArrayLayer          = _update.subres_.layer_;
   subres_range.layerCount              = 1;
 
-  display::image_transition pre = {};
-  pre.destination_              = image_;
-  pre.old_layout_               = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  pre.new_layout_               = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-
-  display::image_transition post = {};
-  post.destination_              = image_;
-  post.old_layout_               = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  post.new_layout_               = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  const bool compressed = format_info::from(params_.format_).compressed();
 
-  display::buffer_image_copy copy = {};
-  copy.imageExtent                = {(uint)size.x, (uint)size.y, 1};
-  copy.imageOffset                = {(int)origin.x, (int)origin.y, 0};
-  copy.bufferRowLength   = params_.tiling_ == VK_IMAGE_TILING_OPTIMAL ? 0 : ((_update.staging_row_pitch_ * 8) / bpp());
-  copy.bufferImageHeight = params_.tiling_ == VK_IMAGE_TILING_OPTIMAL ? 0 : (uint)size.y;
+  display::image_update copy = {};
+  copy.imageExtent           = {(uint)size.x, (uint)size.y, 1};
+  copy.imageOffset           = {(int)origin.x, (int)origin.y, 0};
+  copy.bufferRowLength   = compressed ? 0 : ((_update.staging_row_pitch_ * 8) / bpp());
+  copy.bufferImageHeight = compressed ? 0 : (uint)size.y;
   copy.bufferOffset      = _update.staging_.offset_bytes();
   copy.imageSubresource  = subres_layers;
   copy.source_           = _update.staging_.parent()->buffer_;
   copy.destination_      = image_;
   copy.bytes_size_       = _update.size_bytes();
+  copy.range_            = subres_range;
 
-  std::lock_guard lk(display_->staging_mutex_);
-  display_->staging_jobs_++;
-  display_->preflush([this, pre, post, copy, subres_range]() {
-    display_->stage_transition(pre, subres_range);
-    display_->stage_copy(copy);
-    display_->stage_transition(post, subres_range);
-    display_->staging_jobs_--;
-  });
-  display_->postflush_collect(std::move(_update.staging_));
+  display_->post_copy(copy, std::move(_update.staging_));
 }
 
 }  // namespace hut
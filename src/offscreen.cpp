@@ -30,6 +30,7 @@
 #include <cstddef>
 
 #include <algorithm>
+#include <optional>
 #include <utility>
 
 #include "hut/utils/math.hpp"
@@ -41,7 +42,7 @@
 
 namespace hut {
 
-offscreen::offscreen(const shared_image &_target, const shared_buffer &_storage, offscreen_params _init_params)
+offscreen::offscreen(const shared_image &_target, offscreen_params _init_params)
     : render_target(*_target->display_)
     , params_(std::move(_init_params))
     , target_(_target) {
@@ -62,13 +63,14 @@ offscreen::offscreen(const shared_image &_target, const shared_buffer &_storage,
   pass_params.initial_layout_ = VK_IMAGE_LAYOUT_UNDEFINED;
   pass_params.final_layout_   = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-  reinit_pass(_storage, pass_params, std::span<VkImageView>{&_target->view_, 1});
+  reinit_pass(pass_params, std::span<VkImageView>{&_target->view_, 1});
 
   VkCommandBufferAllocateInfo alloc_info = {};
   alloc_info.sType                       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   alloc_info.level                       = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
   alloc_info.commandBufferCount          = 1;
   alloc_info.commandPool                 = display_->commandg_pool_;
+  std::lock_guard lk(display_->commandg_mutex_);
   HUT_VVK(HUT_PVK(vkAllocateCommandBuffers, display_->device_, &alloc_info, &cb_));
 
   VkFenceCreateInfo fence_info = {};
@@ -78,33 +80,135 @@ offscreen::offscreen(const shared_image &_target, const shared_buffer &_storage,
 
 offscreen::~offscreen() {
   HUT_PROFILE_FUN(POFFSCREEN)
+  std::lock_guard lk(display_->commandg_mutex_);
+  for (auto &slot : readback_slots_) {
+    HUT_PVK(vkFreeCommandBuffers, display_->device_, display_->commandg_pool_, 1, &slot->cb_);
+    HUT_PVK(vkDestroyFence, display_->device_, slot->fence_, nullptr);
+  }
   if (cb_ != VK_NULL_HANDLE)
     HUT_PVK(vkFreeCommandBuffers, display_->device_, display_->commandg_pool_, 1, &cb_);
   if (fence_ != VK_NULL_HANDLE)
     HUT_PVK(vkDestroyFence, display_->device_, fence_, nullptr);
+  for (auto &secondaries : secondaries_)
+    destroy_secondary_pool(secondaries);
 }
 
-void offscreen::flush_cb() {
-  HUT_PROFILE_FUN(POFFSCREEN)
+void offscreen::submit(VkCommandBuffer _cb, VkFence _fence) {
   VkSubmitInfo submit_info       = {};
   submit_info.sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO;
   submit_info.commandBufferCount = 1;
-  submit_info.pCommandBuffers    = &cb_;
+  submit_info.pCommandBuffers    = &_cb;
+
+  const u64                     wait_value    = display_->staging_handoff();
+  const VkPipelineStageFlags    wait_stage    = display::STAGING_CONSUMER_STAGES;
+  u64                           signal_value  = 0;
+  VkTimelineSemaphoreSubmitInfo timeline_info = {};
+  if (display_->graphics_timeline_ != VK_NULL_HANDLE) {
+    timeline_info.sType                     = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues    = &signal_value;
+    submit_info.pNext                       = &timeline_info;
+    submit_info.signalSemaphoreCount        = 1;
+    submit_info.pSignalSemaphores           = &display_->graphics_timeline_;
+  }
+  if (display_->staging_transfer_) {
+    timeline_info.waitSemaphoreValueCount = 1;
+    timeline_info.pWaitSemaphoreValues    = &wait_value;
+    submit_info.waitSemaphoreCount        = 1;
+    submit_info.pWaitSemaphores           = &display_->transfer_timeline_;
+    submit_info.pWaitDstStageMask         = &wait_stage;
+  }
+
+  std::lock_guard queues_lk(display_->queues_mutex_);
+  signal_value = display_->next_graphics_value();
+  HUT_VVK(HUT_PVK(vkQueueSubmit, display_->queueg_, 1, &submit_info, _fence));
+}
 
-  HUT_VVK(HUT_PVK(vkQueueSubmit, display_->queueg_, 1, &submit_info, fence_));
+void offscreen::flush_cb() {
+  HUT_PROFILE_FUN(POFFSCREEN)
+  submit(cb_, fence_);
   HUT_VVK(HUT_PVK(vkWaitForFences, display_->device_, 1, &fence_, VK_TRUE, 10ull * 1000 * 1000 * 1000));  // 10s timeout
   HUT_VVK(HUT_PVK(vkResetFences, display_->device_, 1, &fence_));
 }
 
 void offscreen::draw(const draw_callback &_callback) {
   HUT_PROFILE_FUN(POFFSCREEN)
+  std::unique_lock lk(display_->commandg_mutex_);
   begin_rebuild_cb(fbos_[0], cb_);
   _callback(cb_);
   end_rebuild_cb(cb_);
+  lk.unlock();
+  flush_cb();
+}
+
+void offscreen::draw(std::span<const draw_callback> _callbacks) {
+  HUT_PROFILE_FUN(POFFSCREEN)
+  if (secondaries_.size() < _callbacks.size())
+    secondaries_.resize(_callbacks.size());
+
+  // The previous draw waited for its fence, the secondaries can be recorded again right away
+  std::vector<display::record_job> jobs;
+  std::vector<VkCommandBuffer>     cbs;
+  for (size_t i = 0; i < _callbacks.size(); i++) {
+    alloc_secondary_pool(secondaries_[i], 1);
+    VkCommandBuffer cb = secondaries_[i].cbs_[0];
+    cbs.emplace_back(cb);
+    jobs.emplace_back([this, cb, &callback = _callbacks[i]] {
+      begin_secondary_cb(fbos_[0], cb);
+      callback(cb);
+      end_secondary_cb(cb);
+    });
+  }
+  display_->record_parallel(jobs);
+
+  std::unique_lock lk(display_->commandg_mutex_);
+  begin_rebuild_cb(fbos_[0], cb_, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  if (!cbs.empty())
+    HUT_PVK(vkCmdExecuteCommands, cb_, cbs.size(), cbs.data());
+  end_rebuild_cb(cb_);
+  lk.unlock();
   flush_cb();
 }
 
 void offscreen::download(std::span<u8> _dst, uint _data_row_pitch, image::subresource _src) {
+  HUT_PROFILE_FUN(POFFSCREEN, _src.coords_, _src.level_, _src.layer_)
+  download_async(_src)->read(_dst, _data_row_pitch);
+}
+
+std::unique_ptr<offscreen::readback_slot> offscreen::acquire_readback_slot() {
+  if (!readback_slots_.empty()) {
+    auto slot = std::move(readback_slots_.back());
+    readback_slots_.pop_back();
+    return slot;
+  }
+
+  auto slot = std::make_unique<readback_slot>();
+
+  VkCommandBufferAllocateInfo alloc_info = {};
+  alloc_info.sType                       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc_info.level                       = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  alloc_info.commandBufferCount          = 1;
+  alloc_info.commandPool                 = display_->commandg_pool_;
+  std::lock_guard lk(display_->commandg_mutex_);
+  HUT_VVK(HUT_PVK(vkAllocateCommandBuffers, display_->device_, &alloc_info, &slot->cb_));
+
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType             = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  HUT_VVK(HUT_PVK(vkCreateFence, display_->device_, &fence_info, nullptr, &slot->fence_));
+  return slot;
+}
+
+void offscreen::recycle_readback(readback &_readback) {
+  // Called from the readback's destructor, can't throw
+  HUT_PVK(vkWaitForFences, display_->device_, 1, &_readback.slot_->fence_, VK_TRUE, UINT64_MAX);
+  HUT_PVK(vkResetFences, display_->device_, 1, &_readback.slot_->fence_);
+
+  std::lock_guard lk(readback_mutex_);
+  _readback.memory_.release();
+  readback_slots_.emplace_back(std::move(_readback.slot_));
+}
+
+offscreen::unique_readback offscreen::download_async(image::subresource _src) {
   HUT_PROFILE_FUN(POFFSCREEN, _src.coords_, _src.level_, _src.layer_)
   // Downloading whole image seems more suitable
   if (_src.coords_ == u16bbox_px{0, 0, 0, 0})
@@ -125,9 +229,29 @@ void offscreen::download(std::span<u8> _dst, uint _data_row_pitch, image::subres
   const uint buffer_row_pitch = align(row_byte_size, buffer_align);
   const auto byte_size        = (uint)size.y * buffer_row_pitch;
 
+  std::unique_ptr<readback_slot>     slot;
+  std::optional<buffer_suballoc<u8>> memory;
+  {
+    std::lock_guard lk(readback_mutex_);
+    if (!readback_buffer_) {
+      // Room for a couple of full frames, pages are added if more readbacks are in flight
+      const uint frame_row_pitch = align((uint)target_->size().x * target_->bpp() / 8, buffer_align);
+      const uint frame_byte_size = (uint)target_->size().y * frame_row_pitch;
+
+      buffer_params params;
+      params.permanent_map_     = true;
+      params.initial_byte_size_ = std::max(2 * frame_byte_size, 64u * 1024);
+      params.type_              = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+      params.usage_             = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+      readback_buffer_          = std::make_shared<buffer>(*display_, params);
+    }
+    slot = acquire_readback_slot();
+    memory.emplace(readback_buffer_->allocate_raw(byte_size, offset_align));
+  }
+
   VkCommandBufferBeginInfo begin_info = {};
   begin_info.sType                    = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  begin_info.flags                    = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+  begin_info.flags                    = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
   begin_info.pInheritanceInfo         = nullptr;  // Optional
 
   VkImageSubresourceRange subres_range;
@@ -144,38 +268,72 @@ void offscreen::download(std::span<u8> _dst, uint _data_row_pitch, image::subres
   subres_layers.layerCount               = 1;
 
   VkBufferImageCopy region;
+  region.bufferOffset      = memory->offset_bytes();
   region.imageExtent       = {(uint)size.x, (uint)size.y, 1};
   region.imageOffset       = {(int)origin.x, (int)origin.y, 0};
   region.bufferRowLength   = (buffer_row_pitch * 8) / target_->bpp();
   region.bufferImageHeight = (uint)size.y;
   region.imageSubresource  = subres_layers;
 
-  std::lock_guard lk(display_->staging_mutex_);
-  auto            staging_alloc = display_->staging_->allocate_raw(byte_size, offset_align);
-  region.bufferOffset           = staging_alloc.offset_bytes();
-
-  HUT_PVK(vkBeginCommandBuffer, cb_, &begin_info);
+  std::unique_lock commandg_lk(display_->commandg_mutex_);
+  HUT_PVK(vkBeginCommandBuffer, slot->cb_, &begin_info);
 
-  display::transition_image(cb_, target_->image_, subres_range, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+  display::transition_image(slot->cb_, target_->image_, subres_range, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
                             VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
-  HUT_PVK(vkCmdCopyImageToBuffer, cb_, target_->image_, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-          staging_alloc.parent()->buffer_, 1, &region);
-  display::transition_image(cb_, target_->image_, subres_range, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+  HUT_PVK(vkCmdCopyImageToBuffer, slot->cb_, target_->image_, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+          memory->parent()->buffer_, 1, &region);
+  display::transition_image(slot->cb_, target_->image_, subres_range, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                             VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
-  HUT_PVK(vkEndCommandBuffer, cb_);
-  flush_cb();
+  HUT_PVK(vkEndCommandBuffer, slot->cb_);
+  commandg_lk.unlock();
+  submit(slot->cb_, slot->fence_);
+
+  return unique_readback(
+      new readback(*this, std::move(slot), std::move(*memory), row_byte_size, buffer_row_pitch, (uint)size.y));
+}
+
+offscreen::readback::readback(offscreen &_parent, std::unique_ptr<readback_slot> &&_slot,
+                              buffer_suballoc<u8> &&_memory, uint _row_byte_size, uint _buffer_row_pitch, uint _rows)
+    : parent_(_parent)
+    , slot_(std::move(_slot))
+    , memory_(std::move(_memory))
+    , row_byte_size_(_row_byte_size)
+    , buffer_row_pitch_(_buffer_row_pitch)
+    , rows_(_rows) {}
+
+offscreen::readback::~readback() {
+  parent_.recycle_readback(*this);
+}
+
+bool offscreen::readback::ready() const {
+  const VkResult result = HUT_PVK(vkGetFenceStatus, parent_.display_->device_, slot_->fence_);
+  if (result == VK_NOT_READY)
+    return false;
+  HUT_VVK(result);
+  return true;
+}
+
+void offscreen::readback::wait() const {
+  HUT_PROFILE_FUN(POFFSCREEN)
+  HUT_VVK(HUT_PVK(vkWaitForFences, parent_.display_->device_, 1, &slot_->fence_, VK_TRUE,
+                  10ull * 1000 * 1000 * 1000));  // 10s timeout
+}
+
+void offscreen::readback::read(std::span<u8> _dst, uint _data_row_pitch) const {
+  HUT_PROFILE_FUN(POFFSCREEN)
+  wait();
 
-  std::span<u8> staging_data{staging_alloc.parent()->permanent_map_ + staging_alloc.offset_bytes(), byte_size};
-  if (_data_row_pitch == buffer_row_pitch) {
-    assert(_dst.size_bytes() >= staging_data.size_bytes());
-    memcpy(_dst.data(), staging_data.data(), staging_data.size());
+  std::span<const u8> data{memory_.parent()->permanent_map_ + memory_.offset_bytes(), rows_ * buffer_row_pitch_};
+  if (_data_row_pitch == buffer_row_pitch_) {
+    assert(_dst.size_bytes() >= data.size_bytes());
+    memcpy(_dst.data(), data.data(), data.size());
   } else {
-    assert(_dst.size_bytes() >= (size_t)size.y * _data_row_pitch);
-    for (uint y = 0; y < (uint)size.y; y++) {
-      auto *src_row = staging_data.data() + uintptr_t(y * buffer_row_pitch);
-      auto *dst_row = _dst.data() + uintptr_t(y * _data_row_pitch);
-      memcpy(dst_row, src_row, row_byte_size);
+    assert(_dst.size_bytes() >= (size_t)rows_ * _data_row_pitch);
+    for (uint y = 0; y < rows_; y++) {
+      const auto *src_row = data.data() + uintptr_t(y * buffer_row_pitch_);
+      auto       *dst_row = _dst.data() + uintptr_t(y * _data_row_pitch);
+      memcpy(dst_row, src_row, row_byte_size_);
     }
   }
 }
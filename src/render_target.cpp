@@ -29,6 +29,7 @@
 
 #include <algorithm>
 #include <iostream>
+#include <utility>
 
 #include "hut/utils/profiling.hpp"
 #include "hut/utils/vulkan.hpp"
@@ -52,11 +53,22 @@ render_target::~render_target() {
 
   if (renderpass_ != VK_NULL_HANDLE)
     HUT_PVK(vkDestroyRenderPass, display_->device(), renderpass_, nullptr);
+  if (renderpass_partial_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroyRenderPass, display_->device(), renderpass_partial_, nullptr);
 }
 
-void render_target::reinit_pass(const shared_buffer &_storage, const render_target_params &_init_params,
-                                std::span<VkImageView> _images) {
+void render_target::reinit_pass(const render_target_params &_init_params, std::span<VkImageView> _images,
+                                retired_pass *_retired) {
   HUT_PROFILE_FUN(PRENDERTARGET)
+  if (_retired != nullptr) {
+    _retired->renderpass_         = std::exchange(renderpass_, VK_NULL_HANDLE);
+    _retired->renderpass_partial_ = std::exchange(renderpass_partial_, VK_NULL_HANDLE);
+    _retired->fbos_               = std::move(fbos_);
+    _retired->depth_              = std::move(depth_);
+    _retired->msaa_rendertarget_  = std::move(msaa_rendertarget_);
+    fbos_.clear();
+  }
+
   render_target_params_ = _init_params;
   const auto size       = _init_params.box_.size();
   const auto offset     = _init_params.box_.origin();
@@ -81,7 +93,8 @@ void render_target::reinit_pass(const shared_buffer &_storage, const render_targ
       params.usage_      = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
       params.aspect_     = VK_IMAGE_ASPECT_COLOR_BIT;
       params.samples_    = sample_count_;
-      msaa_rendertarget_ = std::make_shared<image>(*display_, _storage, params);
+      params.category_   = MRENDER_TARGET;
+      msaa_rendertarget_ = std::make_shared<image>(*display_, params);
     }
   }
 
@@ -102,13 +115,14 @@ void render_target::reinit_pass(const shared_buffer &_storage, const render_targ
       throw std::runtime_error("failed to find compatible depth buffer!");
 
     image_params params;
-    params.size_    = size;
-    params.format_  = depth_format;
-    params.tiling_  = VK_IMAGE_TILING_OPTIMAL;
-    params.usage_   = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-    params.aspect_  = VK_IMAGE_ASPECT_DEPTH_BIT;
-    params.samples_ = sample_count_;
-    depth_          = std::make_shared<image>(*display_, _storage, params);
+    params.size_     = size;
+    params.format_   = depth_format;
+    params.tiling_   = VK_IMAGE_TILING_OPTIMAL;
+    params.usage_    = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    params.aspect_   = VK_IMAGE_ASPECT_DEPTH_BIT;
+    params.samples_  = sample_count_;
+    params.category_ = MRENDER_TARGET;
+    depth_           = std::make_shared<image>(*display_, params);
   }
 
   VkSubpassDependency dependency = {};
@@ -123,12 +137,14 @@ void render_target::reinit_pass(const shared_buffer &_storage, const render_targ
   color_attachment.format                  = _init_params.format_;
   color_attachment.samples                 = sample_count_;
   color_attachment.loadOp                  = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  color_attachment.storeOp                 = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  color_attachment.storeOp                 = VK_ATTACHMENT_STORE_OP_STORE;
   color_attachment.stencilLoadOp           = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   color_attachment.stencilStoreOp          = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   color_attachment.initialLayout           = _init_params.initial_layout_;
   color_attachment.finalLayout
       = msaa_rendertarget_ ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : _init_params.final_layout_;
+  if (msaa_rendertarget_)
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;  // Only its resolve is kept
 
   std::vector<VkAttachmentDescription> pass_attachments{color_attachment};
 
@@ -151,7 +167,7 @@ void render_target::reinit_pass(const shared_buffer &_storage, const render_targ
     color_attachment_resolve.format         = _init_params.format_;
     color_attachment_resolve.samples        = VK_SAMPLE_COUNT_1_BIT;
     color_attachment_resolve.loadOp         = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    color_attachment_resolve.storeOp        = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    color_attachment_resolve.storeOp        = VK_ATTACHMENT_STORE_OP_STORE;
     color_attachment_resolve.stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     color_attachment_resolve.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     color_attachment_resolve.initialLayout  = _init_params.initial_layout_;
@@ -193,6 +209,18 @@ void render_target::reinit_pass(const shared_buffer &_storage, const render_targ
     HUT_PVK(vkDestroyRenderPass, device, renderpass_, nullptr);
   HUT_VVK(HUT_PVK(vkCreateRenderPass, device, &render_pass_info, nullptr, &renderpass_));
 
+  if (renderpass_partial_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroyRenderPass, device, renderpass_partial_, nullptr);
+  renderpass_partial_ = VK_NULL_HANDLE;
+  if (_init_params.partial_redraw_) {
+    // Compatible with renderpass_, but loads the target (the resolve one with MSAA), clear_area clears what is redrawn.
+    // The depth and the MSAA attachment aren't stored, they are still cleared by the pass.
+    auto &target         = pass_attachments[msaa_rendertarget_ ? pass_attachments.size() - 1 : 0];
+    target.loadOp        = VK_ATTACHMENT_LOAD_OP_LOAD;
+    target.initialLayout = _init_params.final_layout_;
+    HUT_VVK(HUT_PVK(vkCreateRenderPass, device, &render_pass_info, nullptr, &renderpass_partial_));
+  }
+
   for (auto &fbo : fbos_) {
     if (fbo != VK_NULL_HANDLE)
       HUT_PVK(vkDestroyFramebuffer, device, fbo, nullptr);
@@ -228,10 +256,61 @@ void render_target::reinit_pass(const shared_buffer &_storage, const render_targ
   }
 }
 
-void render_target::begin_rebuild_cb(VkFramebuffer _fbo, VkCommandBuffer _cb) {
+void render_target::destroy_pass(retired_pass &_retired) {
+  HUT_PROFILE_FUN(PRENDERTARGET)
+  for (auto &fbo : _retired.fbos_) {
+    if (fbo != VK_NULL_HANDLE)
+      HUT_PVK(vkDestroyFramebuffer, display_->device(), fbo, nullptr);
+  }
+  _retired.fbos_.clear();
+
+  if (_retired.renderpass_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroyRenderPass, display_->device(), _retired.renderpass_, nullptr);
+  if (_retired.renderpass_partial_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroyRenderPass, display_->device(), _retired.renderpass_partial_, nullptr);
+  _retired.renderpass_         = VK_NULL_HANDLE;
+  _retired.renderpass_partial_ = VK_NULL_HANDLE;
+
+  _retired.depth_.reset();
+  _retired.msaa_rendertarget_.reset();
+}
+
+void render_target::alloc_secondary_pool(secondary_pool &_secondaries, uint _count) {
+  HUT_PROFILE_FUN(PRENDERTARGET)
+  if (_secondaries.pool_ == VK_NULL_HANDLE) {
+    VkCommandPoolCreateInfo pool_info = {};
+    pool_info.sType                   = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.queueFamilyIndex        = display_->iqueueg_;
+    pool_info.flags                   = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    HUT_VVK(HUT_PVK(vkCreateCommandPool, display_->device_, &pool_info, nullptr, &_secondaries.pool_));
+  }
+
+  const uint first = _secondaries.cbs_.size();
+  if (_count <= first)
+    return;
+  _secondaries.cbs_.resize(_count);
+
+  VkCommandBufferAllocateInfo alloc_info = {};
+  alloc_info.sType                       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc_info.level                       = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+  alloc_info.commandBufferCount          = _count - first;
+  alloc_info.commandPool                 = _secondaries.pool_;
+  HUT_VVK(HUT_PVK(vkAllocateCommandBuffers, display_->device_, &alloc_info, _secondaries.cbs_.data() + first));
+}
+
+void render_target::destroy_secondary_pool(secondary_pool &_secondaries) {
+  // Frees the command buffers along with the pool
+  if (_secondaries.pool_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroyCommandPool, display_->device_, _secondaries.pool_, nullptr);
+  _secondaries = {};
+}
+
+void render_target::begin_rebuild_cb(VkFramebuffer _fbo, VkCommandBuffer _cb, VkSubpassContents _contents,
+                                     const VkRect2D *_area) {
   HUT_PROFILE_FUN(PRENDERTARGET)
   auto offset = render_target_params_.box_.origin();
   auto size   = render_target_params_.box_.size();
+  assert(_area == nullptr || renderpass_partial_ != VK_NULL_HANDLE);
 
   VkCommandBufferBeginInfo begin_info = {};
   begin_info.sType                    = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -239,10 +318,12 @@ void render_target::begin_rebuild_cb(VkFramebuffer _fbo, VkCommandBuffer _cb) {
 
   VkRenderPassBeginInfo render_pass_info = {};
   render_pass_info.sType                 = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  render_pass_info.renderPass            = renderpass_;
+  render_pass_info.renderPass            = _area != nullptr ? renderpass_partial_ : renderpass_;
   render_pass_info.framebuffer           = _fbo;
   render_pass_info.renderArea.offset     = {(int)offset.x, (int)offset.y};
   render_pass_info.renderArea.extent     = {(uint)size.x, (uint)size.y};
+  if (_area != nullptr)
+    render_pass_info.renderArea = *_area;
 
   std::vector<VkClearValue> clear_colors;
   clear_colors.emplace_back(VkClearValue{.color = render_target_params_.clear_color_});
@@ -254,13 +335,63 @@ void render_target::begin_rebuild_cb(VkFramebuffer _fbo, VkCommandBuffer _cb) {
   render_pass_info.clearValueCount = clear_colors.size();
   render_pass_info.pClearValues    = clear_colors.data();
 
-  HUT_PVK(vkCmdBeginRenderPass, _cb, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);  // FIXME
-  // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
-  // to enable secondary command buffers
+  HUT_PVK(vkCmdBeginRenderPass, _cb, &render_pass_info, _contents);
+
+  // Secondary command buffers don't inherit dynamic states, they set their own unless they inherit them from here
+  if (_contents == VK_SUBPASS_CONTENTS_INLINE || display_->inherited_viewport_scissor_)
+    set_viewport(_cb, _area);
+}
+
+void render_target::begin_secondary_cb(VkFramebuffer _fbo, VkCommandBuffer _cb, const VkRect2D *_area) {
+  HUT_PROFILE_FUN(PRENDERTARGET)
+  VkCommandBufferInheritanceInfo inheritance_info = {};
+  inheritance_info.sType                          = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritance_info.renderPass                     = renderpass_;
+  inheritance_info.subpass                        = 0;
+  inheritance_info.framebuffer                    = _fbo;
+
+  // The viewport and scissor of the primary are inherited, so that it can change the area without recording again
+  const VkViewport depth       = {0, 0, 0, 0, 0.0f, 1.0f};
+  auto             inherited   = VkCommandBufferInheritanceViewportScissorInfoNV{};
+  inherited.sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_VIEWPORT_SCISSOR_INFO_NV;
+  inherited.viewportScissor2D  = VK_TRUE;
+  inherited.viewportDepthCount = 1;
+  inherited.pViewportDepths    = &depth;
+  if (display_->inherited_viewport_scissor_)
+    inheritance_info.pNext = &inherited;
+
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType                    = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags                    = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  begin_info.pInheritanceInfo         = &inheritance_info;
+  HUT_PVK(vkBeginCommandBuffer, _cb, &begin_info);
+
+  if (!display_->inherited_viewport_scissor_)
+    set_viewport(_cb, _area);
+}
+
+void render_target::clear_area(VkCommandBuffer _cb, const VkRect2D &_area) {
+  VkClearAttachment clear = {};
+  clear.aspectMask        = VK_IMAGE_ASPECT_COLOR_BIT;
+  clear.colorAttachment   = 0;
+  clear.clearValue.color  = render_target_params_.clear_color_;
+
+  VkClearRect rect    = {};
+  rect.rect           = _area;
+  rect.baseArrayLayer = 0;
+  rect.layerCount     = 1;
+  HUT_PVK(vkCmdClearAttachments, _cb, 1, &clear, 1, &rect);
+}
+
+void render_target::set_viewport(VkCommandBuffer _cb, const VkRect2D *_scissor) {
+  auto offset = render_target_params_.box_.origin();
+  auto size   = render_target_params_.box_.size();
 
   VkRect2D scissor = {};
   scissor.offset   = {(int)offset.x, (int)offset.y};
   scissor.extent   = {(uint)size.x, (uint)size.y};
+  if (_scissor != nullptr)
+    scissor = *_scissor;
   HUT_PVK(vkCmdSetScissor, _cb, 0, 1, &scissor);
 
   VkViewport viewport = {};
@@ -279,4 +410,8 @@ void render_target::end_rebuild_cb(VkCommandBuffer _cb) {
   HUT_VVK(HUT_PVK(vkEndCommandBuffer, _cb));
 }
 
+void render_target::end_secondary_cb(VkCommandBuffer _cb) {
+  HUT_VVK(HUT_PVK(vkEndCommandBuffer, _cb));
+}
+
 }  // namespace hut
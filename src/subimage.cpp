@@ -39,6 +39,17 @@ void subimage::release() {
     atlas_->free(std::move(*this));
 }
 
+void subimage::touch() {
+  if (atlas_ != nullptr)
+    last_use_ = atlas_->frame();
+}
+
+void subimage::unpin() {
+  assert(pins_ > 0);
+  pins_--;
+  touch();
+}
+
 vec4 subimage::texcoords() const {
   vec4 result;
   vec2 atlas_size = atlas_->size();
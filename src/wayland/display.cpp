@@ -591,8 +591,9 @@ void display::data_device_handle_selection(void *_data, wl_data_device *_device,
   d->last_offer_from_clipboard_ = _offer;
 }
 
-display::display(const char *_app_name, u32 _app_version, const char *_name)
-    : keyboard_repeat_ctx_{*this}
+display::display(const char *_app_name, u32 _app_version, const char *_name, const display_params &_params)
+    : params_(_params)
+    , keyboard_repeat_ctx_{*this}
     , animate_cursor_ctx_{*this} {
   HUT_PROFILE_FUN(PWAYLAND)
   std::vector<const char *> extensions = {VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME};
@@ -654,7 +655,7 @@ display::display(const char *_app_name, u32 _app_version, const char *_name)
 
 display::~display() {
   HUT_PROFILE_FUN(PWAYLAND)
-  preflush_jobs_.clear();
+  staging_commands_.clear();
   postflush_garbage_.clear();
   posted_jobs_.clear();
 
@@ -746,6 +747,7 @@ int display::dispatch() {
     process_posts(display::clock::now());
     if (windows_.empty())
       loop_ = false;
+    bool redrawn = false;
     for (auto wpair : windows_) {
       window *w = wpair.second;
 
@@ -759,16 +761,22 @@ int display::dispatch() {
         w->scale_ = std::get<1>(*w->on_resize_.args_);
         cursor(w->current_cursor_type_, w->scale_);
         wl_surface_set_buffer_scale(w->wayland_surface_, int(w->scale_));
-        w->init_vulkan_surface();
+        w->surface_outdated_ = true;
+        w->invalidated_      = true;
         HUT_PROFILE_FLUSH_BEVENT(w, on_resize_);
       }
 
       if (w->invalidated_) {
         w->redraw(display::clock::now());
         w->invalidated_ = false;
+        redrawn         = true;
       }
     }
+    if (redrawn)
+      frames_++;
+    trim_buffers(display::clock::now());
 #ifdef HUT_ENABLE_PROFILING
+    profile_memory_usage();
     profiling::threads_data::next_frame();
 #endif  // HUT_ENABLE_PROFILING
   }
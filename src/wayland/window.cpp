@@ -109,9 +109,8 @@ void window::surface_leave(void *_data, struct wl_surface *_surface, struct wl_o
     w->trigger_scale();
 }
 
-window::window(display &_display, shared_buffer _storage, const window_params &_init_params)
+window::window(display &_display, const window_params &_init_params)
     : render_target(_display)
-    , storage_(std::move(_storage))
     , display_(_display)
     , params_(_init_params)
     , size_(_init_params.size_) {
@@ -206,11 +205,12 @@ void window::fullscreen(bool _set) {
   }
 }
 
-void window::invalidate(const uvec4 & /*unused*/, bool _redraw) {
+void window::invalidate(const uvec4 &_rect, bool _redraw) {
   if (_redraw) {
     for (auto &d : dirty_)
       d = 1u;
   }
+  damage(_rect);
   invalidated_ = true;
   display_.post_empty_event();
 }
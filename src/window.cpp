@@ -29,6 +29,7 @@
 
 #include <algorithm>
 #include <iostream>
+#include <utility>
 
 #include "hut/utils/chrono.hpp"
 #include "hut/utils/profiling.hpp"
@@ -85,11 +86,20 @@ void window::destroy_vulkan() {
 
   HUT_PVK(vkDeviceWaitIdle, display_.device());
 
-  if (sem_available_ != VK_NULL_HANDLE)
-    HUT_PVK(vkDestroySemaphore, display_.device(), sem_available_, nullptr);
+  for (auto &frame : frames_) {
+    HUT_PVK(vkDestroySemaphore, display_.device(), frame.available_, nullptr);
+    HUT_PVK(vkDestroyFence, display_.device(), frame.fence_, nullptr);
+  }
+  frames_.clear();
+
+  for (auto &sem : sems_rendered_)
+    HUT_PVK(vkDestroySemaphore, display_.device(), sem, nullptr);
+  sems_rendered_.clear();
+  images_in_flight_.clear();
 
-  if (sem_rendered_ != VK_NULL_HANDLE)
-    HUT_PVK(vkDestroySemaphore, display_.device(), sem_rendered_, nullptr);
+  for (auto &retired : retired_)
+    destroy_retired(retired);
+  retired_.clear();
 
   for (auto &view : swapchain_imageviews_) {
     if (view != VK_NULL_HANDLE)
@@ -107,6 +117,11 @@ void window::destroy_vulkan() {
   }
 }
 
+bool same_rect(const VkRect2D &_a, const VkRect2D &_b) {
+  return _a.offset.x == _b.offset.x && _a.offset.y == _b.offset.y && _a.extent.width == _b.extent.width
+      && _a.extent.height == _b.extent.height;
+}
+
 VkPresentModeKHR select_best_mode(const std::span<VkPresentModeKHR> &_modes, bool _vsync_only) {
   constexpr VkPresentModeKHR PREFERRED_TEARING_MODES[] = {
       VK_PRESENT_MODE_IMMEDIATE_KHR,
@@ -207,21 +222,24 @@ void window::init_vulkan_surface() {
   VkSwapchainKHR new_swapchain;
   HUT_VVK(HUT_PVK(vkCreateSwapchainKHR, display_.device(), &swapchain_infos, nullptr, &new_swapchain));
 
-  HUT_PVK(vkDeviceWaitIdle, display_.device());
-
-  swapchain_ = new_swapchain;
-  if (old_swapchain != VK_NULL_HANDLE)
-    HUT_PVK(vkDestroySwapchainKHR, display_.device(), old_swapchain, nullptr);
+  // Frames in flight may still use the old swapchain and everything built on it, no need to wait for them here
+  retired_objects retired;
+  retired.swapchain_     = old_swapchain;
+  retired.imageviews_    = std::move(swapchain_imageviews_);
+  retired.primary_cbs_   = std::move(primary_cbs_);
+  retired.sems_rendered_ = std::move(sems_rendered_);
+  retired.serial_        = frame_serial_;
+  swapchain_             = new_swapchain;
+  retired.secondaries_.emplace_back(std::exchange(draw_secondaries_, {}));
+  retired.secondaries_.emplace_back(std::exchange(clear_secondaries_, {}));
+  for (auto &[id, layer] : layers_)
+    retired.secondaries_.emplace_back(std::exchange(layer.secondaries_, {}));
 
   HUT_PVK(vkGetSwapchainImagesKHR, display_.device(), swapchain_, &images_count, nullptr);
   swapchain_images_.resize(images_count);
   HUT_PVK(vkGetSwapchainImagesKHR, display_.device(), swapchain_, &images_count, swapchain_images_.data());
 
-  for (auto &imageview : swapchain_imageviews_) {
-    if (imageview != VK_NULL_HANDLE)
-      HUT_PVK(vkDestroyImageView, display_.device(), imageview, nullptr);
-  }
-  swapchain_imageviews_.resize(images_count, VK_NULL_HANDLE);
+  swapchain_imageviews_.assign(images_count, VK_NULL_HANDLE);
   for (u32 i = 0; i < images_count; i++) {
     VkImageViewCreateInfo imagev_infos           = {};
     imagev_infos.sType                           = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -245,10 +263,14 @@ void window::init_vulkan_surface() {
     pass_params.flags_ |= render_target_params::FMULTISAMPLING;
   if (params_.flags_ & window_params::FDEPTH)
     pass_params.flags_ |= render_target_params::FDEPTH;
-  reinit_pass(storage_, pass_params, swapchain_imageviews_);
+  pass_params.partial_redraw_ = params_.flags_.query(window_params::FPARTIAL_REDRAW);
+  reinit_pass(pass_params, swapchain_imageviews_, &retired.pass_);
+  if (renderpass_partial_ != VK_NULL_HANDLE)
+    HUT_PVK(vkGetRenderAreaGranularity, display_.device_, renderpass_partial_, &render_granularity_);
 
-  if (!primary_cbs_.empty())
-    HUT_PVK(vkFreeCommandBuffers, display_.device_, display_.commandg_pool_, primary_cbs_.size(), primary_cbs_.data());
+  // New images have no content to keep yet
+  damage_.assign(images_count, uvec4{0, 0, swapchain_extents_.width, swapchain_extents_.height});
+  render_areas_.assign(images_count, VkRect2D{});
 
   primary_cbs_.resize(images_count);
   VkCommandBufferAllocateInfo alloc_info = {};
@@ -257,29 +279,204 @@ void window::init_vulkan_surface() {
   alloc_info.commandBufferCount          = images_count;
   alloc_info.commandPool                 = display_.commandg_pool_;
 
-  HUT_VVK(HUT_PVK(vkAllocateCommandBuffers, display_.device_, &alloc_info, primary_cbs_.data()));
-
-  if (sem_available_ != VK_NULL_HANDLE)
-    HUT_PVK(vkDestroySemaphore, display_.device_, sem_available_, nullptr);
-  if (sem_rendered_ != VK_NULL_HANDLE)
-    HUT_PVK(vkDestroySemaphore, display_.device_, sem_rendered_, nullptr);
+  {
+    std::lock_guard lk(display_.commandg_mutex_);
+    HUT_VVK(HUT_PVK(vkAllocateCommandBuffers, display_.device_, &alloc_info, primary_cbs_.data()));
+  }
+  primary_dirty_.assign(images_count, 1u);
+
+  alloc_secondary_pool(draw_secondaries_, images_count);
+  if (renderpass_partial_ != VK_NULL_HANDLE)
+    alloc_secondary_pool(clear_secondaries_, images_count);
+  for (auto &[id, layer] : layers_) {
+    alloc_secondary_pool(layer.secondaries_, images_count);
+    layer.dirty_.assign(images_count, 1u);
+  }
 
   VkSemaphoreCreateInfo semaphore_info = {};
   semaphore_info.sType                 = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-  HUT_VVK(HUT_PVK(vkCreateSemaphore, display_.device_, &semaphore_info, nullptr, &sem_available_));
-  HUT_VVK(HUT_PVK(vkCreateSemaphore, display_.device_, &semaphore_info, nullptr, &sem_rendered_));
+  sems_rendered_.resize(images_count);
+  for (auto &sem : sems_rendered_)
+    HUT_VVK(HUT_PVK(vkCreateSemaphore, display_.device_, &semaphore_info, nullptr, &sem));
+  images_in_flight_.assign(images_count, VK_NULL_HANDLE);
+
+  if (frames_.empty())
+    init_frames();
+
+  if (old_swapchain != VK_NULL_HANDLE)
+    retired_.emplace_back(std::move(retired));
+  else
+    destroy_retired(retired);
 
   invalidate(true);
   dirty_.resize(images_count, 1u);
 }
 
+void window::init_frames() {
+  VkSemaphoreCreateInfo semaphore_info = {};
+  semaphore_info.sType                 = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  VkFenceCreateInfo fence_info         = {};
+  fence_info.sType                     = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  fence_info.flags                     = VK_FENCE_CREATE_SIGNALED_BIT;
+
+  frames_.resize(std::max(1u, params_.frames_in_flight_));
+  for (auto &frame : frames_) {
+    HUT_VVK(HUT_PVK(vkCreateSemaphore, display_.device_, &semaphore_info, nullptr, &frame.available_));
+    HUT_VVK(HUT_PVK(vkCreateFence, display_.device_, &fence_info, nullptr, &frame.fence_));
+  }
+  frame_index_ = 0;
+}
+
+uint window::add_layer(layer_callback &&_record) {
+  auto &layer   = layers_[next_layer_];
+  layer.record_ = std::move(_record);
+  alloc_secondary_pool(layer.secondaries_, swapchain_images_.size());
+  layer.dirty_.assign(swapchain_images_.size(), 1u);
+
+  std::fill(primary_dirty_.begin(), primary_dirty_.end(), 1u);
+  invalidate(false);
+  return next_layer_++;
+}
+
+void window::invalidate_layer(uint _layer) {
+  invalidate_layer(_layer, uvec4{uvec2{0, 0}, size_});
+}
+
+void window::invalidate_layer(uint _layer, const uvec4 &_rect) {
+  auto it = layers_.find(_layer);
+  if (it == layers_.end())
+    return;
+
+  std::fill(it->second.dirty_.begin(), it->second.dirty_.end(), 1u);
+  invalidate(_rect, false);
+}
+
+void window::invalidate_layers() {
+  for (auto &[index, layer] : layers_)
+    std::fill(layer.dirty_.begin(), layer.dirty_.end(), 1u);
+  invalidate(true);
+}
+
+void window::damage(const uvec4 &_rect) {
+  const uvec4 rect = _rect * scale_;
+  for (auto &damage : damage_) {
+    if (damage.x >= damage.z || damage.y >= damage.w)
+      damage = rect;
+    else
+      damage = {std::min(damage.x, rect.x), std::min(damage.y, rect.y), std::max(damage.z, rect.z),
+                std::max(damage.w, rect.w)};
+  }
+}
+
+VkRect2D window::damaged_area(u32 _image_index) {
+  const VkRect2D full = {{0, 0}, swapchain_extents_};
+  if (renderpass_partial_ == VK_NULL_HANDLE)
+    return full;
+
+  // Nothing changed, render the same area again so that the command buffers stay valid
+  const uvec4 &damage = damage_[_image_index];
+  if (damage.x >= damage.z || damage.y >= damage.w)
+    return render_areas_[_image_index].extent.width != 0 ? render_areas_[_image_index] : full;
+
+  // Aligned on the render area granularity, that is faster
+  const u32 gx     = std::max(1u, render_granularity_.width);
+  const u32 gy     = std::max(1u, render_granularity_.height);
+  const u32 left   = damage.x / gx * gx;
+  const u32 top    = damage.y / gy * gy;
+  const u32 right  = std::min(swapchain_extents_.width, (damage.z + gx - 1) / gx * gx);
+  const u32 bottom = std::min(swapchain_extents_.height, (damage.w + gy - 1) / gy * gy);
+  if (left >= right || top >= bottom)
+    return full;
+  return {{i32(left), i32(top)}, {right - left, bottom - top}};
+}
+
+void window::remove_layer(uint _layer) {
+  auto it = layers_.find(_layer);
+  if (it == layers_.end())
+    return;
+
+  // Primaries still in flight may execute them
+  retired_objects retired;
+  retired.secondaries_.emplace_back(std::move(it->second.secondaries_));
+  retired.serial_ = frame_serial_;
+  retired_.emplace_back(std::move(retired));
+  layers_.erase(it);
+
+  std::fill(primary_dirty_.begin(), primary_dirty_.end(), 1u);
+  invalidate(false);
+}
+
+void window::retire(std::shared_ptr<void> _resource) {
+  retired_objects retired;
+  retired.retained_.emplace_back(std::move(_resource));
+  retired.serial_ = frame_serial_;
+  retired_.emplace_back(std::move(retired));
+}
+
+void window::destroy_retired(retired_objects &_retired) {
+  destroy_pass(_retired.pass_);
+
+  for (auto &view : _retired.imageviews_) {
+    if (view != VK_NULL_HANDLE)
+      HUT_PVK(vkDestroyImageView, display_.device_, view, nullptr);
+  }
+
+  if (!_retired.primary_cbs_.empty()) {
+    std::lock_guard lk(display_.commandg_mutex_);
+    HUT_PVK(vkFreeCommandBuffers, display_.device_, display_.commandg_pool_, _retired.primary_cbs_.size(),
+            _retired.primary_cbs_.data());
+  }
+  for (auto &secondaries : _retired.secondaries_)
+    destroy_secondary_pool(secondaries);
+
+  for (auto &sem : _retired.sems_rendered_)
+    HUT_PVK(vkDestroySemaphore, display_.device_, sem, nullptr);
+
+  if (_retired.swapchain_ != VK_NULL_HANDLE)
+    HUT_PVK(vkDestroySwapchainKHR, display_.device_, _retired.swapchain_, nullptr);
+  _retired.retained_.clear();
+}
+
+void window::collect_retired() {
+  // A slot that submitted a frame after retirement already waited for its older frames
+  auto frames_done = [this](const retired_objects &_retired) {
+    for (const auto &frame : frames_) {
+      if (frame.serial_ <= _retired.serial_ && HUT_PVK(vkGetFenceStatus, display_.device_, frame.fence_) != VK_SUCCESS)
+        return false;
+    }
+    return true;
+  };
+
+  for (auto it = retired_.begin(); it != retired_.end();) {
+    if (frames_done(*it)) {
+      destroy_retired(*it);
+      it = retired_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
 void window::redraw(display::time_point _tp) {
   HUT_PROFILE_FUN(PWINDOW)
   if (swapchain_ == VK_NULL_HANDLE)
     return;
 
+  collect_retired();
+
+  // Configure events received since the last frame are coalesced in a single recreation
+  if (surface_outdated_) {
+    surface_outdated_ = false;
+    if (swapchain_extents_.width != u32(size_.x * scale_) || swapchain_extents_.height != u32(size_.y * scale_))
+      init_vulkan_surface();
+  }
+
+  // Only blocks when the CPU got frames_in_flight() frames ahead of the GPU
+  auto &frame = frames_[frame_index_];
+  HUT_VVK(HUT_PVK(vkWaitForFences, display_.device_, 1, &frame.fence_, VK_TRUE, NUMAX<u64>));
+
   u32      image_index;
-  VkResult result = HUT_PVK(vkAcquireNextImageKHR, display_.device_, swapchain_, NUMAX<u64>, sem_available_,
+  VkResult result = HUT_PVK(vkAcquireNextImageKHR, display_.device_, swapchain_, NUMAX<u64>, frame.available_,
                             VK_NULL_HANDLE, &image_index);
 
   if (result == VK_ERROR_OUT_OF_DATE_KHR) {
@@ -291,23 +488,94 @@ void window::redraw(display::time_point _tp) {
     HUT_VVK(result);
   }
 
+  // A previous frame slot may still be rendering to this image, with the command buffer we are about to reuse
+  VkFence &image_fence = images_in_flight_[image_index];
+  if (image_fence != VK_NULL_HANDLE && image_fence != frame.fence_)
+    HUT_VVK(HUT_PVK(vkWaitForFences, display_.device_, 1, &image_fence, VK_TRUE, NUMAX<u64>));
+  image_fence = frame.fence_;
+
+  // Fired before the damage is collected, so that what it invalidates makes it into this frame
+  HUT_PROFILE_EVENT(this, on_frame_, _tp - last_frame_);
+
+  // The primary is recorded for a render area, and recorded again when the damage moves. Secondaries inherit its
+  // viewport and scissor with VK_NV_inherited_viewport_scissor, otherwise they have to be recorded again as well.
+  const VkRect2D area     = damaged_area(image_index);
+  const VkRect2D full     = {{0, 0}, swapchain_extents_};
+  const bool     partial  = !same_rect(area, full);
+  VkRect2D      &recorded = render_areas_[image_index];
+  damage_[image_index]    = uvec4{0, 0, 0, 0};
+  if (!same_rect(recorded, area)) {
+    recorded                    = area;
+    primary_dirty_[image_index] = 1u;
+    if (!display_.inherited_viewport_scissor_) {
+      dirty_[image_index] = 1u;
+      for (auto &[id, layer] : layers_)
+        layer.dirty_[image_index] = 1u;
+    }
+  }
+
+  // Only the secondaries that changed are recorded again, each from its own pool so that they can be recorded in
+  // parallel, on_draw_ staying on this thread. The primary just executes them all, in layer order.
+  std::vector<display::record_job> jobs;
   if (dirty_[image_index] != 0u) {
-    HUT_PVK(vkDeviceWaitIdle, display_.device_);
     dirty_[image_index] = 0u;
-    begin_rebuild_cb(fbos_[image_index], primary_cbs_[image_index]);
-    HUT_PROFILE_EVENT_NAMED_ALIASED(this, on_draw_, (), (), primary_cbs_[image_index]);
+    jobs.emplace_back([this, image_index, area, partial, cb = draw_secondaries_.cbs_[image_index]] {
+      begin_secondary_cb(fbos_[image_index], cb, partial ? &area : nullptr);
+      HUT_PROFILE_EVENT_NAMED_ALIASED(this, on_draw_, (), (), cb);
+      end_secondary_cb(cb);
+    });
+  }
+  for (auto &[id, layer] : layers_) {
+    if (layer.dirty_[image_index] == 0u)
+      continue;
+    layer.dirty_[image_index] = 0u;
+    jobs.emplace_back([this, image_index, area, partial, &record = layer.record_,
+                       cb = layer.secondaries_.cbs_[image_index]] {
+      begin_secondary_cb(fbos_[image_index], cb, partial ? &area : nullptr);
+      record(cb);
+      end_secondary_cb(cb);
+    });
+  }
+  if (!jobs.empty()) {
+    display_.record_parallel(jobs);
+    primary_dirty_[image_index] = 1u;
+  }
+
+  if (primary_dirty_[image_index] != 0u) {
+    primary_dirty_[image_index] = 0u;
+    std::vector<VkCommandBuffer> secondaries;
+
+    // The partial pass loads the image, only the area redrawn is cleared
+    if (partial) {
+      VkCommandBuffer clear_cb = clear_secondaries_.cbs_[image_index];
+      begin_secondary_cb(fbos_[image_index], clear_cb, &area);
+      clear_area(clear_cb, area);
+      end_secondary_cb(clear_cb);
+      secondaries.emplace_back(clear_cb);
+    }
+
+    secondaries.emplace_back(draw_secondaries_.cbs_[image_index]);
+    for (auto &[id, layer] : layers_)
+      secondaries.emplace_back(layer.secondaries_.cbs_[image_index]);
+
+    std::lock_guard lk(display_.commandg_mutex_);
+    begin_rebuild_cb(fbos_[image_index], primary_cbs_[image_index], VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS,
+                     partial ? &area : nullptr);
+    HUT_PVK(vkCmdExecuteCommands, primary_cbs_[image_index], secondaries.size(), secondaries.data());
     end_rebuild_cb(primary_cbs_[image_index]);
   }
 
-  HUT_PROFILE_EVENT(this, on_frame_, _tp - last_frame_);
   display_.flush_staged();
   cbs_.emplace_back(primary_cbs_[image_index]);
 
   VkSubmitInfo submit_info = {};
   submit_info.sType        = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-  VkSemaphore          wait_semaphores[] = {sem_available_};
-  VkPipelineStageFlags wait_stages[]     = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+  // The frame only waits for the staged data it reads, the render pass may start before
+  VkSemaphore          wait_semaphores[] = {frame.available_, display_.transfer_timeline_};
+  VkPipelineStageFlags wait_stages[]     = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                            display::STAGING_CONSUMER_STAGES};
+  u64                  wait_values[]     = {0, display_.staging_handoff()};
   submit_info.waitSemaphoreCount         = 1;
   submit_info.pWaitSemaphores            = wait_semaphores;
   submit_info.pWaitDstStageMask          = wait_stages;
@@ -315,11 +583,30 @@ void window::redraw(display::time_point _tp) {
   submit_info.commandBufferCount = (u32)cbs_.size();
   submit_info.pCommandBuffers    = cbs_.data();
 
-  VkSemaphore signal_semaphores[]  = {sem_rendered_};
+  // Staging batches and display::wait_graphics wait on its value of the graphics timeline
+  VkSemaphore signal_semaphores[]  = {sems_rendered_[image_index], display_.graphics_timeline_};
+  u64         signal_values[]      = {0, 0};
   submit_info.signalSemaphoreCount = 1;
   submit_info.pSignalSemaphores    = signal_semaphores;
 
-  HUT_VVK(HUT_PVK(vkQueueSubmit, display_.queueg_, 1, &submit_info, VK_NULL_HANDLE));
+  VkTimelineSemaphoreSubmitInfo timeline_info = {};
+  if (display_.graphics_timeline_ != VK_NULL_HANDLE) {
+    timeline_info.sType                     = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.waitSemaphoreValueCount   = display_.staging_transfer_ ? 2 : 1;
+    timeline_info.pWaitSemaphoreValues      = wait_values;
+    timeline_info.signalSemaphoreValueCount = 2;
+    timeline_info.pSignalSemaphoreValues    = signal_values;
+    submit_info.pNext                       = &timeline_info;
+    submit_info.waitSemaphoreCount          = display_.staging_transfer_ ? 2 : 1;
+    submit_info.signalSemaphoreCount        = 2;
+  }
+
+  HUT_VVK(HUT_PVK(vkResetFences, display_.device_, 1, &frame.fence_));
+  std::unique_lock queues_lk(display_.queues_mutex_);
+  signal_values[1] = display_.next_graphics_value();
+  HUT_VVK(HUT_PVK(vkQueueSubmit, display_.queueg_, 1, &submit_info, frame.fence_));
+  frame.serial_ = ++frame_serial_;
+  frame_index_  = (frame_index_ + 1) % frames_.size();
 
   VkPresentInfoKHR present_info = {};
   present_info.sType            = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -333,7 +620,18 @@ void window::redraw(display::time_point _tp) {
   present_info.pImageIndices   = &image_index;
   present_info.pResults        = nullptr;  // Optional
 
+  // The compositor only has to update the damaged area, the WSI forwards it with wl_surface_damage_buffer
+  VkRectLayerKHR      present_rect    = {area.offset, area.extent, 0};
+  VkPresentRegionKHR  present_region  = {1, &present_rect};
+  VkPresentRegionsKHR present_regions = {};
+  present_regions.sType               = VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR;
+  present_regions.swapchainCount      = 1;
+  present_regions.pRegions            = &present_region;
+  if (partial && display_.incremental_present_)
+    present_info.pNext = &present_regions;
+
   result = HUT_PVK(vkQueuePresentKHR, display_.queuep_, &present_info);
+  queues_lk.unlock();
   if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
     init_vulkan_surface();
   } else {
@@ -0,0 +1,255 @@
+/*  _ _ _   _       _
+ * | |_| |_| |_ _ _| |_
+ * | | | . |   | | |  _|
+ * |_|_|___|_|_|___|_|
+ * Hobby graphics and GUI library under the MIT License (MIT)
+ *
+ * Copyright (c) 2014 Jean-Baptiste Lepesme github.com/jiboo/libhut
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "hut/utils/binpacks.hpp"
+
+using namespace hut;
+
+using rect = vec<2, u16>;
+
+// Traces are generated once with fixed seeds, so that every packer replays exactly the same operations
+struct op {
+  bool alloc_;
+  uint slot_;
+  rect size_;  // Only x is used by 1d packers
+};
+
+struct trace {
+  std::vector<op> ops_;
+  uint            slots_ = 0;
+
+  void alloc(rect _size) { ops_.emplace_back(op{true, slots_++, _size}); }
+  void free(uint _slot) { ops_.emplace_back(op{false, _slot, {}}); }
+};
+
+// Uniform sizes, frees at random while a target count of allocations is live
+trace make_random_trace(uint _ops, uint _live, u16 _min, u16 _max, u32 _seed, bool _rects = false) {
+  std::mt19937                       rng(_seed);
+  std::uniform_int_distribution<u16> size(_min, _max);
+  trace                              result;
+  std::vector<uint>                  live;
+  for (uint i = 0; i < _ops; i++) {
+    if (live.size() < _live || rng() % 2 == 0) {
+      live.emplace_back(result.slots_);
+      const u16 width = size(rng);
+      result.alloc({width, _rects ? size(rng) : u16(1)});
+    } else {
+      const uint index = rng() % live.size();
+      result.free(live[index]);
+      live[index] = live.back();
+      live.pop_back();
+    }
+  }
+  return result;
+}
+
+// Batches of widgets instances, mostly the latest widgets are destroyed and recreated
+trace make_ui_churn_trace(uint _ops, u32 _seed) {
+  constexpr u16     SIZES[] = {1, 1, 2, 4, 4, 8, 16, 64};
+  std::mt19937      rng(_seed);
+  trace             result;
+  std::vector<uint> live;
+  for (uint i = 0; i < _ops; i++) {
+    if (live.size() < 256 || rng() % 2 == 0) {
+      live.emplace_back(result.slots_);
+      result.alloc({SIZES[rng() % std::size(SIZES)], 1});
+    } else {
+      const uint index = rng() % 4 != 0 ? uint(live.size() - 1) : uint(rng() % live.size());
+      result.free(live[index]);
+      live.erase(live.begin() + index);
+    }
+  }
+  return result;
+}
+
+// Streamed uploads, allocations are released in the order they were made
+trace make_fifo_trace(uint _ops, uint _in_flight, u16 _min, u16 _max, u32 _seed) {
+  std::mt19937                       rng(_seed);
+  std::uniform_int_distribution<u16> size(_min, _max);
+  trace                              result;
+  uint                               oldest = 0;
+  for (uint i = 0; i < _ops; i++) {
+    if (result.slots_ - oldest >= _in_flight)
+      result.free(oldest++);
+    result.alloc({size(rng), 1});
+  }
+  return result;
+}
+
+// Glyph like rects, a text's worth of glyphs is cached, then the least recent third is evicted
+trace make_glyphs_trace(uint _ops, u32 _seed) {
+  std::mt19937                       rng(_seed);
+  std::uniform_int_distribution<u16> width(4, 32);
+  std::uniform_int_distribution<u16> height(12, 40);
+  trace                              result;
+  uint                               oldest = 0;
+  while (result.ops_.size() < _ops) {
+    for (uint i = 0; i < 512; i++)
+      result.alloc({width(rng), height(rng)});
+    const uint evicted = (result.slots_ - oldest) / 3;
+    for (uint i = 0; i < evicted; i++)
+      result.free(oldest++);
+  }
+  return result;
+}
+
+template<typename TPacker>
+void report_1d(benchmark::State &_state, const TPacker &_packer, uint _failed) {
+  // Fragmentation is the part of the free space that can't be used by a single allocation
+  uint free_bytes = 0, largest_free = 0, blocks = 0;
+  _packer.visit_blocks([&](const auto &_block) {
+    blocks++;
+    if (!_block.used_) {
+      free_bytes += _block.size_;
+      largest_free = std::max<uint>(largest_free, _block.size_);
+    }
+    return true;
+  });
+  _state.counters["fragmentation"] = free_bytes == 0 ? 0. : 1. - double(largest_free) / free_bytes;
+  _state.counters["failed"]        = _failed;
+  _state.counters["blocks"]        = blocks;
+  _state.counters["metadata"]      = double(_packer.metadata_byte_size());
+}
+
+template<typename TPacker>
+void report_2d(benchmark::State &_state, const TPacker &_packer, uint _failed, double _occupancy) {
+  // Used area when the first pack failed, or the peak if none did
+  _state.counters["occupancy"] = _occupancy;
+  _state.counters["failed"]    = _failed;
+  _state.counters["metadata"]  = double(_packer.metadata_byte_size());
+}
+
+template<typename TPacker>
+void bench_1d(benchmark::State &_state, const trace &_trace, uint _pool) {
+  std::vector<std::optional<uint>> slots(_trace.slots_);
+  uint                             failed = 0;
+  for (auto _ : _state) {
+    TPacker packer(_pool);
+    slots.assign(_trace.slots_, std::nullopt);
+    failed = 0;
+    for (const auto &op : _trace.ops_) {
+      auto &slot = slots[op.slot_];
+      if (op.alloc_) {
+        slot = packer.pack(op.size_.x);
+        failed += !slot;
+      } else if (slot) {
+        packer.offer(*slot);
+      }
+    }
+    benchmark::DoNotOptimize(packer.allocated());
+    _state.PauseTiming();
+    report_1d(_state, packer, failed);
+    _state.ResumeTiming();
+  }
+  _state.SetItemsProcessed(int64_t(_state.iterations() * _trace.ops_.size()));
+}
+
+template<typename TPacker>
+void bench_2d(benchmark::State &_state, const trace &_trace, rect _pool) {
+  using vec_t = typename TPacker::type;
+  std::vector<std::optional<vec_t>> slots(_trace.slots_);
+  for (auto _ : _state) {
+    TPacker packer(vec_t{_pool});
+    slots.assign(_trace.slots_, std::nullopt);
+    uint   failed = 0;
+    double used = 0, occupancy = 0;
+    for (const auto &op : _trace.ops_) {
+      auto &slot = slots[op.slot_];
+      if (op.alloc_) {
+        slot = packer.pack(vec_t{op.size_});
+        if (slot) {
+          used += double(op.size_.x) * op.size_.y;
+          if (failed == 0)
+            occupancy = std::max(occupancy, used);
+        } else {
+          failed++;
+        }
+      } else if (slot) {
+        packer.offer(*slot);
+        used -= double(op.size_.x) * op.size_.y;
+      }
+    }
+    _state.PauseTiming();
+    report_2d(_state, packer, failed, occupancy / (double(_pool.x) * _pool.y));
+    _state.ResumeTiming();
+  }
+  _state.SetItemsProcessed(int64_t(_state.iterations() * _trace.ops_.size()));
+}
+
+int main(int _argc, char **_argv) {
+  // Frees only carry the slot, copy sizes back so that 2d replays know what area is released
+  const auto with_sizes = [](trace _trace) {
+    std::vector<rect> sizes(_trace.slots_);
+    for (auto &op : _trace.ops_) {
+      if (op.alloc_)
+        sizes[op.slot_] = op.size_;
+      else
+        op.size_ = sizes[op.slot_];
+    }
+    return _trace;
+  };
+
+  const std::pair<std::string, trace> traces_1d[] = {
+      {"random", make_random_trace(200'000, 10'000, 16, 4096, 1)},
+      {"ui_churn", make_ui_churn_trace(200'000, 2)},
+      {"fifo", make_fifo_trace(200'000, 1'000, 256, 32 * 1024, 3)},
+  };
+  constexpr uint POOL_1D = 32 * 1024 * 1024;
+  for (const auto &[name, trace] : traces_1d) {
+    benchmark::RegisterBenchmark(("linear1d/" + name).c_str(), bench_1d<binpack::linear1d<uint>>, trace, POOL_1D);
+    benchmark::RegisterBenchmark(("tlsf1d/" + name).c_str(), bench_1d<binpack::tlsf1d<uint>>, trace, POOL_1D);
+  }
+
+  const std::pair<std::string, trace> traces_2d[] = {
+      {"glyphs", with_sizes(make_glyphs_trace(100'000, 4))},
+      {"random", with_sizes(make_random_trace(100'000, 500, 4, 64, 5, true))},
+  };
+  const rect pool_2d = {1024, 1024};
+  for (const auto &[name, trace] : traces_2d) {
+    benchmark::RegisterBenchmark(("shelve<align<16>>/" + name).c_str(),
+                                 bench_2d<binpack::shelve<u16, binpack::shelve_separator_align<u16, 16>>>, trace,
+                                 pool_2d);
+    benchmark::RegisterBenchmark(("shelve<pow<16>>/" + name).c_str(),
+                                 bench_2d<binpack::shelve<u16, binpack::shelve_separator_pow<u16, 16>>>, trace,
+                                 pool_2d);
+    benchmark::RegisterBenchmark(("skyline/" + name).c_str(), bench_2d<binpack::skyline<u16>>, trace, pool_2d);
+    benchmark::RegisterBenchmark(("maxrects/" + name).c_str(), bench_2d<binpack::maxrects<u16>>, trace, pool_2d);
+  }
+
+  benchmark::Initialize(&_argc, _argv);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
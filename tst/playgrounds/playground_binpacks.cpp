@@ -64,9 +64,9 @@ void debug(const binpack::shelve<TSizeType, TShelveSelector> &_packer) {
   ImDrawList *draw_list = ImGui::GetWindowDrawList();
   ImVec2      p         = ImGui::GetCursorScreenPos();
 
-  for (auto &row : _packer.rows_) {
-    draw_list->AddText(ImVec2(p.x, p.y + row.second.y_), IM_COL32(255, 255, 255, 127),
-                       std::to_string(row.first).c_str());
+  for (auto &[y, index] : _packer.rows_by_y_) {
+    draw_list->AddText(ImVec2(p.x, p.y + y), IM_COL32(255, 255, 255, 127),
+                       std::to_string(_packer.rows_[index].height_).c_str());
   }
 }
 
@@ -198,7 +198,7 @@ int main(int /*unused*/, char ** /*unused*/) {
   display       dsp("hut binpack playground");
   shared_buffer buf = std::make_shared<buffer>(dsp);
 
-  window win(dsp, buf);
+  window win(dsp);
   win.clear_color({0, 0, 0, 1});
   win.title(u8"hut binpack playground");
 
@@ -44,7 +44,7 @@ int main(int /*unused*/, char ** /*unused*/) {
   display       dsp("hut clipboard playground");
   shared_buffer buf = std::make_shared<buffer>(dsp);
 
-  window win(dsp, buf);
+  window win(dsp);
   win.title(u8"hut clipboard playground");
   win.clear_color({0, 0, 0, 1});
 
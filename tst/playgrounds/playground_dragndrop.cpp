@@ -117,7 +117,7 @@ struct my_drop_target_interface : drop_target_interface {
 int main(int /*unused*/, char ** /*unused*/) {
   display       dsp("hut dragndrop playground");
   shared_buffer buf = std::make_shared<buffer>(dsp);
-  window        win(dsp, buf);
+  window        win(dsp);
   win.title(u8"hut dragndrop playground");
   win.clear_color({0, 0, 0, 1});
 
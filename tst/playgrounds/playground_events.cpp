@@ -41,7 +41,7 @@ using namespace hut;
 int main(int /*unused*/, char ** /*unused*/) {
   display       dsp("hut events playground");
   shared_buffer buf = std::make_shared<buffer>(dsp);
-  window        win(dsp, buf);
+  window        win(dsp);
   win.title(u8"hut events playground");
   win.clear_color({0, 0, 0, 1});
 
@@ -43,12 +43,13 @@ int main(int /*unused*/, char ** /*unused*/) {
   display       dsp("hut render2d playground");
   shared_buffer buf = std::make_shared<buffer>(dsp);
 
-  window win(dsp, buf, window_params{.flags_{window_params::FTRANSPARENT, window_params::FVSYNC}});
+  window win(dsp, window_params{.flags_{window_params::FTRANSPARENT, window_params::FVSYNC}});
   win.title(u8"hut render2d playground");
   win.clear_color({0, 0, 0, 1});
 
-  auto texatlas = std::make_shared<atlas>(
-      dsp, buf, image_params{.size_ = dsp.max_tex_size(), .format_ = VK_FORMAT_R8G8B8A8_UNORM});
+  auto texatlas = std::make_shared<atlas>(dsp,
+                                          image_params{.size_ = dsp.max_tex_size(), .format_ = VK_FORMAT_R8G8B8A8_UNORM},
+                                          binpack::PSHELVE2D, true);
   auto samp = std::make_shared<sampler>(dsp);
   auto tex  = imgdec::load_png(texatlas, tst_png::tex1_png);
   auto ubo  = buf->allocate<common_ubo>(1, dsp.ubo_align());
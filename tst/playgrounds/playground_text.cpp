@@ -53,14 +53,14 @@ int main(int /*unused*/, char ** /*unused*/) {
   display       dsp("hut text playground");
   shared_buffer buf = std::make_shared<buffer>(dsp);
 
-  window win(dsp, buf);
+  window win(dsp);
   win.clear_color({0, 0, 0, 1});
   win.title(u8"hut text playground");
 
   auto ubo = buf->allocate<common_ubo>(1, dsp.ubo_align());
   ubo->set(common_ubo{win.size()});
-  auto fontatlas
-      = std::make_shared<atlas>(dsp, buf, image_params{.size_ = dsp.max_tex_size(), .format_ = VK_FORMAT_R8_UNORM});
+  auto fontatlas = std::make_shared<atlas>(
+      dsp, image_params{.size_ = dsp.max_tex_size(), .format_ = VK_FORMAT_R8_UNORM}, binpack::PSHELVE2D, true);
   auto           samp      = std::make_shared<sampler>(dsp);
   constexpr auto FONT_SIZE = 16_px;
   auto           font      = std::make_shared<text::font>(tst_woff2::Roboto_Regular_woff2, FONT_SIZE);
@@ -40,7 +40,7 @@ int main(int /*unused*/, char ** /*unused*/) {
   display       dsp("hut ui playground");
   shared_buffer buf = std::make_shared<buffer>(dsp);
 
-  window win(dsp, buf, window_params{.flags_{window_params::FTRANSPARENT, window_params::FVSYNC}});
+  window win(dsp, window_params{.flags_{window_params::FTRANSPARENT, window_params::FVSYNC}});
   win.title(u8"hut ui playground");
   win.clear_color({0, 0, 0, 0});
 
@@ -47,7 +47,7 @@ int main(int /*unused*/, char ** /*unused*/) {
   params.flags_.set(window_params::FMULTISAMPLING);
   params.flags_.set(window_params::FTRANSPARENT);
 
-  window w(dsp, buf, params);
+  window w(dsp, params);
   w.clear_color({0.1f, 0.1f, 0.1f, 0.0f});
   w.title(u8"hut demo3d win");
 
@@ -90,7 +90,7 @@ int main(int /*unused*/, char ** /*unused*/) {
   skybox_params.layers_            = 6;
   skybox_params.size_              = {4, 4};
   skybox_params.format_            = VK_FORMAT_R8G8B8A8_UNORM;
-  auto                skybox_image = std::make_shared<image>(dsp, buf, skybox_params);
+  auto                skybox_image = std::make_shared<image>(dsp, skybox_params);
   u8vec4_rgba         pixels[16];
   std::span<const u8> pixels_ref{&pixels[0][0], 16 * sizeof(u8vec4_rgba)};
   std::fill(std::begin(pixels), std::end(pixels), u8vec4_rgba{0xFF, 0x00, 0x00, 0x80});
@@ -42,7 +42,7 @@ int main(int /*unused*/, char ** /*unused*/) {
   display       dsp("hut demo");
   shared_buffer buf = std::make_shared<buffer>(dsp);
 
-  window win(dsp, buf);
+  window win(dsp);
   win.clear_color({0, 0, 0, 1});
   win.title(u8"hut imgui demo");
 
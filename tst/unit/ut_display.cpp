@@ -27,6 +27,7 @@
 
 #include <gtest/gtest.h>
 
+#include "hut/buffer.hpp"
 #include "hut/display.hpp"
 #include "hut/window.hpp"
 
@@ -36,3 +37,24 @@ TEST(display, fastkill) {
   { display d("hut fastkill test"); }
   { display d("hut fastkill tests"); }
 }
+
+TEST(display, staging_stats) {
+  display d("staging_stats");
+  auto    b = std::make_shared<buffer>(d);
+
+  auto data = b->allocate<u32>(4);
+  data->set({1, 2, 3, 4});
+  d.flush_staged();
+
+  const auto last = d.last_staging_stats();
+  EXPECT_EQ(last.flushes_, 1u);
+  EXPECT_GE(last.submissions_, 1u);
+  EXPECT_GE(last.copies_, 1u);
+  EXPECT_GE(last.bytes_, 4 * sizeof(u32));
+
+  // Nothing staged, nothing recorded
+  const auto before = d.total_staging_stats();
+  d.flush_staged();
+  EXPECT_EQ(d.total_staging_stats().flushes_, before.flushes_);
+  EXPECT_GE(before.bytes_, last.bytes_);
+}
@@ -2,6 +2,7 @@
 
 #include "hut/utils/color.hpp"
 
+#include "hut/atlas.hpp"
 #include "hut/offscreen.hpp"
 #include "hut/pipeline.hpp"
 
@@ -42,40 +43,93 @@ TEST(offscreen, buffer_noop) {
   auto    b = std::make_shared<buffer>(d);
 }
 
+TEST(offscreen, buffer_trim) {
+  display       d("buffer_trim");
+  buffer_params params;
+  params.initial_byte_size_ = 1024;
+  auto b                    = std::make_shared<buffer>(d, params);
+  {
+    auto spike = b->allocate_raw(4096);
+    EXPECT_EQ(b->reserved_bytes(), 1024u + 4096u);
+    EXPECT_EQ(b->trim(), 0u);
+  }
+  EXPECT_EQ(b->trim(std::chrono::hours(1)), 0u);
+  EXPECT_EQ(b->trim(), 4096u);
+  EXPECT_EQ(b->reserved_bytes(), 1024u);
+}
+
 TEST(offscreen, image_noop) {
   display d("image_noop");
-  auto    b = std::make_shared<buffer>(d);
 
   image_params params;
   params.size_   = {4, 4};
   params.format_ = VK_FORMAT_R8G8B8A8_UNORM;
-  auto img       = std::make_shared<image>(d, b, params);
+  auto img       = std::make_shared<image>(d, params);
+}
+
+TEST(offscreen, image_memory) {
+  display d("image_memory");
+
+  const auto base_count = d.memory().allocation_count();
+  const auto base_bytes = d.memory().allocated_bytes();
+
+  image_params params;
+  params.size_   = {4, 4};
+  params.format_ = VK_FORMAT_R8G8B8A8_UNORM;
+  std::vector<shared_image> images;
+  for (int i = 0; i < 4; i++)
+    images.emplace_back(std::make_shared<image>(d, params));
+  EXPECT_EQ(d.memory().allocation_count(), base_count + 1);
+
+  params.tiling_ = VK_IMAGE_TILING_OPTIMAL;
+  images.emplace_back(std::make_shared<image>(d, params));
+  EXPECT_EQ(d.memory().allocation_count(), base_count + 2);
+
+  images.clear();
+  EXPECT_EQ(d.memory().allocated_bytes(), base_bytes);
+  EXPECT_EQ(d.memory().allocation_count(), base_count + 2);
+}
+
+TEST(offscreen, memory_usage) {
+  display    d("memory_usage");
+  const auto before = d.memory_usage();
+  EXPECT_GT(before.categories_[MSTAGING], 0u);
+  EXPECT_FALSE(before.heaps_.empty());
+
+  auto         b = std::make_shared<buffer>(d);
+  image_params params;
+  params.size_   = {4, 4};
+  params.format_ = VK_FORMAT_R8G8B8A8_UNORM;
+  auto img       = std::make_shared<image>(d, params);
+
+  const auto after = d.memory_usage();
+  EXPECT_GT(after.categories_[MBUFFER], before.categories_[MBUFFER]);
+  EXPECT_GT(after.categories_[MIMAGE], before.categories_[MIMAGE]);
+  EXPECT_EQ(after.categories_[MATLAS], 0u);
 }
 
 TEST(offscreen, offscreen_noop) {
   display d("offscreen_noop");
-  auto    b = std::make_shared<buffer>(d);
 
   image_params params;
   params.size_   = {4, 4};
   params.format_ = VK_FORMAT_R8G8B8A8_UNORM;
   params.usage_ |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-  auto img = std::make_shared<image>(d, b, params);
+  auto img = std::make_shared<image>(d, params);
 
-  auto ofs = std::make_shared<offscreen>(img, b);
+  auto ofs = std::make_shared<offscreen>(img);
 }
 
 TEST(offscreen, offscreen_download) {
   display d("offscreen_download");
-  auto    b = std::make_shared<buffer>(d);
 
   image_params iparams;
   iparams.size_   = {4, 4};
   iparams.format_ = VK_FORMAT_R8G8B8A8_UNORM;
   iparams.usage_ |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-  auto img = std::make_shared<image>(d, b, iparams);
+  auto img = std::make_shared<image>(d, iparams);
 
-  auto ofs = offscreen(img, b);
+  auto ofs = offscreen(img);
 
   d.flush_staged();  // staging has to be explicitly flushed in offscreen mode
 
@@ -114,8 +168,8 @@ TEST(offscreen, offscreen_basic) {
   iparams.size_   = {4, 4};
   iparams.format_ = VK_FORMAT_R8G8B8A8_UNORM;
   iparams.usage_ |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-  auto img = std::make_shared<image>(d, b, iparams);
-  auto ofs = offscreen(img, b);
+  auto img = std::make_shared<image>(d, iparams);
+  auto ofs = offscreen(img);
 
   auto rgb_pipeline = std::make_shared<pipeline_rgb>(ofs);
   auto indices      = b->allocate<u16>(6);
@@ -155,15 +209,69 @@ TEST(offscreen, offscreen_basic) {
   EXPECT_TRUE(std::equal(std::begin(pixel_ref), std::end(pixel_ref), std::begin(pixel_data)));
 }
 
+TEST(offscreen, offscreen_parallel_draw) {
+  display d("offscreen_parallel_draw");
+  auto    b = std::make_shared<buffer>(d);
+
+  image_params iparams;
+  iparams.size_   = {4, 4};
+  iparams.format_ = VK_FORMAT_R8G8B8A8_UNORM;
+  iparams.usage_ |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  auto img = std::make_shared<image>(d, iparams);
+  auto ofs = offscreen(img);
+
+  auto rgb_pipeline = std::make_shared<pipeline_rgb>(ofs);
+  auto indices      = b->allocate<u16>(6);
+  indices->set({0, 1, 2, 2, 1, 3});
+  auto vertices = b->allocate<pipeline_rgb::vertex>(4);
+  vertices->set({
+      pipeline_rgb::vertex{{0, 0}, {1, 1, 1}},
+      pipeline_rgb::vertex{{0, 2}, {1, 1, 1}},
+      pipeline_rgb::vertex{{2, 0}, {1, 1, 1}},
+      pipeline_rgb::vertex{{2, 2}, {1, 1, 1}},
+  });
+  auto top_left = b->allocate<pipeline_rgb::instance>(1);
+  top_left->set({pipeline_rgb::instance{make_transform_mat4({0, 0}, {1, 1, 1})}});
+  auto bottom_right = b->allocate<pipeline_rgb::instance>(1);
+  bottom_right->set({pipeline_rgb::instance{make_transform_mat4({2, 2}, {1, 1, 1})}});
+
+  auto ubo = b->allocate<proj_ubo>(1, d.ubo_align());
+  ubo->set(proj_ubo{iparams.size_});
+  rgb_pipeline->write(0, ubo);
+
+  d.flush_staged();  // staging has to be explicitly flushed in offscreen mode
+
+  // Each quad is recorded in its own secondary command buffer, possibly on another thread
+  const offscreen::draw_callback callbacks[] = {
+      [&](VkCommandBuffer _cb) { rgb_pipeline->draw(_cb, 0, indices, top_left, vertices); },
+      [&](VkCommandBuffer _cb) { rgb_pipeline->draw(_cb, 0, indices, bottom_right, vertices); },
+  };
+  ofs.draw(callbacks);
+
+  u8vec4_rgba pixel_data[4 * 4];
+  ofs.download(std::span<u8>(&pixel_data[0].x, sizeof(pixel_data)), 4 * sizeof(u8vec4_rgba));
+
+  u8vec4_rgba pixel_ref[4 * 4] = {
+      // clang-format off
+      W, W, C, C,
+      W, W, C, C,
+      C, C, W, W,
+      C, C, W, W,
+      // clang-format on
+  };
+
+  dump(pixel_data, {0, 0, 4, 4});
+  EXPECT_TRUE(std::equal(std::begin(pixel_ref), std::end(pixel_ref), std::begin(pixel_data)));
+}
+
 TEST(offscreen, offscreen_download_offset) {
   display d("offscreen_download_offset");
-  auto    b = std::make_shared<buffer>(d);
 
   image_params iparams;
   iparams.size_   = {4, 4};
   iparams.format_ = VK_FORMAT_R8G8B8A8_UNORM;
   iparams.usage_ |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-  auto img = std::make_shared<image>(d, b, iparams);
+  auto img = std::make_shared<image>(d, iparams);
 
   {
     // Set pixel at [2,2]
@@ -172,7 +280,7 @@ TEST(offscreen, offscreen_download_offset) {
     memcpy(ptr + (2 * updator.staging_row_pitch() + 2 * 4), &W, 4);
   }
 
-  auto ofs = offscreen(img, b);
+  auto ofs = offscreen(img);
 
   d.flush_staged();  // staging has to be explicitly flushed in offscreen mode
 
@@ -210,11 +318,11 @@ TEST(offscreen, offscreen_render_offset) {
   iparams.size_   = {4, 4};
   iparams.format_ = VK_FORMAT_R8G8B8A8_UNORM;
   iparams.usage_ |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-  auto img = std::make_shared<image>(d, b, iparams);
+  auto img = std::make_shared<image>(d, iparams);
 
   offscreen_params oparams;
   oparams.subres_.coords_ = u16bbox_px::with_origin_size({1, 1}, {2, 2});
-  auto ofs                = offscreen(img, b, oparams);
+  auto ofs                = offscreen(img, oparams);
 
   auto rgb_pipeline = std::make_shared<pipeline_rgb>(ofs);
   auto indices      = b->allocate<u16>(6);
@@ -263,3 +371,126 @@ TEST(offscreen, offscreen_render_offset) {
   dump(pixel_data, {0, 0, 4, 4});
   EXPECT_TRUE(std::equal(std::begin(pixel_ref), std::end(pixel_ref), std::begin(pixel_data)));
 }
+
+TEST(offscreen, offscreen_download_async) {
+  display d("offscreen_download_async");
+  auto    b = std::make_shared<buffer>(d);
+
+  image_params iparams;
+  iparams.size_   = {4, 4};
+  iparams.format_ = VK_FORMAT_R8G8B8A8_UNORM;
+  iparams.usage_ |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  auto img = std::make_shared<image>(d, iparams);
+  auto ofs = offscreen(img);
+
+  auto rgb_pipeline = std::make_shared<pipeline_rgb>(ofs);
+  auto indices      = b->allocate<u16>(6);
+  indices->set({0, 1, 2, 2, 1, 3});
+  auto vertices = b->allocate<pipeline_rgb::vertex>(4);
+  vertices->set({
+      pipeline_rgb::vertex{{0, 0}, {1, 1, 1}},
+      pipeline_rgb::vertex{{0, 2}, {1, 1, 1}},
+      pipeline_rgb::vertex{{2, 0}, {1, 1, 1}},
+      pipeline_rgb::vertex{{2, 2}, {1, 1, 1}},
+  });
+  auto instances = b->allocate<pipeline_rgb::instance>(1);
+  instances->set(pipeline_rgb::instance{make_transform_mat4({0, 0}, {1, 1, 1})});
+
+  auto ubo = b->allocate<proj_ubo>(1, d.ubo_align());
+  ubo->set(proj_ubo{iparams.size_});
+  rgb_pipeline->write(0, ubo);
+
+  d.flush_staged();  // staging has to be explicitly flushed in offscreen mode
+
+  // First frame is still being read back while the second is drawn
+  ofs.draw([&](VkCommandBuffer _cb) { rgb_pipeline->draw(_cb, 0, indices, instances, vertices); });
+  auto first = ofs.download_async();
+  instances->set(pipeline_rgb::instance{make_transform_mat4({2, 2}, {1, 1, 1})});
+  d.flush_staged();
+  ofs.draw([&](VkCommandBuffer _cb) { rgb_pipeline->draw(_cb, 0, indices, instances, vertices); });
+  auto second = ofs.download_async();
+
+  u8vec4_rgba first_data[4 * 4];
+  first->read(std::span<u8>(&first_data[0].x, sizeof(first_data)), 4 * sizeof(u8vec4_rgba));
+  u8vec4_rgba second_data[4 * 4];
+  second->wait();
+  EXPECT_TRUE(second->ready());
+  second->read(std::span<u8>(&second_data[0].x, sizeof(second_data)), 4 * sizeof(u8vec4_rgba));
+
+  u8vec4_rgba first_ref[4 * 4] = {
+      // clang-format off
+      W, W, C, C,
+      W, W, C, C,
+      C, C, C, C,
+      C, C, C, C,
+      // clang-format on
+  };
+  u8vec4_rgba second_ref[4 * 4] = {
+      // clang-format off
+      C, C, C, C,
+      C, C, C, C,
+      C, C, W, W,
+      C, C, W, W,
+      // clang-format on
+  };
+
+  dump(first_data, {0, 0, 4, 4});
+  dump(second_data, {0, 0, 4, 4});
+  EXPECT_TRUE(std::equal(std::begin(first_ref), std::end(first_ref), std::begin(first_data)));
+  EXPECT_TRUE(std::equal(std::begin(second_ref), std::end(second_ref), std::begin(second_data)));
+
+  // Slots and readback memory are recycled
+  first.reset();
+  second.reset();
+  auto third = ofs.download_async();
+  EXPECT_NO_THROW(third->wait());
+}
+
+TEST(offscreen, atlas_compact) {
+  display d("atlas_compact");
+
+  image_params params;
+  params.size_   = {16, 16};
+  params.format_ = VK_FORMAT_R8G8B8A8_UNORM;
+  params.usage_ |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  auto a = std::make_shared<atlas>(d, params);
+
+  // 6*6 sub-images are padded to 7*7, four fill the first page and the fifth opens a second one
+  std::vector<shared_subimage> subs;
+  std::vector<u8vec4_rgba>     colors;
+  for (u8 i = 0; i < 5; i++) {
+    colors.emplace_back(u8vec4_rgba{u8(50 * i), 0, 255, 255});
+    std::vector<u8vec4_rgba> pixels(6 * 6, colors.back());
+    subs.emplace_back(a->pack({6, 6}, std::span<const u8>(&pixels[0].x, pixels.size() * sizeof(u8vec4_rgba)),
+                              6 * sizeof(u8vec4_rgba)));
+  }
+  ASSERT_EQ(a->page_count(), 2u);
+  for (uint i = 1; i < 4; i++)
+    subs[i].reset();
+
+  const auto generation = a->generation();
+  ASSERT_TRUE(a->compact());
+  EXPECT_EQ(a->page_count(), 1u);
+  EXPECT_NE(a->generation(), generation);
+  EXPECT_FALSE(a->compact());
+
+  d.flush_staged();  // staging has to be explicitly flushed in offscreen mode
+  auto ofs = offscreen(a->page(0));
+
+  u8vec4_rgba pixel_data[16 * 16];
+  ofs.download(std::span<u8>(&pixel_data[0].x, sizeof(pixel_data)), 16 * sizeof(u8vec4_rgba),
+               image::subresource{{0, 0, 16, 16}});
+
+  // Relocated sub-images keep their texels, where their new texcoords point to
+  for (uint i : {0u, 4u}) {
+    ASSERT_TRUE(subs[i]->valid());
+    EXPECT_EQ(subs[i]->page(), 0u);
+    const uvec4 texels = uvec4(subs[i]->texcoords() * 16.f);
+    EXPECT_EQ(texels.z - texels.x, 6u);
+    EXPECT_EQ(texels.w - texels.y, 6u);
+    for (uint y = texels.y; y < texels.w; y++) {
+      for (uint x = texels.x; x < texels.z; x++)
+        EXPECT_EQ(pixel_data[16 * y + x], colors[i]);
+    }
+  }
+}
@@ -2,5 +2,272 @@
 
 #include "hut/utils/binpacks.hpp"
 
+using namespace hut::binpack;
+
 TEST(binpacks, linear1d) {
+  linear1d<uint> linear(100);
+  EXPECT_TRUE(linear.empty());
+
+  // Blocks are rounded up to the alignment, and so is the allocated size
+  auto a = linear.pack(10, 16);
+  auto b = linear.pack(8, 16);
+  ASSERT_TRUE(a && b);
+  EXPECT_EQ(0, *a);
+  EXPECT_EQ(16, *b);
+  EXPECT_EQ(32, linear.allocated());
+  EXPECT_EQ(68, linear.free());
+
+  linear.offer(*a);
+  EXPECT_EQ(16, linear.allocated());
+  linear.offer(*b);
+  EXPECT_EQ(0, linear.allocated());
+  EXPECT_TRUE(linear.empty());
+}
+
+TEST(binpacks, ring1d) {
+  ring1d<uint> ring(100);
+  EXPECT_EQ(100, ring.capacity());
+  EXPECT_TRUE(ring.empty());
+
+  auto a = ring.pack(40);
+  auto b = ring.pack(30, 16);
+  ASSERT_TRUE(a && b);
+  EXPECT_EQ(0, *a);
+  EXPECT_EQ(48, *b);
+  EXPECT_EQ(78, ring.allocated());
+  EXPECT_FALSE(ring.pack(40));
+
+  // Space is only reclaimed from the oldest allocation
+  ring.offer(*b);
+  EXPECT_EQ(78, ring.allocated());
+  ring.offer(*a);
+  EXPECT_TRUE(ring.empty());
+  EXPECT_EQ(0, ring.allocated());
+  EXPECT_EQ(78, ring.high_water());
+}
+
+TEST(binpacks, ring1d_wrap) {
+  ring1d<uint> ring(100);
+  auto         a = ring.pack(60);
+  auto         b = ring.pack(30);
+  ASSERT_TRUE(a && b);
+  ring.offer(*a);
+
+  // Doesn't fit in the 10 bytes left at the end, wraps to the start
+  auto c = ring.pack(50);
+  ASSERT_TRUE(c);
+  EXPECT_EQ(0, *c);
+  EXPECT_EQ(90, ring.allocated());
+  EXPECT_FALSE(ring.try_fit(20));
+  EXPECT_TRUE(ring.try_fit(10));
+
+  ring.offer(*b);
+  EXPECT_EQ(50, ring.allocated());
+  EXPECT_TRUE(ring.try_fit(50));
+  ring.offer(*c);
+  EXPECT_TRUE(ring.empty());
+}
+
+TEST(binpacks, ring1d_shared) {
+  ring1d<uint> ring(100);
+  auto         shared = ring.pack_shared(40);
+  auto         after  = ring.pack(20);
+  ASSERT_TRUE(shared && after);
+  EXPECT_EQ(60, ring.allocated());
+
+  // Sub-allocations may be offered before the block is closed
+  ring.offer(*shared + 8);
+  ring.offer(*after);
+  EXPECT_EQ(60, ring.allocated());
+  ring.close(*shared, 2);
+  EXPECT_EQ(60, ring.allocated());
+  ring.offer(*shared + 24);
+  EXPECT_TRUE(ring.empty());
+}
+
+TEST(binpacks, tlsf1d) {
+  tlsf1d<uint> tlsf(100);
+  auto         a = tlsf.pack(10);
+  auto         b = tlsf.pack(3, 8);
+  auto         c = tlsf.pack(20);
+  ASSERT_TRUE(a && b && c);
+  EXPECT_EQ(0, *b % 8);
+  EXPECT_EQ(33, tlsf.allocated());
+  EXPECT_EQ(0, tlsf.lower_bound());
+
+  tlsf.offer(*a);
+  EXPECT_EQ(*b, tlsf.lower_bound());
+  tlsf.offer(*c);
+  EXPECT_EQ(*b + 3, tlsf.upper_bound());
+
+  // Whole pool is available again once everything is offered and merged
+  tlsf.offer(*b);
+  EXPECT_TRUE(tlsf.empty());
+  EXPECT_EQ(0, tlsf.allocated());
+  auto all = tlsf.pack(100);
+  ASSERT_TRUE(all);
+  EXPECT_EQ(0, *all);
+  EXPECT_FALSE(tlsf.try_fit(1));
+}
+
+TEST(binpacks, tlsf1d_reuse) {
+  tlsf1d<uint>      tlsf(1000);
+  std::vector<uint> offsets;
+  for (uint i = 0; i < 100; i++) {
+    auto fit = tlsf.pack(10);
+    ASSERT_TRUE(fit);
+    offsets.emplace_back(*fit);
+  }
+  EXPECT_FALSE(tlsf.try_fit(1));
+
+  // Offer every other block, holes can be reused but not merged
+  for (uint i = 0; i < offsets.size(); i += 2)
+    tlsf.offer(offsets[i]);
+  EXPECT_EQ(500, tlsf.allocated());
+  EXPECT_FALSE(tlsf.try_fit(11));
+  EXPECT_TRUE(tlsf.try_fit(10));
+
+  for (uint i = 1; i < offsets.size(); i += 2)
+    tlsf.offer(offsets[i]);
+  EXPECT_TRUE(tlsf.empty());
+  EXPECT_TRUE(tlsf.try_fit(1000));
+
+  uint blocks = 0;
+  tlsf.visit_blocks([&blocks](const auto &_block) {
+    EXPECT_FALSE(_block.used_);
+    blocks++;
+    return true;
+  });
+  EXPECT_EQ(1, blocks);
+}
+
+TEST(binpacks, dynamic1d) {
+  for (auto packer : {PLINEAR1D, PTLSF1D}) {
+    dynamic1d<uint> dynamic(packer, 64);
+    auto            a = dynamic.pack(32);
+    auto            b = dynamic.pack(32);
+    ASSERT_TRUE(a && b);
+    EXPECT_EQ(64, dynamic.allocated());
+    EXPECT_FALSE(dynamic.try_fit(1));
+    dynamic.offer(*a);
+    dynamic.offer(*b);
+    EXPECT_TRUE(dynamic.empty());
+  }
+}
+
+TEST(binpacks, shelve) {
+  using packer_t = shelve<hut::u16, shelve_separator_align<hut::u16, 8>>;
+  packer_t packer({64, 64});
+  EXPECT_TRUE(packer.empty());
+
+  // Same height class, shares a row
+  auto a = packer.pack({40, 5});
+  auto b = packer.pack({24, 8});
+  ASSERT_TRUE(a && b);
+  EXPECT_EQ(0, a->y);
+  EXPECT_EQ(0, b->y);
+  EXPECT_EQ(40, b->x);
+
+  // The first row is full, a new one is opened
+  auto c = packer.pack({8, 3});
+  ASSERT_TRUE(c);
+  EXPECT_EQ(8, c->y);
+
+  // Other height classes get their own rows
+  auto d = packer.pack({64, 16});
+  ASSERT_TRUE(d);
+  EXPECT_EQ(16, d->y);
+  EXPECT_FALSE(packer.pack({65, 1}));
+
+  // Freed spans are merged and reused in place
+  packer.offer(*a);
+  auto e = packer.pack({16, 8});
+  auto f = packer.pack({24, 8});
+  ASSERT_TRUE(e && f);
+  EXPECT_EQ(0, e->x);
+  EXPECT_EQ(16, f->x);
+  EXPECT_EQ(0, f->y);
+
+  // Rows are released once empty
+  for (const auto &rect : {*b, *c, *d, *e, *f})
+    packer.offer(rect);
+  EXPECT_TRUE(packer.empty());
+  EXPECT_TRUE(packer.rows_by_y_.empty());
+  auto g = packer.pack({64, 64});
+  ASSERT_TRUE(g);
+  EXPECT_EQ(0, g->y);
+}
+
+TEST(binpacks, skyline) {
+  skyline<hut::u16> packer({64, 64});
+  EXPECT_TRUE(packer.empty());
+
+  // Rects go where their bottom edge is the lowest
+  auto a = packer.pack({40, 10});
+  auto b = packer.pack({24, 4});
+  ASSERT_TRUE(a && b);
+  EXPECT_EQ(0, a->y);
+  EXPECT_EQ(40, b->x);
+  EXPECT_EQ(0, b->y);
+  auto c = packer.pack({24, 6});
+  ASSERT_TRUE(c);
+  EXPECT_EQ(40, c->x);
+  EXPECT_EQ(4, c->y);
+  EXPECT_FALSE(packer.pack({65, 1}));
+
+  // Freeing the highest rect lowers the skyline back
+  auto d = packer.pack({64, 54});
+  ASSERT_TRUE(d);
+  EXPECT_EQ(10, d->y);
+  EXPECT_FALSE(packer.pack({1, 1}));
+  packer.offer(*d);
+  auto e = packer.pack({64, 54});
+  ASSERT_TRUE(e);
+  EXPECT_EQ(10, e->y);
+
+  for (const auto &rect : {*a, *b, *c, *e})
+    packer.offer(rect);
+  EXPECT_TRUE(packer.empty());
+  EXPECT_EQ(1, packer.segments_.size());
+}
+
+TEST(binpacks, maxrects) {
+  maxrects<hut::u16> packer({64, 64});
+
+  // Mixed sizes fill the page without row waste
+  auto a = packer.pack({32, 20});
+  auto b = packer.pack({32, 44});
+  auto c = packer.pack({32, 44});
+  auto d = packer.pack({32, 20});
+  ASSERT_TRUE(a && b && c && d);
+  EXPECT_FALSE(packer.pack({1, 1}));
+
+  // A freed rect is reused, and merged with its free neighbours
+  packer.offer(*a);
+  packer.offer(*d);
+  auto e = packer.pack({32, 20});
+  ASSERT_TRUE(e);
+  EXPECT_EQ(*a, *e);
+  packer.offer(*e);
+  packer.offer(*c);
+  auto f = packer.pack({32, 64});
+  ASSERT_TRUE(f);
+
+  for (const auto &rect : {*b, *f})
+    packer.offer(rect);
+  EXPECT_TRUE(packer.empty());
+  EXPECT_EQ(1, packer.free_.size());
+}
+
+TEST(binpacks, dynamic2d) {
+  for (auto packer : {PSHELVE2D, PSKYLINE2D, PMAXRECTS2D}) {
+    dynamic2d<hut::u16> dynamic(packer, {64, 64});
+    auto                a = dynamic.pack({64, 32});
+    auto                b = dynamic.pack({64, 32});
+    ASSERT_TRUE(a && b);
+    EXPECT_FALSE(dynamic.pack({1, 1}));
+    dynamic.offer(*a);
+    dynamic.offer(*b);
+    EXPECT_TRUE(dynamic.empty());
+  }
 }